@@ -0,0 +1,329 @@
+/**
+ * @file bench.c
+ * @brief Throughput and latency benchmark for the OnlyFiles filesystem
+ *
+ * For every combination of file count and file size given on the command
+ * line, this program formats a fresh disk image and times each phase:
+ * 1. fs_create of every file
+ * 2. fs_write of every file
+ * 3. fs_read of every file (repeated -r times)
+ * 4. fs_list (repeated -r times)
+ * 5. fs_delete of every file
+ *
+ * Each phase reports ops/s, p50 and p99 latency, and the number of system
+ * calls on the disk image per operation, taken from fs_stats: reads, writes
+ * and syncs, plus io_uring submissions in FS_IO_URING builds.
+ *
+ * Usage: ./fs_bench [-n counts] [-s sizes] [-r rounds] [-m] [-w] [-d disk_path]
+ *   -n  comma-separated file counts (1 to MAX_FILES), default 32,256
+ *   -s  comma-separated file sizes in bytes (1 to MAX_FILE_SIZE), default 1,100,4096,49152
+ *   -r  number of read and list rounds, default 10
+ *   -m  mount with the mmap backend instead of pread (io_uring in FS_IO_URING builds)
+ *   -w  mount with FS_MOUNT_WRITE_BEHIND
+ *   -d  disk image to use, default bench.img
+ */
+
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONFIGS 16
+#ifdef FS_IO_URING
+#define PREAD_LABEL "io_uring" // The pread backend's I/O goes through io_uring
+#else
+#define PREAD_LABEL "pread"
+#endif
+#define MAX_FILE_SIZE ((MAX_BLOCKS - 14 - JOURNAL_BLOCKS) * BLOCK_SIZE) // data region minus the journal and a maximal file's 4 indirect blocks
+
+/**
+ * @brief Results of one timed phase
+ */
+typedef struct {
+    const char* name;  /**< Operation being measured */
+    long ops;          /**< Number of operations performed */
+    double total_ns;   /**< Sum of all latencies */
+    double p50_ns;     /**< Median latency */
+    double p99_ns;     /**< 99th percentile latency */
+    double syscalls;   /**< System calls on the disk image per operation */
+} phase_result;
+
+static double* latencies = NULL; // one entry per operation of the current phase
+static long latency_count = 0;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Counts the system calls made on the disk image so far
+ *
+ * /proc/self/io would miss io_uring_enter, so the filesystem's own counters
+ * are used; reading them makes no system call of its own.
+ *
+ * @return Reads, writes, syncs and io_uring submissions, or -1 on error
+ */
+static long syscall_count()
+{
+    fs_counters c;
+    if (fs_stats(&c) != 0) {
+        return -1;
+    }
+    return (long)(c.read_syscalls + c.write_syscalls + c.sync_syscalls + c.uring_submits);
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Summarizes the latencies collected for a phase
+ *
+ * The syscall counter is read once before and once after the phase.
+ */
+static phase_result finish_phase(const char* name, long syscalls_before)
+{
+    long syscalls_after = syscall_count();
+    phase_result r;
+    r.name = name;
+    r.ops = latency_count;
+    r.total_ns = 0;
+    for (long i = 0; i < latency_count; i++) {
+        r.total_ns += latencies[i];
+    }
+    qsort(latencies, latency_count, sizeof(double), compare_double);
+    r.p50_ns = latency_count > 0 ? latencies[latency_count / 2] : 0;
+    r.p99_ns = latency_count > 0 ? latencies[(latency_count * 99) / 100] : 0;
+    if (syscalls_before < 0 || syscalls_after < 0 || latency_count == 0) {
+        r.syscalls = -1;
+    } else {
+        r.syscalls = (double)(syscalls_after - syscalls_before) / latency_count;
+    }
+    latency_count = 0;
+    return r;
+}
+
+static void print_result(const phase_result* r)
+{
+    double ops_per_sec = r->total_ns > 0 ? r->ops / (r->total_ns / 1e9) : 0;
+    if (r->syscalls < 0) {
+        printf("  %-10s %8ld ops %12.0f ops/s  p50 %9.0f ns  p99 %9.0f ns  syscalls/op    n/a\n",
+               r->name, r->ops, ops_per_sec, r->p50_ns, r->p99_ns);
+    } else {
+        printf("  %-10s %8ld ops %12.0f ops/s  p50 %9.0f ns  p99 %9.0f ns  syscalls/op %6.2f\n",
+               r->name, r->ops, ops_per_sec, r->p50_ns, r->p99_ns, r->syscalls);
+    }
+}
+
+static int parse_list(const char* arg, int* out, int max)
+{
+    int count = 0;
+    char* copy = strdup(arg);
+    for (char* tok = strtok(copy, ","); tok != NULL && count < max; tok = strtok(NULL, ",")) {
+        out[count++] = atoi(tok);
+    }
+    free(copy);
+    return count;
+}
+
+static void fail(const char* what, int code)
+{
+    fprintf(stderr, "Benchmark failed: %s (code: %d)\n", what, code);
+    exit(1);
+}
+
+/**
+ * @brief Runs every phase for one file count and file size
+ */
+static void run_config(const char* disk_path, int mode, int num_files, int file_size, int rounds)
+{
+    static char data[MAX_FILE_SIZE];
+    static char buffer[MAX_FILE_SIZE];
+    static char names[MAX_FILES][MAX_FILENAME];
+    static char listing[MAX_FILES][MAX_FILENAME];
+
+    for (int i = 0; i < file_size; i++) {
+        data[i] = 'a' + i % 26;
+    }
+    for (int i = 0; i < num_files; i++) {
+        snprintf(names[i], MAX_FILENAME, "bench_%d.dat", i);
+    }
+
+    int blocks_per_file = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks_per_file > MAX_DIRECT_BLOCKS) {
+        blocks_per_file += 2 + blocks_per_file / BLOCK_POINTERS; // indirect blocks, rounded up
+    }
+    if (num_files * blocks_per_file > MAX_BLOCKS - 10 - JOURNAL_BLOCKS) {
+        printf("%d files x %d bytes: skipped, does not fit on the disk\n\n", num_files, file_size);
+        return;
+    }
+
+    if (fs_format(disk_path) != 0) {
+        fail("fs_format", -1);
+    }
+    if (fs_mount_mode(disk_path, mode) != 0) {
+        fail("fs_mount_mode", -1);
+    }
+
+    printf("%d files x %d bytes (%s backend%s)\n", num_files, file_size,
+           (mode & ~FS_MOUNT_WRITE_BEHIND) == FS_MOUNT_MMAP ? "mmap" : PREAD_LABEL,
+           (mode & FS_MOUNT_WRITE_BEHIND) ? ", write-behind" : "");
+
+    phase_result r;
+    long before;
+    int result;
+
+    before = syscall_count();
+    for (int i = 0; i < num_files; i++) {
+        double t = now_ns();
+        result = fs_create(names[i]);
+        latencies[latency_count++] = now_ns() - t;
+        if (result != 0) {
+            fail("fs_create", result);
+        }
+    }
+    r = finish_phase("fs_create", before);
+    print_result(&r);
+
+    before = syscall_count();
+    for (int i = 0; i < num_files; i++) {
+        double t = now_ns();
+        result = fs_write(names[i], data, file_size);
+        latencies[latency_count++] = now_ns() - t;
+        if (result != 0) {
+            fail("fs_write", result);
+        }
+    }
+    r = finish_phase("fs_write", before);
+    print_result(&r);
+
+    before = syscall_count();
+    double t = now_ns();
+    result = fs_sync();
+    latencies[latency_count++] = now_ns() - t;
+    if (result != 0) {
+        fail("fs_sync", result);
+    }
+    r = finish_phase("fs_sync", before);
+    print_result(&r);
+
+    before = syscall_count();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < num_files; i++) {
+            double t = now_ns();
+            result = fs_read(names[i], buffer, sizeof(buffer));
+            latencies[latency_count++] = now_ns() - t;
+            if (result != file_size) {
+                fail("fs_read", result);
+            }
+        }
+    }
+    r = finish_phase("fs_read", before);
+    print_result(&r);
+    if (memcmp(buffer, data, file_size) != 0) {
+        fail("fs_read returned the wrong content", 0);
+    }
+
+    before = syscall_count();
+    for (int round = 0; round < rounds; round++) {
+        double t = now_ns();
+        result = fs_list(listing, MAX_FILES);
+        latencies[latency_count++] = now_ns() - t;
+        if (result != num_files) {
+            fail("fs_list", result);
+        }
+    }
+    r = finish_phase("fs_list", before);
+    print_result(&r);
+
+    before = syscall_count();
+    for (int i = 0; i < num_files; i++) {
+        double t = now_ns();
+        result = fs_delete(names[i]);
+        latencies[latency_count++] = now_ns() - t;
+        if (result != 0) {
+            fail("fs_delete", result);
+        }
+    }
+    r = finish_phase("fs_delete", before);
+    print_result(&r);
+
+    fs_unmount();
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int counts[MAX_CONFIGS] = { 32, 256 };
+    int sizes[MAX_CONFIGS] = { 1, 100, 4096, MAX_DIRECT_BLOCKS * BLOCK_SIZE };
+    int num_counts = 2, num_sizes = 4;
+    int rounds = 10;
+    int mode = FS_MOUNT_PREAD;
+    int flags = 0;
+    const char* disk_path = "bench.img";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:r:mwd:")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_counts = parse_list(optarg, counts, MAX_CONFIGS);
+            break;
+        case 's':
+            num_sizes = parse_list(optarg, sizes, MAX_CONFIGS);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'm':
+            mode = FS_MOUNT_MMAP;
+            break;
+        case 'w':
+            flags = FS_MOUNT_WRITE_BEHIND;
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n counts] [-s sizes] [-r rounds] [-m] [-w] [-d disk_path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < num_counts; i++) {
+        if (counts[i] < 1 || counts[i] > MAX_FILES) {
+            fprintf(stderr, "File count %d must be between 1 and %d.\n", counts[i], MAX_FILES);
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_sizes; i++) {
+        if (sizes[i] < 1 || sizes[i] > MAX_FILE_SIZE) {
+            fprintf(stderr, "File size %d must be between 1 and %d.\n", sizes[i], MAX_FILE_SIZE);
+            return 1;
+        }
+    }
+    if (rounds < 1) {
+        rounds = 1;
+    }
+
+    latencies = malloc(sizeof(double) * MAX_FILES * rounds + sizeof(double) * MAX_FILES);
+    if (latencies == NULL) {
+        fail("out of memory", -1);
+    }
+
+    for (int c = 0; c < num_counts; c++) {
+        for (int s = 0; s < num_sizes; s++) {
+            run_config(disk_path, mode | flags, counts[c], sizes[s], rounds);
+        }
+    }
+
+    free(latencies);
+    remove(disk_path);
+    return 0;
+}
@@ -1 +1 @@
-gcc fs.c main.c -o fs_main
+gcc -pthread fs.c main.c -o fs_main
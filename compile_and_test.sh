@@ -1,4 +1,11 @@
 set -e
 
-gcc fs.c testfilesystem.c -o test_fs
+gcc -pthread fs.c testfilesystem.c -o test_fs
 ./test_fs
+gcc -pthread -fsanitize=thread fs.c testfilesystem.c -o test_fs_tsan
+TSAN_OPTIONS="detect_deadlocks=0 halt_on_error=1" ./test_fs_tsan
+gcc -pthread -O2 fs.c bench.c -o fs_bench
+gcc -pthread -O2 -DFS_IO_URING fs.c bench.c -o fs_bench_uring
+gcc -pthread -O2 fs.c image.c -o fs_image
+gcc -pthread -O2 fs.c stress.c -o fs_stress
+./fs_stress -n 1000
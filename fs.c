@@ -1,120 +1,959 @@
+// Build with -DFS_IO_URING to do the pread backend's I/O through io_uring
+#if defined(FS_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#undef BLOCK_SIZE // linux/fs.h defines its own; fs.h, included next, sets ours
+#define HAVE_IO_URING 1
+#endif
+#endif
 #include "fs.h"
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+
 // Find an inode by filename
 int find_inode ( const char * filename ) ;
 
 // Find a free inode
 int find_free_inode () ;
 
-// Find a free block
-int find_free_block () ;
-
-// Mark a block as used
-void mark_block_used ( int block_num ) ;
+// Free several blocks under one acquisition of the allocator lock
+static void release_blocks ( const int * blocks , int count ) ;
 
-// Mark a block as free
-void mark_block_free ( int block_num ) ;
+// Reserve several free blocks at once, preferring a contiguous run
+int alloc_blocks ( int count , int hint , int * out ) ;
 
-// Read an inode from disk
+// Read an inode from the inode cache
 void read_inode ( int inode_num , inode * target ) ;
 
-// Write an inode to disk
+// Write an inode to the inode cache
 void write_inode ( int inode_num , const inode * source ) ;
 
+// Transfer an iovec array at a byte offset of the disk image
+int dev_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) ;
+
+// Transfer several iovec arrays, as one batch where the backend supports it
+struct io_run;
+static int dev_rw_runs ( struct io_run * runs , int count , bool is_write ) ;
+
+// Close the disk image and drop its mapping, if any
+void release_disk () ;
+
+// Mount an image into a context, for fs_mount_mode and fsc_mount
+static int mount_context ( fs_context * fs , const char * disk_path , int mode ) ;
+
+// Open and validate the image for fs_mount_mode (table_lock held exclusively)
+static int mount_image ( const char * disk_path , int mode ) ;
+
+// Write back and release a context's image, for fs_unmount and fsc_unmount
+static void unmount_context ( fs_context * fs ) ;
+
+// One commit for fs_sync: write back dirty data, then commit the metadata
+static int sync_commit () ;
+
+// Allocate and index an inode for a new empty file (table_lock held exclusively)
+static int create_inode ( const char * filename ) ;
+
+// Free a file's blocks and inode (table_lock held exclusively)
+static void delete_inode ( int inode_index ) ;
+
+// Replace a file's content (caller holds the inode lock exclusively)
+static int write_file_data ( int inode_index , const void * data , int size ) ;
+
+// Replace a file's content with data blocks (caller holds the inode lock exclusively)
+static int write_file_blocks ( int inode_index , const void * data , int size ) ;
+
+// Replace a file's content with its compressed form, or return 1 if that saves no block
+static int write_file_compressed ( int inode_index , const char * data , int size ) ;
+
+// Write a byte range of a file, growing it if needed (caller holds the inode lock exclusively)
+static int write_file_range ( int inode_index , const char * data , int size , int offset ) ;
+
+// Copy a byte range of a file out (caller holds the inode lock, or the snapshot's)
+static int read_file_range ( const inode * node , char * buffer , int size , int offset , const int * map ) ;
+
+// Copy a byte range of a compressed file out, see read_file_range
+static int read_compressed_range ( const inode * node , char * buffer , int offset , int to_read , const int * map ) ;
+
+// Note a read of a file about to happen and read ahead while its reads are sequential
+static void read_ahead ( int inode_index , int offset , int size ) ;
+
+// Compress with the LZ4 block format; returns 0 if the result exceeds capacity
+static int lz4_compress ( const char * src , int size , char * dst , int capacity ) ;
+
+// Decompress an LZ4 block up to capacity bytes; returns the length produced, or -1 if corrupt
+static int lz4_decompress ( const char * src , int size , char * dst , int capacity ) ;
+
+// Lock an open handle and its inode (shared or exclusive)
+struct open_file;
+static int lock_handle ( int fd , bool exclusive , struct open_file ** out ) ;
+
+// Release the locks taken by lock_handle
+static void unlock_handle ( struct open_file * h ) ;
+
+// Give a file exactly blocks_needed data blocks plus their pointer blocks
+static int resize_file_blocks ( const inode * node , int blocks_needed , int * map , int * meta , int rewrite_from , int rewrite_to ) ;
+
+// Store a file's new block list and size in its inode
+static int commit_file_blocks ( int inode_index , const int * map , int blocks_needed , const int * meta , int size , bool remapped ) ;
+
+// Store a file's content in its inode, which then owns no blocks
+static void commit_file_inline ( int inode_index , const char * data , int size ) ;
+
+// Number of runs of consecutive blocks in a block list
+static int count_extents ( const int * blocks , int count ) ;
+
+// Check that an inode in use has a valid kind and a size that fits it
+static bool inode_valid ( const inode * node ) ;
+
+// Set up a context with nothing mounted, and tear it down again
+static void context_init ( fs_context * fs ) ;
+static void context_destroy ( fs_context * fs ) ;
+
+// The context of the fs_* calls
+static fs_context * default_fs () ;
+
+// Resolve a filename and lock its inode (shared or exclusive)
+int lookup_and_lock ( const char * filename , bool exclusive ) ;
+
+// Lock every inode shared, so that no write is in flight, or exclusively,
+// so that no read is either, and unlock them again
+void lock_all_inodes () ;
+void lock_all_inodes_exclusive () ;
+void unlock_all_inodes () ;
+
+// Transfer blocks that each have their own buffer
+int transfer_blocks ( const int * blocks , struct iovec * iov , int count , bool is_write ) ;
+
+// Number of indirect blocks a file of nblocks data blocks needs
+static int pointer_blocks_for ( int nblocks ) ;
+
+// Collect the first count data blocks of a file, and its indirect blocks
+static int map_file_blocks ( const inode * node , int count , int * data , int * meta ) ;
+
+// Check that every block in a list is a data block
+static bool blocks_valid ( const int * blocks , int count ) ;
+
+// Write the indirect blocks describing a file's block list
+static int store_pointer_blocks ( const int * data , int count , const int * meta ) ;
+
+// Reset the block cache to empty
+void bcache_reset () ;
+
+// Read a file's blocks through the block cache
+int cached_read ( const int * blocks , int count , char * dst , int size ) ;
+
+// Write a file's blocks into the block cache
+int cached_write ( const int * blocks , int count , const char * src , int size ) ;
+
+// Drop a freed block from the block cache without writing it back
+void bcache_forget ( int block_num ) ;
+
+// Write every dirty cached block back to the disk image
+int bcache_flush () ;
+
+// Start or stop the write-behind flusher thread
+static void start_flusher () ;
+static void stop_flusher () ;
+
+// Queue a request for the read-ahead thread, starting it on first use
+struct readahead_request;
+static bool readahead_queue ( const struct readahead_request * req ) ;
+
+// Stop the read-ahead thread once it has served its pending requests
+static void stop_readahead () ;
+
+// Claim cache buffers for blocks a sequential reader will want
+static int bcache_reserve ( const int * blocks , int count , int demand , int * bufs , int * io_blocks ) ;
+
+// Read the blocks claimed by bcache_reserve into their buffers
+static void bcache_fill ( const int * bufs , const int * blocks , int count ) ;
+
+// Load the superblock, bitmap and inode table into memory
+int load_metadata () ;
+
+// Write dirty cached metadata back to disk
+int flush_metadata () ;
+
+// Make the dirty metadata durable, through the journal when there is one
+static int commit_metadata () ;
+
+// Replay the newest committed journal transaction into place
+static int journal_replay ( bool clear ) ;
+
+// CRC-32 (IEEE) of a buffer, continuing from crc
+static uint32_t crc32_update ( uint32_t crc , const void * data , size_t len ) ;
+
+// Checksum of the superblock (without its checksum field), bitmap and inode table
+static uint32_t metadata_checksum ( const superblock * sb , const void * bitmap , const inode * inodes ) ;
+
+// Fill in a fresh superblock for a geometry (see fs_format_geometry)
+static int plan_layout ( superblock * sb , int total_blocks , int total_inodes , int block_size ) ;
+
+// Derive the in-memory geometry from a superblock
+struct geometry;
+static int read_geometry ( const superblock * sb , struct geometry * g ) ;
+
+// Bytes a journal slot needs for a transaction rewriting all of sb's metadata
+static size_t journal_slot_need ( const superblock * sb ) ;
+
+// Byte offset of a journal slot in the image
+static off_t journal_slot_offset ( const struct geometry * g , int slot ) ;
+
+// Allocate everything a mount sizes by the image's geometry
+static int mount_alloc ( bool mapped ) ;
+
+// Entries of a scratch block list, growing it to count (see BLOCK_LIST)
+struct block_list;
+static int * block_list_reserve ( struct block_list * list , int count ) ;
+
+// Room for resize_file_blocks: a file's block list and pointer block list
+static int * resize_lists ( struct block_list * list , const inode * node , int blocks_needed , int ** meta ) ;
+
+// Record a clean unmount in the superblock
+static int mark_clean () ;
+
+// Count the inconsistencies between the inodes, the bitmap and the free totals
+static int check_metadata () ;
+
+// Record that an inode changed, so its inode table block gets written back
+void mark_inode_dirty ( int inode_num ) ;
+
+// Find the next run of dirty inode table blocks
+static bool next_dirty_run ( int * k , int * end ) ;
+
+// Record that a block's bitmap bit changed (alloc_lock held)
+void mark_bitmap_dirty ( int block_num ) ;
+
+// Rebuild the filename index from the inode cache
+void build_name_index () ;
 
-int static disk_fd = -1; // file descriptor for the disk image file
-bool is_mounted = false; // Flag to check if the filesystem is mounted;
+// Add an inode to the filename index
+void index_insert ( int inode_num ) ;
+
+// Remove an inode from the filename index
+void index_remove ( int inode_num ) ;
+
+// Order two inode slots by file name, for qsort
+static int compare_names ( const void * a , const void * b ) ;
+
+// Bring the name-ordered list of indexed inodes up to date (sorted_lock held)
+static void sort_names () ;
+
+// First position of the name-ordered list past after and not before prefix
+static int sorted_position ( const char * after , const char * prefix ) ;
+
+// Collect the next used inode slots whose names match prefix, in slot order
+static int collect_slots ( const uint64_t * used_map , const inode * table , const char * prefix , fs_list_cursor * cursor , fs_dirent * entries , int max_entries ) ;
+
+// Find a file in a snapshot's copy of the filename index
+struct snapshot;
+static int snapshot_find ( const struct snapshot * snap , const char * filename ) ;
+
+// Free a snapshot's copies of the metadata
+static void free_snapshot ( struct snapshot * snap ) ;
+
+// Count the files sharing each data block, and set up the dedup index if wanted
+static int setup_block_refs ( bool want_index ) ;
+
+// Hash a block's content for the dedup index
+static uint64_t block_hash ( const char * block ) ;
+
+// Share a stored block with the same content, or return -1
+static int dedup_share ( uint64_t hash , const char * block ) ;
+
+// Write blocks from to to - 1 of a file's data and add the full ones to the dedup index
+static int dedup_store ( const int * map , int from , int to , const char * data , int size , const uint64_t * hashes ) ;
+
+// Write a file's data, sharing the blocks whose content is already stored
+static int dedup_write ( int * map , int count , const char * data , int size ) ;
+
+// Free blocks that no other file shares
+static void free_block_list ( const int * blocks , int count ) ;
+
+// Add n to one of the calling thread's counters (see STAT)
+static void stat_add ( size_t slot , unsigned long long n ) ;
+
+// Monotonic clock in nanoseconds, for the per-operation timers
+static unsigned long long stat_clock () ;
+
+
+// Disk layout (see fs_format_geometry). The superblock is always block 0,
+// followed by the bitmap and the inode table, each rounded up to whole
+// blocks, then the data region, which begins with the journal. Everything
+// else comes from the mounted image's superblock: the names below are the
+// current context's geometry, while MAX_BLOCKS, MAX_FILES and BLOCK_SIZE
+// in fs.h are only fs_format's defaults.
+struct geometry {
+    int total_blocks;
+    int total_inodes;
+    int block_size;
+    int bitmap_start, bitmap_blocks;
+    int inode_table_start, inode_table_blocks;
+    int data_start;
+    int journal_start, journal_blocks; // 0 blocks on images without a journal
+    int file_blocks; // most blocks one file can own
+};
+#define SUPERBLOCK_BLOCK 0
+#define DISK_BLOCKS (ctx->geo.total_blocks)
+#define DISK_INODES (ctx->geo.total_inodes)
+#define DISK_BLOCK_SIZE (ctx->geo.block_size)
+#define DISK_POINTERS (DISK_BLOCK_SIZE / (int)sizeof(int)) // block indices held by one indirect block
+#define BITMAP_BLOCK (ctx->geo.bitmap_start)
+#define INODE_TABLE_BLOCK (ctx->geo.inode_table_start)
+#define DATA_START_BLOCK (ctx->geo.data_start)
+#define DISK_SIZE ((off_t)DISK_BLOCKS * DISK_BLOCK_SIZE)
+#define BITMAP_BYTES (DISK_BLOCKS / 8)
+#define INODE_TABLE_BYTES ((size_t)DISK_INODES * sizeof(inode))
+#define INODE_TABLE_BLOCKS (ctx->geo.inode_table_blocks)
+
+// Geometries fs_format_geometry accepts. Block and inode counts are whole
+// bitmap words; the limits keep every byte offset within a file in an int
+// and the per-mount metadata (about 250 bytes per inode) in the tens of MB.
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define GEOMETRY_MAX_BLOCKS (1 << 24)
+#define GEOMETRY_MAX_INODES (1 << 18)
+#define LEGACY_DATA_START 10 // images from before the layout fields, and the smallest data_start
+
+// Block addressing beyond the direct blocks. Logical block i of a file is
+// blocks[i] for i < 12, then entry i - 12 of the indirect block, then
+// entry j % P of the j / P-th block listed in the double indirect block,
+// with j = i - 12 - P and P = DISK_POINTERS (1024 with 4KB blocks). The
+// indirect blocks of a file are its "pointer blocks", kept in the fixed
+// order indirect, double indirect, then the double indirect block's
+// children (see map_file_blocks).
+#define DATA_BLOCKS (ctx->geo.file_blocks) // most blocks one file can own
+#define MAX_FILE_BYTES (DATA_BLOCKS * DISK_BLOCK_SIZE) // fits an int, see read_geometry
+#define INDIRECT_LIMIT (MAX_DIRECT_BLOCKS + DISK_POINTERS) // first block served by the double indirect block
+#define IO_BATCH_BLOCKS 64 // blocks per pass through the block cache
+
+// Scratch block lists, sized by the file at hand: up to BLOCK_LIST_LOCAL
+// entries live on the caller's stack, longer lists on the heap. Declared
+// with BLOCK_LIST, so the heap copy is freed on every return path.
+#define BLOCK_LIST_LOCAL 64
+struct block_list {
+    int* entries;
+    int capacity; // of entries
+    int local[BLOCK_LIST_LOCAL];
+};
+static void block_list_release ( struct block_list * list ) ;
+#define BLOCK_LIST(name) struct block_list name __attribute__((cleanup(block_list_release))) = { NULL }
+
+// Inline files (INODE_INLINE) keep their content where the block pointers
+// would be, and own no blocks at all. Compressed files (INODE_COMPRESSED)
+// own only the direct blocks their compressed data needs, and indirect
+// holds its length.
+#define INODE_KIND(node) ((node)->used & ~INODE_COMPRESS) // 1, INODE_INLINE or INODE_COMPRESSED
+#define INLINE_DATA(node) ((char*)(node)->blocks)
+#define STORED_BYTES(node) (INODE_KIND(node) == INODE_COMPRESSED ? (node)->indirect : (node)->size)
+#define FILE_BLOCKS(node) (INODE_KIND(node) == INODE_INLINE ? 0 : (STORED_BYTES(node) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE)
+#define COMPRESS_MAX_BYTES (64 * DISK_BLOCK_SIZE) // largest file stored compressed, as reads unpack it whole
+_Static_assert(offsetof(inode, double_indirect) + sizeof(int) - offsetof(inode, blocks) == INLINE_DATA_MAX,
+               "inline data must fill exactly the block pointers");
+
+// Metadata journal (see commit_metadata). fs_format_geometry reserves
+// journal_blocks data blocks, split into two slots that hold one
+// transaction each and are used in turn, so a torn commit never destroys
+// the previous transaction. A slot is large enough for a transaction that
+// rewrites all of the metadata (see journal_slot_need). A transaction is a
+// header followed by records, each an image byte range of the superblock,
+// bitmap or inode table with its new content.
+#define JOURNAL_MAGIC 0x4c4e524au // "JRNL"
+#define JOURNAL_SLOT_BLOCKS (ctx->geo.journal_blocks / 2)
+#define JOURNAL_SLOT_BYTES ((size_t)JOURNAL_SLOT_BLOCKS * DISK_BLOCK_SIZE)
+struct journal_header {
+    uint32_t magic;
+    uint32_t sequence; // one more than the previous transaction's
+    uint32_t length;   // bytes of records after the header
+    uint32_t checksum; // CRC-32 of the header, with this field zero, and the records
+};
+struct journal_record {
+    uint32_t offset; // byte offset in the image
+    uint32_t length; // bytes of content following the record
+};
+
+
+// Block device backend, chosen when mounting (see fs_mount_mode). rw_runs
+// transfers a batch of runs at once; backends without it get one rw call
+// per run.
+struct io_run {
+    off_t offset;
+    struct iovec* iov;
+    int iovcnt;
+};
+#define IO_RUNS_PER_BATCH 64 // runs handed to the backend at once
+struct block_backend {
+    const char* name;
+    int (*rw)(off_t offset, struct iovec* iov, int iovcnt, bool is_write);
+    int (*rw_runs)(struct io_run* runs, int count, bool is_write);
+};
+static int pread_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) ;
+static int mmap_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) ;
+static const struct block_backend pread_backend = { "pread", pread_rw, NULL };
+static const struct block_backend mmap_backend = { "mmap", mmap_rw, NULL };
+#ifdef HAVE_IO_URING
+// io_uring backend: the pread backend's replacement in FS_IO_URING builds.
+// Every thread submits through its own ring, so threads never contend on a
+// queue and each can keep a whole batch in flight.
+#define URING_DEPTH IO_RUNS_PER_BATCH
+struct uring_ring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    void* cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+};
+static int uring_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) ;
+static int uring_rw_runs ( struct io_run * runs , int count , bool is_write ) ;
+static struct uring_ring * ring_attach () ;
+static const struct block_backend uring_backend = { "io_uring", uring_rw, uring_rw_runs };
+static _Thread_local struct uring_ring* my_ring = NULL;
+static _Thread_local bool my_ring_failed = false; // setup failed, this thread uses preadv
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Write-back cache of data blocks between the fs_* calls and the backend,
+// keyed by block number with LRU eviction. The metadata blocks are
+// resident for the whole mount and never pass through it. The cache is off
+// for the mmap backend, where the page cache already plays this role.
+#define BCACHE_BUFFERS 256 // 1MB of cached blocks with 4KB blocks
+#define BUF_DATA(b) (ctx->bcache_data + (size_t)(b) * DISK_BLOCK_SIZE) // content of a buffer
+#define BCACHE_HASH_BUCKETS 512
+struct cache_buf {
+    int block;              // cached block, -1 if the buffer is unused
+    bool valid;             // data holds the block's content
+    bool dirty;             // data is newer than the disk image
+    bool busy;              // a fill or a writeback of this buffer is in flight
+    int refs;               // pins; a pinned buffer is never evicted
+    bool prefetched;        // filled by read-ahead (busy until done) and not read since
+    int hash_next;          // next buffer in the same hash bucket
+    int lru_prev, lru_next; // LRU list, most recently used first
+};
+
+// Write-behind (FS_MOUNT_WRITE_BEHIND). Writes only dirty cache buffers, and
+// a flusher thread writes them back in block order, so adjacent blocks go
+// out in one pwritev. It runs every FLUSH_INTERVAL_MS, or as soon as
+// FLUSH_THRESHOLD buffers are dirty. Guarded by bcache_lock.
+#define FLUSH_INTERVAL_MS 100
+#define FLUSH_THRESHOLD (BCACHE_BUFFERS / 4)
+
+// Read-ahead. Each read of a file is compared with where the previous one
+// ended; while they follow on, a window of the next blocks is kept in the
+// cache ahead of the reader, doubling from READAHEAD_MIN to READAHEAD_MAX
+// blocks, and any other access drops it back to nothing. The reader claims
+// the buffers itself, marked busy, so they are in the cache before they
+// are read: anyone else wanting those blocks waits for them instead of
+// reading them again. A sequential read of blocks nobody requested yet
+// fetches them together with the window in one preadv; after that the
+// window is topped up by a thread that starts with the first request, so
+// the reads overlap with the reader. With the mmap backend the kernel is
+// hinted instead (MADV_WILLNEED).
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX (BCACHE_BUFFERS / 8)
+#define READAHEAD_QUEUE 16 // requests waiting for the thread; more are dropped
+struct readahead {
+    _Atomic int next;   // block after the last read, where a sequential one starts
+    _Atomic int window; // blocks to keep ahead of the reader, 0 while access looks random
+    _Atomic int issued; // blocks up to here are already requested
+};
+struct readahead_request {
+    int count;
+    int bufs[IO_BATCH_BLOCKS]; // buffers claimed by bcache_reserve
+    int blocks[IO_BATCH_BLOCKS]; // and the blocks they are for
+};
+
+// Filename index over the inode cache: a chained hash keyed by filename with
+// the chains threaded through inode numbers, plus a bitmap of used inode
+// slots. Built by fs_mount, kept current by fs_create and fs_delete. The
+// bucket count is the power of two at or above twice the inode count.
+#define NAME_HASH_BUCKET(h) ((h) & ctx->name_hash_mask)
+
+// Open file handles (see fs_open). in_use is guarded by handles_lock and
+// only claims a slot; every other field is guarded by the slot's own lock,
+// which serializes the operations on one handle. Lock order: handle lock,
+// then table_lock, then inode lock.
+#define MAX_OPEN_FILES 64
+struct open_file {
+    bool in_use;
+    bool open;
+    pthread_mutex_t lock;
+    int inode;
+    unsigned generation; // inode_generation when opened
+    unsigned mount;      // mount_id when opened
+    int position;        // next byte for fs_hread / fs_hwrite
+    int* map;            // cached block list of the file, map_count entries
+    int map_count;
+    int map_capacity;    // entries allocated for map
+    unsigned map_version; // inode_version the cached list belongs to
+};
+
+// A frozen copy of the metadata (see fs_snapshot). Every block set in
+// bitmap holds one reference in snap_refs. Blocks with a reference are
+// pinned: a write moves a file off them (resize_file_blocks) instead of
+// overwriting them, and when a file lets go of one it is cleared in the
+// bitmap but stays out of the allocator's reach until the last snapshot
+// holding it is released. The on-disk bitmap thus only ever describes the
+// live files, and a crash simply loses the snapshots.
+struct snapshot {
+    bool active;
+    inode* inodes;      // the inode table
+    uint64_t* bitmap;   // the block bitmap
+    int* hash_head;     // the filename index
+    int* hash_next;
+    uint32_t* hash_value;
+    uint64_t* used_map;
+};
+
+// One entry of the dedup index: the last block written with this hash
+struct dedup_slot {
+    uint64_t hash;
+    int block; // -1 if empty
+};
+
+// Everything one mounted image needs. The fsc_* calls take a context from
+// fsc_mount; the fs_* calls use default_context. Contexts share nothing but
+// the statistics, so calls on different images never contend on a lock.
+struct fs_context {
+    int disk_fd; // file descriptor for the disk image file
+    bool is_mounted; // Flag to check if the filesystem is mounted;
+
+    // Geometry of the mounted image, from its superblock. Everything sized
+    // by it below is allocated by mount_alloc and freed by release_disk.
+    struct geometry geo;
+
+    // In-memory copy of the metadata, loaded once by fs_mount.
+    // All operations work against these; fs_sync / fs_unmount write them back.
+    superblock sb_buf;
+    uint64_t* bitmap_buf; // same bytes as on disk (little-endian words)
+    inode* inode_buf;
+
+    // The metadata every operation uses. With the pread backend these point at
+    // the buffers above; with the mmap backend they point into the mapped image.
+    superblock* sb_cache;
+    uint64_t* bitmap_cache;
+    inode* inode_cache;
+
+    const struct block_backend* backend;
+    char* disk_map; // whole image when mounted with FS_MOUNT_MMAP
+
+    // Metadata writeback granularity: the inode table is tracked per block
+    // and the bitmap as one range of dirty words, so a sync writes only the
+    // parts that changed instead of the whole table.
+    atomic_bool sb_dirty;
+    _Atomic uint64_t* inode_dirty; // bit k set = inode table block k changed
+    int bitmap_dirty_lo; // dirty words [lo, hi), guarded by alloc_lock
+    int bitmap_dirty_hi;
+    bool journal_enabled; // the image has a journal and the metadata is not mapped
+    uint32_t journal_sequence; // of the next transaction, guarded by table_lock
+    char* journal_buf; // one slot, when the image has a journal
+
+    // Group commit. Every fs_sync needs a commit that started after it was
+    // called; callers arriving while one is running wait and share the next.
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    unsigned long long sync_started, sync_done; // commits begun and finished
+    bool sync_running;
+    int sync_result; // of the last finished commit
+
+    // Locking. table_lock guards the mount state, the filename index and inode
+    // allocation: lookups hold it shared, fs_create / fs_delete / mount / sync
+    // hold it exclusive. Each inode's content has its own lock, which is always
+    // acquired while table_lock is still held, so the lock order is table_lock
+    // then inode lock. alloc_lock guards the block bitmap, the allocation cursor
+    // and free_blocks, which writers of different files share.
+    pthread_rwlock_t table_lock;
+    pthread_rwlock_t* inode_locks;
+    pthread_mutex_t alloc_lock;
+
+    // Block cache (see struct cache_buf)
+    struct cache_buf bcache[BCACHE_BUFFERS];
+    char* bcache_data; // BCACHE_BUFFERS blocks, see BUF_DATA
+    int bcache_hash[BCACHE_HASH_BUCKETS];
+    int lru_head, lru_tail;
+    bool bcache_enabled;
+    pthread_mutex_t bcache_lock;
+    pthread_cond_t bcache_cond; // a buffer stopped being busy
+    int bcache_dirty_count; // buffers with dirty set
+
+    // Write-behind flusher, guarded by bcache_lock
+    bool write_behind; // the flusher thread is running
+    bool flusher_stop;
+    pthread_t flusher_thread;
+    pthread_cond_t flusher_cond; // wakes the flusher early
+
+    // Read-ahead state per inode slot, and the queue of the read-ahead
+    // thread, guarded by ra_lock
+    struct readahead* readahead;
+    struct readahead_request ra_queue[READAHEAD_QUEUE];
+    int ra_head, ra_count;
+    bool ra_running, ra_stop;
+    pthread_t ra_thread;
+    pthread_mutex_t ra_lock;
+    pthread_cond_t ra_cond; // a request arrived, or ra_stop was set
+
+    // Filename index (see NAME_HASH_BUCKET)
+    int* name_hash_head; // first inode in each bucket, -1 if empty
+    uint32_t name_hash_mask; // buckets - 1
+    int* name_hash_next; // next inode in the same bucket, -1 at the end
+    uint32_t* name_hash_value; // full hash of each indexed name
+    uint64_t* inode_used_map; // bit set = inode slot in use
+
+    // Indexed inodes in name order, for sorted listings. Index changes only
+    // clear sorted_valid (table_lock is held exclusively then); the next
+    // sorted listing rebuilds the list under sorted_lock.
+    int* sorted_names;
+    int sorted_count;
+    bool sorted_valid;
+    pthread_mutex_t sorted_lock;
+
+    // Change counters per inode slot, guarded by the inode's lock.
+    // inode_generation moves on every fs_delete, so a handle can tell that its
+    // file is gone; inode_version moves whenever the file's block list changes,
+    // so a handle can tell that its cached copy of the list is stale.
+    unsigned* inode_generation;
+    unsigned* inode_version;
+
+    // Runs of consecutive data blocks of each file with indirect blocks, or
+    // -1 until fs_stat first maps the file. Written under the inode's lock
+    // held exclusively, or by fs_stat under a shared lock (hence atomic).
+    _Atomic int* inode_extents;
+
+    unsigned mount_id; // bumped by every mount; handles from older mounts are stale
+
+    // Snapshots. snap_refs and snap_pinned change only with table_lock held
+    // exclusively and every inode lock held, so a writer can test them under
+    // its inode lock; snap_lock keeps a snapshot alive while it is read.
+    // pinned_free counts the pinned blocks that are free in the bitmap
+    // (alloc_lock).
+    struct snapshot snapshots[FS_MAX_SNAPSHOTS];
+    int snapshot_count;
+    uint8_t* snap_refs; // snapshots holding each block
+    uint64_t* snap_pinned; // bit set = snap_refs nonzero
+    int pinned_free;
+    pthread_rwlock_t snap_lock;
+
+    // Deduplication. block_refs counts the other files sharing each data
+    // block, on images with shared_blocks set. With FS_MOUNT_DEDUP,
+    // dedup_table maps content hashes to blocks written since the mount.
+    // A block in the index (dedup_indexed) is never overwritten in place,
+    // so content compared once stays valid while the index holds it.
+    // dedup_lock guards block_refs, dedup_table and dedup_indexed.
+    bool dedup;
+    uint16_t* block_refs;
+    struct dedup_slot* dedup_table;
+    uint32_t dedup_mask; // slots - 1
+    uint64_t* dedup_indexed;
+    pthread_mutex_t dedup_lock;
+
+    // Open file handles (see struct open_file)
+    struct open_file open_files[MAX_OPEN_FILES];
+    pthread_mutex_t handles_lock;
+
+    // Next-fit cursor for alloc_blocks: the search resumes after the last allocation
+    int alloc_cursor;
+};
+
+// The context of the fs_* call this thread is in, set on entry by
+// USE_CONTEXT and restored on return. The flusher thread sets its own.
+static _Thread_local fs_context* ctx = NULL;
+static void context_leave ( fs_context ** saved ) ;
+#define USE_CONTEXT(c) fs_context* context_saved __attribute__((cleanup(context_leave))) = ctx; ctx = (c)
+
+// The context behind the fs_* calls, initialized on first use
+static fs_context default_context;
+static pthread_once_t default_context_once = PTHREAD_ONCE_INIT;
+
+// Test a bit in the cached block bitmap
+#define BLOCK_IN_USE(b) ((ctx->bitmap_cache[(b) / 64] >> ((b) % 64)) & 1)
+
+// Blocks the allocator must not hand out: in use, or held by a snapshot
+// (see struct snapshot). Only blocks in neither can be allocated.
+#define TAKEN_WORD(w) (ctx->bitmap_cache[w] | (ctx->snap_pinned != NULL ? ctx->snap_pinned[w] : 0))
+#define BLOCK_TAKEN(b) ((TAKEN_WORD((b) / 64) >> ((b) % 64)) & 1)
+#define BLOCK_PINNED(b) (ctx->snap_pinned != NULL && ((ctx->snap_pinned[(b) / 64] >> ((b) % 64)) & 1))
+#define ALLOCATABLE_BLOCKS (ctx->sb_cache->free_blocks - ctx->pinned_free)
+
+// Blocks a write must not overwrite in place: held by a snapshot, shared
+// with another file, or in the dedup index (dedup_lock held for the last two)
+#define BLOCK_REFERENCED(b) (ctx->block_refs != NULL && ctx->block_refs[b] > 0)
+#define BLOCK_INDEXED(b) (ctx->dedup_indexed != NULL && ((ctx->dedup_indexed[(b) / 64] >> ((b) % 64)) & 1))
+#define BLOCK_SHARED(b) (BLOCK_PINNED(b) || BLOCK_REFERENCED(b) || BLOCK_INDEXED(b))
+
+// Statistics. Every thread counts into a private block of fs_counters
+// slots, so the hot paths only do an uncontended load and store; fs_stats
+// sums the blocks of all live threads plus those retired by exited ones.
+// A reset records a baseline instead of touching other threads' blocks.
+#define STAT_SLOTS (sizeof(fs_counters) / sizeof(unsigned long long))
+#define STAT(field) (offsetof(fs_counters, field) / sizeof(unsigned long long)) // slot of a counter
+struct stats_block {
+    _Atomic unsigned long long v[STAT_SLOTS]; // written by the owning thread only
+    struct stats_block* next;
+};
+static _Thread_local struct stats_block* my_stats = NULL;
+static struct stats_block* stats_list = NULL; // blocks of live threads, guarded by stats_lock
+static unsigned long long stats_retired[STAT_SLOTS]; // totals of exited threads
+static unsigned long long stats_baseline[STAT_SLOTS]; // totals at the last fs_stats_reset
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Times an fs_* entry point from this declaration to its return
+struct op_timer {
+    int op;
+    unsigned long long start;
+};
+static void op_timer_end ( struct op_timer * t ) ;
+#define TIME_OP(op) struct op_timer op_timer __attribute__((cleanup(op_timer_end))) = { (op), stat_clock() }
 
 
 /**
  * @brief Creates and formats a new filesystem
  * 
  * This function creates a new disk image file and initializes the filesystem
- * structures within it (superblock, block bitmap, and inode table).
+ * structures within it (superblock, block bitmap, and inode table), with the
+ * default geometry of MAX_BLOCKS blocks of BLOCK_SIZE bytes and MAX_FILES
+ * inodes.
  * 
  * Disk layout:
  * - Block 0: Superblock (4KB)
  * - Block 1: Block bitmap (4KB)
- * - Blocks 2-9: Inode table (32KB = 256 inodes × 128B)
- * - Blocks 10-2559: Data blocks (~9.96MB)
+ * - Blocks 2-9: Inode table (256 inodes × 92B, padded to 32KB)
+ * - Blocks 10-21: Metadata journal (JOURNAL_BLOCKS)
+ * - Blocks 22-2559: Data blocks (~9.9MB)
  * 
  * @param disk_path Path where the disk image file will be created
  * @return 0 on success, -1 on error (e.g., cannot create file)
  */
 int fs_format(const char* disk_path){
+    return fs_format_geometry(disk_path, MAX_BLOCKS, MAX_FILES, BLOCK_SIZE);
+}
+
+
+/**
+ * @brief Creates and formats a new filesystem with a chosen geometry
+ * 
+ * The superblock records the geometry and the layout derived from it, and
+ * fs_mount takes both from there. The bitmap and the inode table occupy
+ * as many blocks as they need after the superblock, and the journal is
+ * sized to hold a transaction rewriting all of the metadata.
+ * 
+ * @param disk_path Path where the disk image file will be created
+ * @param total_blocks Blocks in the image, a multiple of 64 up to 2^24
+ * @param total_inodes Files the image can hold, a multiple of 64 up to 2^18
+ * @param block_size Bytes per block, a power of two from 1024 to 65536
+ * @return 0 on success, -1 on error (e.g., invalid geometry or cannot create file)
+ */
+int fs_format_geometry(const char* disk_path, int total_blocks, int total_inodes, int block_size){
+    TIME_OP(FS_OP_FORMAT);
+
+    // Lay the image out first, so an impossible geometry leaves the file alone
+    superblock sb;
+    struct geometry g;
+    if (plan_layout(&sb, total_blocks, total_inodes, block_size) < 0 || read_geometry(&sb, &g) < 0) {
+        return -1; // Invalid geometry
+    }
+
     // check if a filesystem of this type is already mounted
-    if (is_mounted) {
+    fs_context* fs = default_fs();
+    pthread_rwlock_rdlock(&fs->table_lock);
+    bool mounted = fs->is_mounted;
+    pthread_rwlock_unlock(&fs->table_lock);
+    if (mounted) {
         return -1;
     }
 
-    // Opening the virtual disk
-    disk_fd = open(disk_path, O_RDWR | O_CREAT, 0644);
+    // Opening the virtual disk. A local descriptor keeps format away from
+    // the state of any filesystem being mounted concurrently.
+    int disk_fd = open(disk_path, O_RDWR | O_CREAT, 0644);
     if (disk_fd < 0) {
         return -1; // Error opening file
     }
+    if (flock(disk_fd, LOCK_EX | LOCK_NB) < 0) {
+        close(disk_fd);
+        return -1; // The image is mounted, by any context or process
+    }
 
-    // Allocate 10 MB: seek to (10 * 1024 * 1024) - 1 and write one byte
-    lseek(disk_fd, ((10 * 1024 * 1024) - 1), SEEK_SET);
-    write(disk_fd, "", 1); // Write a single byte to allocate the space
+    // Initialize block bitmap (a set bit means the block is in use) and inodes
+    size_t bitmap_bytes = (size_t)g.total_blocks / 8;
+    size_t table_bytes = (size_t)g.total_inodes * sizeof(inode);
+    unsigned char* bitmap = calloc(1, bitmap_bytes); // Set all blocks as free (0)
+    inode* inodes = malloc(table_bytes);
+    if (bitmap == NULL || inodes == NULL) {
+        free(bitmap);
+        free(inodes);
+        close(disk_fd);
+        return -1; // Out of memory
+    }
+
+    // Allocate the whole image: write one byte at its last offset
+    off_t disk_size = (off_t)g.total_blocks * g.block_size;
+    bool ok = pwrite(disk_fd, "", 1, disk_size - 1) == 1; // Write a single byte to allocate the space
 
     // ==============================================================================
-    // Initialize superblock
-    superblock sb;
-    sb.total_blocks = MAX_BLOCKS;
-    sb.block_size = BLOCK_SIZE;
-    sb.free_blocks = MAX_BLOCKS - 1 - 1 - 8; // 10 blocks reserved for metadata
-    sb.total_inodes = MAX_FILES;
-    sb.free_inodes = MAX_FILES; // Initially all inodes are free
 
-    // Writing superblock 
-    lseek ( disk_fd ,  0 * BLOCK_SIZE , SEEK_SET ) ; // Move to the start of the disk
-    write ( disk_fd , &sb , sizeof(superblock) ) ; // Write the superblock to block 0
+    // Writing superblock (sealed below, once the checksum is known)
+    ok = ok && pwrite(disk_fd, &sb, sizeof(superblock), SUPERBLOCK_BLOCK * g.block_size) == sizeof(superblock);
 
     // ==============================================================================
 
-    // Initialize block bitmap
-    unsigned char bitmap [ MAX_BLOCKS / 8];
-
-    bitmap[0] |= (1 << 0); // Mark block 0 as used (superblock)
-    bitmap[1] |= (1 << 0); // Mark block 1 as used (block bitmap)
-    for (int i = 2; i < 10; i++) {
-        bitmap[i / 8] |= (1 << (i % 8)); // Mark blocks 2-9 as used (inode table)
-    }
-    for (int i = 10; i < MAX_BLOCKS / 8; i++) {
-        bitmap [i/8] &= ~(1 << ( i %8) ); // Set all blocks as free (0)
+    for (int i = 0; i < g.journal_start + g.journal_blocks; i++) {
+        bitmap[i / 8] |= (1 << (i % 8)); // Mark the superblock, bitmap, inode table and the journal as used
     }
 
     // Writing block bitmap
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move to block 1
-    write(disk_fd, bitmap, sizeof(bitmap)); // Write the bitmap to block 1
+    ok = ok && pwrite(disk_fd, bitmap, bitmap_bytes, (off_t)g.bitmap_start * g.block_size) == (ssize_t)bitmap_bytes;
 
     // ==============================================================================
 
-    // Initialize inodes
-    inode inodes[MAX_FILES];
-
-    for (int i = 0; i < MAX_FILES; i++) {
+    for (int i = 0; i < g.total_inodes; i++) {
         inodes[i].used = 0; // Mark all inodes as free
         inodes[i].size = 0; // Initial size is 0
-        inodes[i].name[0] = '\0'; // Initialize name to empty
+        memset(inodes[i].name, 0, MAX_FILENAME); // Initialize name to empty
         for (int j = 0; j < MAX_DIRECT_BLOCKS; j++) {
             inodes[i].blocks[j] = -1; // Initialize block pointers to -1
         }
+        inodes[i].indirect = -1;
+        inodes[i].double_indirect = -1;
     }
-    bitmap[2] |= (1 << 0); // Mark block 2 as used (inode table)
-    bitmap[3] |= (1 << 0); // Mark block 3 as used (inode table)
 
      // Writing inode table
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to block 2 (start of inode table)
-    write(disk_fd, inodes, sizeof(inodes)); // Write the inode table to blocks 2-9
+    ok = ok && pwrite(disk_fd, inodes, table_bytes, (off_t)g.inode_table_start * g.block_size) == (ssize_t)table_bytes;
+
+    // ==============================================================================
+
+    // Empty journal: clear both slot headers, which may hold a transaction
+    // from an earlier filesystem in this image
+    struct journal_header empty;
+    memset(&empty, 0, sizeof(empty));
+    for (int slot = 0; slot < 2; slot++) {
+        ok = ok && pwrite(disk_fd, &empty, sizeof(empty), journal_slot_offset(&g, slot)) == sizeof(empty);
+    }
+
+    // A fresh image counts as cleanly unmounted, so its first mount is fast
+    sb.checksum = metadata_checksum(&sb, bitmap, inodes);
+    ok = ok && pwrite(disk_fd, &sb, sizeof(superblock), SUPERBLOCK_BLOCK * g.block_size) == sizeof(superblock);
 
     // ==============================================================================
 
+    free(bitmap);
+    free(inodes);
     close(disk_fd);
-    disk_fd = -1; // reset disk_fd to indicate no open file
-    is_mounted = false; // reset the is_mounted flag
 
-    return 0; // Success
+    return ok ? 0 : -1; // Success, unless the image could not be written
+}
+
+// Fill in a fresh superblock for a geometry: the bitmap and the inode
+// table follow the superblock, the data region starts after them but never
+// before block 10, which keeps the default geometry's layout unchanged, and
+// the journal comes first in the data region. Returns -1 if the geometry is
+// outside the supported range or leaves no data blocks.
+static int plan_layout ( superblock * sb , int total_blocks , int total_inodes , int block_size ) {
+
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0
+        || total_blocks < 64 || total_blocks > GEOMETRY_MAX_BLOCKS || total_blocks % 64 != 0
+        || total_inodes < 64 || total_inodes > GEOMETRY_MAX_INODES || total_inodes % 64 != 0) {
+        return -1;
+    }
+
+    memset(sb, 0, sizeof(*sb));
+    sb->total_blocks = total_blocks;
+    sb->block_size = block_size;
+    sb->total_inodes = total_inodes;
+    sb->free_inodes = total_inodes; // Initially all inodes are free
+    sb->bitmap_start = 1;
+    sb->bitmap_blocks = (total_blocks / 8 + block_size - 1) / block_size;
+    sb->inode_table_start = sb->bitmap_start + sb->bitmap_blocks;
+    sb->inode_table_blocks = (int)(((size_t)total_inodes * sizeof(inode) + block_size - 1) / block_size);
+    int metadata_end = sb->inode_table_start + sb->inode_table_blocks;
+    sb->data_start = metadata_end > LEGACY_DATA_START ? metadata_end : LEGACY_DATA_START;
+    sb->journal_start = sb->data_start;
+    sb->journal_blocks = 2 * (int)((journal_slot_need(sb) + block_size - 1) / block_size);
+    if ((long long)sb->journal_start + sb->journal_blocks >= total_blocks) {
+        return -1; // The metadata and the journal would fill the whole image
+    }
+    sb->free_blocks = total_blocks - sb->journal_start - sb->journal_blocks; // metadata blocks, then the journal
+    sb->clean = 1;
+    sb->journal_sequence = 1;
+    return 0;
+}
+
+// Derive the in-memory geometry from a superblock. Images from before the
+// layout fields have zeros there and the original fixed layout. Returns -1
+// if the superblock describes a layout this code cannot mount.
+static int read_geometry ( const superblock * sb , struct geometry * g ) {
+
+    g->total_blocks = sb->total_blocks;
+    g->total_inodes = sb->total_inodes;
+    g->block_size = sb->block_size;
+    if (sb->bitmap_blocks == 0) {
+        g->bitmap_start = 1; // Legacy layout
+        g->bitmap_blocks = 1;
+        g->inode_table_start = 2;
+        g->inode_table_blocks = LEGACY_DATA_START - 2;
+        g->data_start = LEGACY_DATA_START;
+    } else {
+        g->bitmap_start = sb->bitmap_start;
+        g->bitmap_blocks = sb->bitmap_blocks;
+        g->inode_table_start = sb->inode_table_start;
+        g->inode_table_blocks = sb->inode_table_blocks;
+        g->data_start = sb->data_start;
+    }
+    g->journal_start = sb->journal_start;
+    g->journal_blocks = sb->journal_blocks;
+
+    // load_metadata reads the superblock, bitmap and inode table with one
+    // preadv, so they must be adjacent in that order
+    int bs = g->block_size;
+    if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0
+        || g->total_blocks < 64 || g->total_blocks > GEOMETRY_MAX_BLOCKS || g->total_blocks % 64 != 0
+        || g->total_inodes < 64 || g->total_inodes > GEOMETRY_MAX_INODES || g->total_inodes % 64 != 0
+        || g->bitmap_start != 1 || g->bitmap_blocks != (g->total_blocks / 8 + bs - 1) / bs
+        || g->inode_table_start != g->bitmap_start + g->bitmap_blocks
+        || (long long)g->inode_table_blocks * bs < (long long)g->total_inodes * (long long)sizeof(inode)
+        || g->data_start < g->inode_table_start + g->inode_table_blocks || g->data_start >= g->total_blocks) {
+        return -1;
+    }
+    if (g->journal_blocks != 0
+        && (g->journal_blocks < 0 || g->journal_blocks % 2 != 0 || g->journal_start < g->data_start
+            || g->journal_start > g->total_blocks - g->journal_blocks
+            || (size_t)(g->journal_blocks / 2) * bs < journal_slot_need(sb))) {
+        return -1; // Journal outside the data region, or too small for a full transaction
+    }
+
+    // A file is bounded by the data region, by the reach of the double
+    // indirect block, and by byte offsets that must fit an int
+    long long pointers = bs / (int)sizeof(int);
+    long long limit = g->total_blocks - g->data_start;
+    long long reach = MAX_DIRECT_BLOCKS + pointers + pointers * pointers;
+    long long offsets = INT_MAX / bs - 1;
+    limit = limit < reach ? limit : reach;
+    g->file_blocks = (int)(limit < offsets ? limit : offsets);
+    return 0;
+}
+
+// Bytes a journal slot needs for a transaction rewriting all of sb's metadata
+static size_t journal_slot_need ( const superblock * sb ) {
+    size_t table_bytes = (size_t)sb->total_inodes * sizeof(inode);
+    size_t table_blocks = (table_bytes + sb->block_size - 1) / sb->block_size;
+    size_t records = 2 + (table_blocks + 1) / 2; // superblock, bitmap, inode table runs
+    return sizeof(struct journal_header) + records * sizeof(struct journal_record)
+           + sizeof(superblock) + sb->total_blocks / 8 + table_bytes;
 }
 
 
@@ -129,61 +968,219 @@ int fs_format(const char* disk_path){
  * @return 0 on success, -1 on error (e.g., file not found or invalid filesystem)
  */
 int fs_mount(const char* disk_path){
-    if (is_mounted) {
+    return mount_context(default_fs(), disk_path, FS_MOUNT_PREAD);
+}
+
+
+/**
+ * @brief Mounts an existing filesystem with a chosen I/O backend
+ * 
+ * FS_MOUNT_PREAD reads the metadata into memory and does data I/O with
+ * preadv/pwritev. FS_MOUNT_MMAP maps the whole image instead: metadata and
+ * data blocks are then accessed in place, and fs_read_zc becomes available.
+ * FS_MOUNT_WRITE_BEHIND may be OR'd into FS_MOUNT_PREAD to start the
+ * background flusher; it has no effect with FS_MOUNT_MMAP. FS_MOUNT_DEDUP,
+ * with either mode, makes writes share full blocks whose content is
+ * already stored instead of writing them again.
+ * 
+ * @param disk_path Path to the disk image file to mount
+ * @param mode FS_MOUNT_PREAD or FS_MOUNT_MMAP, optionally with FS_MOUNT_WRITE_BEHIND and FS_MOUNT_DEDUP
+ * @return 0 on success, -1 on error (e.g., file not found or invalid filesystem)
+ */
+int fs_mount_mode(const char* disk_path, int mode){
+    return mount_context(default_fs(), disk_path, mode);
+}
+
+
+/**
+ * @brief Mounts an existing filesystem into a new context
+ * 
+ * Same as fs_mount_mode, but the image gets a context of its own instead
+ * of the default one, so any number of images can be mounted at once.
+ * 
+ * @param disk_path Path to the disk image file to mount
+ * @param mode FS_MOUNT_PREAD or FS_MOUNT_MMAP, optionally with FS_MOUNT_WRITE_BEHIND and FS_MOUNT_DEDUP
+ * @return The new context, or NULL on error (e.g. the image is already mounted)
+ */
+fs_context* fsc_mount(const char* disk_path, int mode){
+    fs_context* fs = malloc(sizeof(fs_context));
+    if (fs == NULL) {
+        return NULL; // Out of memory
+    }
+    context_init(fs);
+    if (mount_context(fs, disk_path, mode) < 0) {
+        context_destroy(fs);
+        free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+
+// Mount an image into a context, for fs_mount_mode and fsc_mount
+static int mount_context ( fs_context * fs , const char * disk_path , int mode ) {
+    TIME_OP(FS_OP_MOUNT);
+    USE_CONTEXT(fs);
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    int result = mount_image(disk_path, mode);
+    pthread_rwlock_unlock(&ctx->table_lock);
+    return result;
+}
+
+
+// Open and validate the image for fs_mount_mode (table_lock held exclusively)
+static int mount_image ( const char * disk_path , int mode ) {
+    if (ctx->is_mounted) {
         return -1; // already mounted
     }
 
+    bool want_write_behind = (mode & FS_MOUNT_WRITE_BEHIND) != 0;
+    bool want_dedup = (mode & FS_MOUNT_DEDUP) != 0;
+    mode &= ~(FS_MOUNT_WRITE_BEHIND | FS_MOUNT_DEDUP);
+    if (mode != FS_MOUNT_PREAD && mode != FS_MOUNT_MMAP) {
+        return -1; // Unknown mount mode
+    }
+
+#ifdef HAVE_IO_URING
+    if (mode == FS_MOUNT_PREAD && (my_ring != NULL || ring_attach() != NULL)) {
+        ctx->backend = &uring_backend; // Otherwise the kernel refused io_uring; stay on preadv
+    }
+#endif
+
     // Open the disk image file
-    disk_fd = open(disk_path, O_RDWR);
-    if (disk_fd < 0) {
+    ctx->disk_fd = open(disk_path, O_RDWR);
+    if (ctx->disk_fd < 0) {
         return -1; // Error opening file
     }
+    // Two contexts working on one image would overwrite each other's metadata
+    if (flock(ctx->disk_fd, LOCK_EX | LOCK_NB) < 0) {
+        release_disk();
+        return -1; // Mounted elsewhere, in this process or another
+    }
 
-    // Read the superblock
+    // The superblock says how large everything else is
     superblock sb;
-    lseek(disk_fd, 0 * BLOCK_SIZE, SEEK_SET); // Move to block 0 (superblock)
-    read(disk_fd, &sb, sizeof(superblock)); // Read the superblock
+    struct iovec sb_iov = { &sb, sizeof(sb) };
+    if (dev_rw(0, &sb_iov, 1, false) < 0 || read_geometry(&sb, &ctx->geo) < 0
+        || mount_alloc(mode == FS_MOUNT_MMAP) < 0) {
+        release_disk();
+        return -1; // Not a filesystem, an unsupported geometry, or out of memory
+    }
+
+    // Finish the last committed transaction before anything reads the
+    // metadata. A mapped mount updates the metadata in place, bypassing the
+    // journal, so it also empties the journal for the next mount.
+    if (journal_replay(mode == FS_MOUNT_MMAP) < 0) {
+        release_disk();
+        return -1; // Unreadable or invalid journal
+    }
+
+    if (mode == FS_MOUNT_MMAP) {
+        // Map the whole image; the metadata is then used in place
+        struct stat st;
+        if (fstat(ctx->disk_fd, &st) < 0 || st.st_size < DISK_SIZE) {
+            release_disk();
+            return -1; // The image is truncated
+        }
+        void* map = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->disk_fd, 0);
+        if (map == MAP_FAILED) {
+            release_disk();
+            return -1; // Cannot map the image
+        }
+        ctx->disk_map = map;
+        ctx->backend = &mmap_backend;
+        ctx->sb_cache = (superblock*)(ctx->disk_map + SUPERBLOCK_BLOCK * DISK_BLOCK_SIZE);
+        ctx->bitmap_cache = (uint64_t*)(ctx->disk_map + BITMAP_BLOCK * DISK_BLOCK_SIZE);
+        ctx->inode_cache = (inode*)(ctx->disk_map + INODE_TABLE_BLOCK * DISK_BLOCK_SIZE);
+    } else if (load_metadata() < 0) {
+        // Read the superblock, bitmap and inode table into the metadata cache
+        release_disk();
+        return -1; // Short read, the image is truncated
+    }
+
+    // Check if the superblock is valid: a replayed transaction must not
+    // have moved anything the buffers were sized for
+    struct geometry loaded;
+    if (read_geometry(ctx->sb_cache, &loaded) < 0 || memcmp(&loaded, &ctx->geo, sizeof(loaded)) != 0) {
+        release_disk();
+        return -1; // Invalid filesystem structure
+    }
 
-    // Read inode table
+    // After a clean unmount the checksum vouches for everything the checks
+    // below would look at, so they are skipped; fs_check does the full scan
+    bool clean = ctx->sb_cache->clean == 1
+                 && ctx->sb_cache->checksum == metadata_checksum(ctx->sb_cache, ctx->bitmap_cache, ctx->inode_cache);
 
-    inode inodes[MAX_FILES];
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to block 2 (start of inode table)
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
     // Check if the inode table is valid
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodes[i].used && inodes[i].size < 0) {
-            close(disk_fd);
+    for (int i = 0; i < DISK_INODES && !clean; i++) {
+        if (ctx->inode_cache[i].used && !inode_valid(&ctx->inode_cache[i])) {
+            release_disk();
             return -1; // Invalid inode found
         }
     }
-    // Read block bitmap
-    unsigned char bitmap[MAX_BLOCKS / 8];
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move to block 1 (block bitmap)
-    read(disk_fd, bitmap, sizeof(bitmap)); // Read the block bitmap
-    // Check if the block bitmap is valid
-    for (int i = 0; i < MAX_BLOCKS / 8; i++) {
-        if (bitmap[i] < 0 || bitmap[i] > 255) {
-            close(disk_fd);
-            return -1; // Invalid block bitmap found
+    build_name_index();
+
+    // Recount the free totals so the allocator can trust them
+    if (!clean) {
+        int used_blocks = 0, used_inodes = 0;
+        for (int w = 0; w < DISK_BLOCKS / 64; w++) {
+            used_blocks += __builtin_popcountll(ctx->bitmap_cache[w]);
+        }
+        for (int w = 0; w < DISK_INODES / 64; w++) {
+            used_inodes += __builtin_popcountll(ctx->inode_used_map[w]);
+        }
+        if (ctx->sb_cache->free_blocks != DISK_BLOCKS - used_blocks || ctx->sb_cache->free_inodes != DISK_INODES - used_inodes) {
+            ctx->sb_cache->free_blocks = DISK_BLOCKS - used_blocks;
+            ctx->sb_cache->free_inodes = DISK_INODES - used_inodes;
+            ctx->sb_dirty = true;
         }
     }
+    ctx->alloc_cursor = DATA_START_BLOCK;
+    bcache_reset();
+
     // Check if the block bitmap is correctly initialized
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (i < 10 && (bitmap[i / 8] & (1 << (i % 8)))) {
-            close(disk_fd);
+    for (int i = 0; i < DATA_START_BLOCK && !clean; i++) {
+        if (!BLOCK_IN_USE(i)) {
+            release_disk();
             return -1; // Reserved blocks should be marked as used
         }
-        if (i >= 10 && !(bitmap[i / 8] & (1 << (i % 8)))) {
-            close(disk_fd);
-            return -1; // Data blocks should be marked as free
+    }
+    for (int i = 0; i < ctx->sb_cache->journal_blocks && !clean; i++) {
+        if (!BLOCK_IN_USE(ctx->sb_cache->journal_start + i)) {
+            release_disk();
+            return -1; // So should the journal
         }
     }
-    // Check if the superblock is valid
-    if (sb.total_blocks != MAX_BLOCKS || sb.block_size != BLOCK_SIZE || sb.total_inodes != MAX_FILES) {
-        close(disk_fd);
-        return -1; // Invalid filesystem structure
+    if (clean) {
+        stat_add(STAT(clean_mounts), 1);
+    }
+
+    // Files may share blocks once the image has been mounted for dedup
+    if ((want_dedup || ctx->sb_cache->shared_blocks) && setup_block_refs(want_dedup) < 0) {
+        release_disk();
+        return -1; // Out of memory, or an unreadable indirect block
+    }
+    ctx->sb_cache->shared_blocks |= want_dedup;
+
+    // The image stays dirty until fs_unmount marks it clean again. With
+    // the journal the first commit carries the cleared flag; a mapped image
+    // has it in place at once.
+    ctx->sb_cache->clean = 0;
+    if (ctx->sb_cache->bitmap_blocks == 0) {
+        // An image with the original fixed layout records it from now on
+        ctx->sb_cache->bitmap_start = ctx->geo.bitmap_start;
+        ctx->sb_cache->bitmap_blocks = ctx->geo.bitmap_blocks;
+        ctx->sb_cache->inode_table_start = ctx->geo.inode_table_start;
+        ctx->sb_cache->inode_table_blocks = ctx->geo.inode_table_blocks;
+        ctx->sb_cache->data_start = ctx->geo.data_start;
+    }
+    ctx->sb_dirty = true;
+    ctx->journal_enabled = ctx->sb_cache->journal_blocks > 0 && ctx->disk_map == NULL;
+    ctx->mount_id++; // Invalidates the handles of any earlier mount
+    ctx->is_mounted = true; // Set the mounted flag to true
+    if (want_write_behind) {
+        start_flusher(); // Only takes effect with the block cache, i.e. FS_MOUNT_PREAD
     }
-    is_mounted = true; // Set the mounted flag to true
 
     return 0;
 }
@@ -193,109 +1190,431 @@ int fs_mount(const char* disk_path){
  * @brief Unmounts the filesystem
  * 
  * Ensures all pending changes are written to the disk image file and
- * closes the file. After unmounting, no further filesystem operations
- * should be performed until the filesystem is mounted again.
+ * closes the file. Calls already in flight on other threads finish first;
+ * calls made afterwards fail until the filesystem is mounted again.
  */
 void fs_unmount()
 {
-    is_mounted = false; // Set the mounted flag to false
-    close(disk_fd); // Close the file
+    unmount_context(default_fs());
 }
 
 
-
 /**
- * @brief Creates a new empty file
+ * @brief Unmounts the filesystem of a context and frees the context
  * 
- * Allocates an inode for a new file with the specified name. The file
- * initially has zero size and no allocated data blocks.
- * 
- * @param filename Name of the file to create (null-terminated, max 28 chars)
- * @return 0 on success, -1 if file already exists, -2 if no free inodes, -3 for other errors
+ * Same as fs_unmount for a context from fsc_mount, but the context is freed,
+ * so no call on it may run concurrently with this one or after it: a call
+ * that has entered the context needs its locks to still exist. Does nothing
+ * if fs is NULL.
  */
-int fs_create(const char* filename)
+void fsc_unmount(fs_context* fs)
 {
-    // Check if the filename is already in use
-    if (is_mounted == false) {
-        return -3; // Filesystem not mounted
-    }   
-
-    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
-        return -3; // Invalid filename
-    }
-    
-    int existing_inode_index = find_inode(filename);
-    if (existing_inode_index >= 0) {
-        return -1; // File already exists
-    }
-    // Find a free inode
-    int inode_index = find_free_inode();
-    if (inode_index < 0) {
-        return -1; // No free inode available
+    if (fs == NULL) {
+        return;
     }
+    unmount_context(fs);
+    context_destroy(fs);
+    free(fs);
+}
 
 
-    // Initialize the new inode
-    inode new_inode;
-    new_inode.used = true;
-    new_inode.size = 0;
-    strncpy(new_inode.name, filename, 28);
-
-    // Write the new inode to the disk
-    write_inode(inode_index, &new_inode);
-
-    return 0; // Success
+// Write back and release a context's image, for fs_unmount and fsc_unmount
+static void unmount_context ( fs_context * fs ) {
+    TIME_OP(FS_OP_UNMOUNT);
+    USE_CONTEXT(fs);
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted) {
+        pthread_rwlock_wrlock(&ctx->snap_lock); // Wait for snapshot reads in flight
+        for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+            free_snapshot(&ctx->snapshots[i]);
+        }
+        pthread_rwlock_unlock(&ctx->snap_lock);
+        lock_all_inodes_exclusive(); // Wait for reads and writes in flight
+        stop_flusher();
+        stop_readahead();
+        // Write back dirty data blocks first, then any dirty metadata; only
+        // if both succeed is the image marked clean
+        if (bcache_flush() == 0 && commit_metadata() == 0) {
+            mark_clean();
+        }
+        bcache_reset();
+        unlock_all_inodes();
+    }
+    ctx->is_mounted = false; // Set the mounted flag to false
+    release_disk(); // Close the file
+    pthread_rwlock_unlock(&ctx->table_lock);
 }
 
 
 /**
- * @brief Lists the files in the filesystem
+ * @brief Writes all cached changes back to the disk image
  * 
- * Populates the provided array with the names of files in the filesystem,
+ * Dirty blocks in the block cache are written first, coalesced into one
+ * pwritev per run of adjacent blocks, then whichever of the superblock,
+ * block bitmap and inode table changed, after waiting for any write-behind
+ * flusher writes in flight. The metadata goes through the journal, so one
+ * fdatasync makes everything durable; this is the explicit durability
+ * point. Concurrent callers are group-committed.
+ * 
+ * @return 0 on success, -1 on error (e.g., not mounted or write failed)
+ */
+int fsc_sync(fs_context* fs)
+{
+    TIME_OP(FS_OP_SYNC);
+    USE_CONTEXT(fs);
+
+    // The first commit to start after this call covers every operation that
+    // completed before it, so a caller that finds a commit running waits for
+    // it and then shares the next one with whoever else arrived meanwhile.
+    pthread_mutex_lock(&ctx->sync_lock);
+    unsigned long long need = ctx->sync_started + 1;
+    while (ctx->sync_done < need) {
+        if (ctx->sync_running) {
+            pthread_cond_wait(&ctx->sync_cond, &ctx->sync_lock);
+            continue;
+        }
+        ctx->sync_running = true;
+        ctx->sync_started++;
+        pthread_mutex_unlock(&ctx->sync_lock);
+        int result = sync_commit();
+        pthread_mutex_lock(&ctx->sync_lock);
+        ctx->sync_running = false;
+        ctx->sync_done = ctx->sync_started;
+        ctx->sync_result = result;
+        pthread_cond_broadcast(&ctx->sync_cond);
+    }
+    int result = ctx->sync_result;
+    pthread_mutex_unlock(&ctx->sync_lock);
+
+    return result;
+}
+
+// One commit for fs_sync: write back dirty data, then commit the metadata
+static int sync_commit () {
+
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // Filesystem not mounted
+    }
+
+    // With every inode locked the metadata is a consistent snapshot.
+    // Data goes out before the metadata that points at it.
+    lock_all_inodes();
+    int result = 0;
+    if (bcache_flush() < 0 || commit_metadata() < 0) {
+        result = -1;
+    }
+    unlock_all_inodes();
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return result;
+}
+
+
+
+/**
+ * @brief Creates a new empty file
+ * 
+ * Allocates an inode for a new file with the specified name. The file
+ * initially has zero size and no allocated data blocks.
+ * 
+ * @param filename Name of the file to create (null-terminated, max 28 chars)
+ * @return 0 on success, -1 if file already exists, -2 if no free inodes, -3 for other errors
+ */
+int fsc_create(fs_context* fs, const char* filename)
+{
+    TIME_OP(FS_OP_CREATE);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Filesystem not mounted
+    }
+
+    int inode_index = create_inode(filename);
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return inode_index < 0 ? inode_index : 0; // -1 if the file exists, -2 if no free inode
+}
+
+// Allocate and index an inode for a new empty file (table_lock held exclusively)
+static int create_inode ( const char * filename ) {
+
+    // Check if the filename is already in use
+    int existing_inode_index = find_inode(filename);
+    if (existing_inode_index >= 0) {
+        return -1; // File already exists
+    }
+    // Find a free inode
+    int inode_index = find_free_inode();
+    if (inode_index < 0) {
+        return -2; // No free inode available
+    }
+
+    // Initialize the new inode
+    inode new_inode;
+    new_inode.used = true;
+    new_inode.size = 0;
+    strncpy(new_inode.name, filename, MAX_FILENAME);
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++) {
+        new_inode.blocks[i] = -1; // No data blocks yet
+    }
+    new_inode.indirect = -1;
+    new_inode.double_indirect = -1;
+
+    // Write the new inode to the inode cache
+    write_inode(inode_index, &new_inode);
+    index_insert(inode_index);
+    ctx->inode_extents[inode_index] = 0;
+    ctx->readahead[inode_index].next = 0;
+    ctx->readahead[inode_index].window = 0;
+    ctx->readahead[inode_index].issued = 0;
+
+    ctx->sb_cache->free_inodes--;
+    ctx->sb_dirty = true;
+
+    return inode_index;
+}
+
+/**
+ * @brief Creates many files, optionally with content, in one call
+ * 
+ * All names are resolved and their inodes allocated in a single pass under
+ * one acquisition of the table lock. The blocks for every payload are then
+ * reserved together, so the files land back to back on disk, and the
+ * changed inodes sit next to each other in the inode table, which the next
+ * sync writes back with one pwritev per contiguous run of table blocks.
+ * 
+ * @param filenames Names of the files to create
+ * @param data Content of each file, or NULL to create empty files
+ * @param sizes Size of each content, or NULL to create empty files
+ * @param count Number of entries
+ * @param results Receives each entry's result: 0 on success, -1 if the file already exists, -2 if no free inode or out of space, -3 for other errors
+ * @return Number of files created, or -3 if the batch itself is invalid or the filesystem is not mounted
+ */
+int fsc_create_many(fs_context* fs, const char* const filenames[], const void* const data[], const int sizes[], int count, int results[])
+{
+    TIME_OP(FS_OP_CREATE_MANY);
+    USE_CONTEXT(fs);
+    if (filenames == NULL || results == NULL || count < 0) {
+        return -3; // Invalid batch
+    }
+    if ((data == NULL) != (sizes == NULL)) {
+        return -3; // Contents and sizes come together
+    }
+
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Filesystem not mounted
+    }
+
+    // Pass 1: create the inodes and count the blocks all payloads need.
+    // Until pass 3, results[i] holds the new inode number of each entry.
+    long long total = 0;
+    for (int i = 0; i < count; i++) {
+        const char* filename = filenames[i];
+        int size = sizes != NULL ? sizes[i] : 0;
+        if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28
+            || size < 0 || (size > 0 && data[i] == NULL)) {
+            results[i] = -3; // Invalid filename or content
+            continue;
+        }
+        int blocks = size <= INLINE_DATA_MAX ? 0 : (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE; // inline payloads need none
+        if (blocks > DATA_BLOCKS) {
+            results[i] = -2; // Larger than the whole data region
+            continue;
+        }
+        results[i] = create_inode(filename);
+        if (results[i] >= 0) {
+            total += blocks + pointer_blocks_for(blocks);
+        }
+    }
+
+    // Pass 2: reserve the blocks of every payload at once. If they do not
+    // all fit, each file allocates its own in pass 3 and the ones that do
+    // not fit fail individually.
+    int* pool = NULL;
+    if (total > 0 && total <= DISK_BLOCKS - DATA_START_BLOCK) {
+        pool = malloc(total * sizeof(int));
+        if (pool != NULL && alloc_blocks(total, -1, pool) < 0) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+
+    // Pass 3: write each payload. Each file takes its data blocks and then
+    // its pointer blocks from the pool, the layout resize_file_blocks uses.
+    // An entry whose content cannot be stored is not created at all.
+    int created = 0;
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        if (results[i] < 0) {
+            continue;
+        }
+        int inode_index = results[i];
+        int size = sizes != NULL ? sizes[i] : 0;
+        int blocks = size <= INLINE_DATA_MAX ? 0 : (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        int result = 0;
+        if (blocks > 0 && pool != NULL) {
+            int* map = &pool[used];
+            used += blocks + pointer_blocks_for(blocks);
+            int written = ctx->dedup ? dedup_write(map, blocks, data[i], size) : cached_write(map, blocks, data[i], size);
+            if (written < 0) {
+                result = -3; // Write to the disk image failed
+            } else {
+                result = commit_file_blocks(inode_index, map, blocks, map + blocks, size, false);
+            }
+            if (result < 0) {
+                release_blocks(map, blocks + pointer_blocks_for(blocks));
+            }
+        } else if (size > 0) {
+            result = write_file_data(inode_index, data[i], size);
+        }
+
+        if (result < 0) {
+            delete_inode(inode_index);
+            results[i] = result;
+        } else {
+            results[i] = 0;
+            created++;
+            stat_add(STAT(bytes_written), size);
+        }
+    }
+    free(pool);
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return created;
+}
+
+
+/**
+ * @brief Lists the files in the filesystem
+ * 
+ * Populates the provided array with the names of files in the filesystem,
  * up to the specified maximum.
  * 
  * @param filenames Pre-allocated 2D array to receive file names
  * @param max_files Maximum number of file names to retrieve
  * @return Number of files found (0 to max_files), or -1 on error
  */
-int fs_list(char filenames[][MAX_FILENAME], int max_files){
-    if (is_mounted == false) {
-        return -1; // Filesystem not mounted
-    }
-
+int fsc_list(fs_context* fs, char filenames[][MAX_FILENAME], int max_files){
+    TIME_OP(FS_OP_LIST);
+    USE_CONTEXT(fs);
     if (filenames == NULL || max_files <= 0) {
         return -1; // Invalid parameters
     }
 
-    
+    pthread_rwlock_rdlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // Filesystem not mounted
+    }
+
+
     int count = 0;
-    inode inodes[MAX_FILES];
-    bool found = false;
-    
-    // Read the inode table from disk
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to the start of the inode table
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
-
-    // Iterate through inodes and collect file names
-    for (int i = 0; i < MAX_FILES && count < max_files; i++) {
-        //ensure filenamr are not duplicated
-        for (int j = 0; j < count; j++) {
-            if (strcmp(filenames[j], inodes[i].name) == 0) {
-                found = true; // File already exists in the list
-                break; // No need to add it again
-            }
-        }
-        if (inodes[i].used && !found) {
-            strncpy(filenames[count], inodes[i].name, MAX_FILENAME);
+
+    // Iterate through the indexed inodes and collect file names.
+    // The index never holds two inodes with the same name, so no duplicate check is needed.
+    for (int w = 0; w < DISK_INODES / 64 && count < max_files; w++) {
+        uint64_t used = ctx->inode_used_map[w];
+        while (used != 0 && count < max_files) {
+            int i = w * 64 + __builtin_ctzll(used);
+            used &= used - 1; // Clear the lowest set bit
+            strncpy(filenames[count], ctx->inode_cache[i].name, MAX_FILENAME);
             filenames[count][MAX_FILENAME - 1] = '\0'; // Ensure null-termination
             count++;
         }
-        found = false; // Reset found for the next iteration
     }
 
+    pthread_rwlock_unlock(&ctx->table_lock);
+
     return count; // Return the number of files found
 }
 
+/**
+ * @brief Lists files a page at a time, optionally sorted and filtered by prefix
+ * 
+ * Unsorted listings walk the used-slot bitmap from the cursor's slot.
+ * Sorted listings binary-search the name-ordered list for the cursor's
+ * last name, so paging through n files costs one sort plus O(log n) per page
+ * as long as no file is created or deleted in between.
+ * 
+ * @param cursor Resume point, FS_LIST_CURSOR_INIT for a new listing
+ * @param prefix Name prefix to match, or NULL
+ * @param flags FS_LIST_SORTED and FS_LIST_SIZES, or 0
+ * @param entries Pre-allocated array to receive the files
+ * @param max_entries Number of entries available
+ * @return Number of files returned (0 once the listing is complete), or -1 on error
+ */
+int fsc_list_entries(fs_context* fs, fs_list_cursor* cursor, const char* prefix, int flags, fs_dirent* entries, int max_entries) {
+    TIME_OP(FS_OP_LIST_ENTRIES);
+    USE_CONTEXT(fs);
+    if (cursor == NULL || entries == NULL || max_entries <= 0) {
+        return -1; // Invalid parameters
+    }
+    if (prefix == NULL) {
+        prefix = "";
+    }
+    size_t prefix_len = strnlen(prefix, MAX_FILENAME);
+    if (cursor->next < 0) {
+        return 0; // Listing already complete
+    }
+
+    pthread_rwlock_rdlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // Filesystem not mounted
+    }
+
+    // Collect the inode slots first; size holds the slot until sizes are filled in
+    int count = 0;
+    if (flags & FS_LIST_SORTED) {
+        pthread_mutex_lock(&ctx->sorted_lock);
+        sort_names();
+        cursor->after[MAX_FILENAME] = '\0';
+        int k = sorted_position(cursor->after, prefix);
+        for (; k < ctx->sorted_count && count < max_entries; k++) {
+            int i = ctx->sorted_names[k];
+            if (strncmp(ctx->inode_cache[i].name, prefix, prefix_len) != 0) {
+                break; // Names with the prefix are contiguous, so none follow
+            }
+            entries[count++].size = i;
+        }
+        if (k >= ctx->sorted_count || strncmp(ctx->inode_cache[ctx->sorted_names[k]].name, prefix, prefix_len) != 0) {
+            cursor->next = -1; // No match left for another call
+        }
+        pthread_mutex_unlock(&ctx->sorted_lock);
+    } else {
+        count = collect_slots(ctx->inode_used_map, ctx->inode_cache, prefix, cursor, entries, max_entries);
+    }
+
+    for (int n = 0; n < count; n++) {
+        int i = entries[n].size;
+        memcpy(entries[n].name, ctx->inode_cache[i].name, MAX_FILENAME);
+        entries[n].name[MAX_FILENAME] = '\0'; // A full-length name has no terminator of its own
+        entries[n].size = -1;
+        if (flags & FS_LIST_SIZES) {
+            // The size changes under the inode lock, not under table_lock
+            pthread_rwlock_rdlock(&ctx->inode_locks[i]);
+            entries[n].size = ctx->inode_cache[i].size;
+            pthread_rwlock_unlock(&ctx->inode_locks[i]);
+        }
+    }
+    if (count > 0 && (flags & FS_LIST_SORTED)) {
+        memcpy(cursor->after, entries[count - 1].name, MAX_FILENAME + 1);
+    }
+
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return count;
+}
+
 /**
  * @brief Writes data to a file
  * 
@@ -308,11 +1627,9 @@ int fs_list(char filenames[][MAX_FILENAME], int max_files){
  * @param size Number of bytes to write
  * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
  */
-int fs_write(const char* filename, const void* data, int size) {
-    if (is_mounted == false) {
-        return -3; // Filesystem not mounted
-    }
-
+int fsc_write(fs_context* fs, const char* filename, const void* data, int size) {
+    TIME_OP(FS_OP_WRITE);
+    USE_CONTEXT(fs);
     if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
         return -3; // Invalid filename
     }
@@ -321,236 +1638,4214 @@ int fs_write(const char* filename, const void* data, int size) {
         return -3; // Invalid data or size
     }
 
-    int inode_index = find_inode(filename);
+    int inode_index = lookup_and_lock(filename, true);
     if (inode_index < 0) {
-        return -1; // File not found
+        return inode_index; // File not found (-1) or not mounted (-3)
     }
 
-    // Read the inode to get its current state
-    inode target_inode;
-    read_inode(inode_index, &target_inode);
-    int index_block = find_free_block();
-
-    if (index_block < 0) {
-        return -2; // Out of space
+    int result = write_file_data(inode_index, data, size);
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+    if (result == 0) {
+        stat_add(STAT(bytes_written), size);
     }
 
-    // TODO:  Calculate number of blocks needed
-    int num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE; // Calculate number of blocks needed
+    return result;
+}
+
+// Replace a file's content (caller holds the inode lock exclusively)
+static int write_file_data ( int inode_index , const void * data , int size ) {
 
-    inode inodes[MAX_FILES];
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to the start of the inode table
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
-    for (int i = size; i < BLOCK_SIZE; i++)
-    {
-        /* code */
+    // Small content goes into the inode and the file's blocks are freed, so
+    // reading it back costs no block I/O
+    if (size > 0 && size <= INLINE_DATA_MAX) {
+        BLOCK_LIST(lists);
+        int* meta;
+        int* map = resize_lists(&lists, &ctx->inode_cache[inode_index], 0, &meta);
+        if (map == NULL) {
+            return -3; // Out of memory
+        }
+        int result = resize_file_blocks(&ctx->inode_cache[inode_index], 0, map, meta, 0, 0);
+        if (result < 0) {
+            return result;
+        }
+        commit_file_inline(inode_index, data, size);
+        return 0;
     }
-    
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++) {
-        if (inodes[inode_index].blocks[i] == -1) {
-            inodes[inode_index].blocks[i] = index_block; // Found the inode index
-            mark_block_used(index_block); // Mark the block as used
-            break;
+    if ((ctx->inode_cache[inode_index].used & INODE_COMPRESS) && size <= COMPRESS_MAX_BYTES) {
+        int result = write_file_compressed(inode_index, data, size);
+        if (result != 1) {
+            return result;
         }
     }
+    return write_file_blocks(inode_index, data, size);
+}
 
-    // Write the data to the allocated blocks
-    for (int i = 0; i < blocks_needed; i++) {
-        lseek(disk_fd, target_inode.blocks[i] * BLOCK_SIZE, SEEK_SET);
-        write(disk_fd, data + (i * BLOCK_SIZE), BLOCK_SIZE);
+// Replace a file's content with data blocks (caller holds the inode lock exclusively)
+static int write_file_blocks ( int inode_index , const void * data , int size ) {
+
+    // Calculate number of blocks needed
+    int blocks_needed = (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if (blocks_needed > DATA_BLOCKS) {
+        return -2; // Larger than the whole data region
     }
 
-    // Update the inode with new size and mark it as used
-    target_inode.used = true;
-    target_inode.size = size;
+    // Keep the blocks the file already owns, reserve the missing ones and free the rest
+    BLOCK_LIST(lists);
+    int* meta;
+    int* map = resize_lists(&lists, &ctx->inode_cache[inode_index], blocks_needed, &meta);
+    if (map == NULL) {
+        return -3; // Out of memory
+    }
+    int moved = resize_file_blocks(&ctx->inode_cache[inode_index], blocks_needed, map, meta, 0, blocks_needed);
+    if (moved < 0) {
+        return moved;
+    }
 
-    // Write the updated inode back to disk
-    write_inode(inode_index, &target_inode);
+    // Write the data into the block cache; it reaches the image on eviction or sync
+    int shared = 0;
+    if (ctx->dedup) {
+        shared = dedup_write(map, blocks_needed, data, size);
+    } else if (cached_write(map, blocks_needed, data, size) < 0) {
+        shared = -3;
+    }
+    if (shared < 0) {
+        return -3; // Write to the disk image failed
+    }
 
-    return 0; // Success
+    return commit_file_blocks(inode_index, map, blocks_needed, meta, size, moved > 0 || shared > 0);
 }
 
-/**
- * @brief Deletes an existing file
- * 
- * Removes a file from the filesystem, freeing its inode and any
- * allocated data blocks.
- * 
- * @param filename Name of the file to delete (null-terminated)
- * @return 0 on success, -1 if file not found, -2 for other errors
- */
-int fs_delete(const char* filename)
-{
-    if (is_mounted == false) {
-        return -3; // Filesystem not mounted
-    }
+// Replace a file's content with its compressed form (caller holds the inode
+// lock exclusively). The compressed data is written like any other content,
+// then the inode records the real size. Returns 1, leaving the file alone,
+// if it would not save a block or not fit in the direct blocks.
+static int write_file_compressed ( int inode_index , const char * data , int size ) {
 
-    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
-        return -3; // Invalid filename
+    int raw_blocks = (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int capacity = (raw_blocks - 1 < MAX_DIRECT_BLOCKS ? raw_blocks - 1 : MAX_DIRECT_BLOCKS) * DISK_BLOCK_SIZE;
+    if (capacity <= 0) {
+        return 1; // A single block cannot shrink
+    }
+    char* packed = malloc(capacity);
+    if (packed == NULL) {
+        return -3; // Out of memory
+    }
+    int packed_size = lz4_compress(data, size, packed, capacity);
+    if (packed_size == 0) {
+        free(packed);
+        return 1; // Not compressible enough
+    }
+    int result = write_file_blocks(inode_index, packed, packed_size);
+    free(packed);
+    if (result < 0) {
+        return result;
     }
 
-    int inode_index = find_inode(filename);
-    if (inode_index < 0) {
-        return -1; // File not found
+    inode* cached = &ctx->inode_cache[inode_index];
+    cached->used = INODE_COMPRESSED | INODE_COMPRESS;
+    cached->size = size;
+    cached->indirect = packed_size; // No indirect block: the data fits in the direct ones
+    mark_inode_dirty(inode_index);
+    stat_add(STAT(compressed_blocks), raw_blocks - FILE_BLOCKS(cached));
+    return 0;
+}
+
+// Write a byte range of a file, growing it if needed (caller holds the inode lock exclusively)
+static int write_file_range ( int inode_index , const char * data , int size , int offset ) {
+
+    int old_size = ctx->inode_cache[inode_index].size;
+    if (size == 0) {
+        return 0; // Nothing changes, not even the size
+    }
+    if ((long long)offset + size > MAX_FILE_BYTES) {
+        return -2; // Larger than the whole data region
     }
+    int end = offset + size;
+    int new_size = end > old_size ? end : old_size;
 
-    // Read the inode to get its data blocks
-    inode target_inode;
-    read_inode(inode_index, &target_inode);
+    // Compressed content cannot be patched in place: the whole file is
+    // unpacked, changed and written again, compressed if that still helps.
+    // So is a file with compression on that stays small enough for it.
+    inode* node = &ctx->inode_cache[inode_index];
+    if (INODE_KIND(node) == INODE_COMPRESSED
+        || ((node->used & INODE_COMPRESS) && new_size > INLINE_DATA_MAX && new_size <= COMPRESS_MAX_BYTES)) {
+        char* content = calloc(new_size, 1); // a gap before offset reads back as zeros
+        if (content == NULL) {
+            return -3; // Out of memory
+        }
+        int result = read_file_range(node, content, old_size, 0, NULL);
+        if (result >= 0) {
+            memcpy(content + offset, data, size);
+            result = write_file_data(inode_index, content, new_size);
+        }
+        free(content);
+        return result;
+    }
 
-    // Free the data blocks associated with the inode
-    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++) {
-        if (target_inode.blocks[i] >= 0) {
-            mark_block_free(target_inode.blocks[i]);
+    // A file that stays small keeps its content inline, or takes it inline
+    // if it was empty. Growing past the limit moves the content to a block.
+    if (INODE_KIND(node) == INODE_INLINE || old_size == 0) {
+        char content[INLINE_DATA_MAX];
+        memset(content, 0, sizeof(content)); // a gap before offset reads back as zeros
+        if (INODE_KIND(node) == INODE_INLINE) {
+            memcpy(content, INLINE_DATA(node), old_size);
+        }
+        if (new_size <= INLINE_DATA_MAX) {
+            memcpy(content + offset, data, size);
+            commit_file_inline(inode_index, content, new_size);
+            return 0;
+        }
+        if (old_size > 0) {
+            int result = write_file_blocks(inode_index, content, old_size);
+            if (result < 0) {
+                return result;
+            }
         }
     }
 
-    // Mark the inode as free
-    target_inode.used = false;
-    target_inode.size = 0;
-    target_inode.name[0] = '\0'; // Clear the name
+    // Only blocks past the current end are allocated
+    int blocks_needed = (new_size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    BLOCK_LIST(lists);
+    int* meta;
+    int* map = resize_lists(&lists, &ctx->inode_cache[inode_index], blocks_needed, &meta);
+    if (map == NULL) {
+        return -3; // Out of memory
+    }
+    // Visit only the blocks that change: those overlapping the range, plus
+    // any gap between the old end and offset, which reads back as zeros.
+    // Blocks that data covers completely are written straight from it in
+    // runs; a block that keeps some old bytes is merged in a bounce buffer.
+    int start = offset < old_size ? offset : old_size;
+    int last = (end - 1) / DISK_BLOCK_SIZE;
+    int moved = resize_file_blocks(&ctx->inode_cache[inode_index], blocks_needed, map, meta, start / DISK_BLOCK_SIZE, last + 1);
+    if (moved < 0) {
+        return moved;
+    }
+    char bounce[DISK_BLOCK_SIZE];
+    int b = start / DISK_BLOCK_SIZE;
+    while (b <= last) {
+        int block_start = b * DISK_BLOCK_SIZE;
+        int block_len = new_size - block_start < DISK_BLOCK_SIZE ? new_size - block_start : DISK_BLOCK_SIZE;
 
-    // Write the updated inode back to disk
-    write_inode(inode_index, &target_inode);
+        if (block_start >= offset && block_start + block_len <= end) {
+            int run = 1;
+            while (b + run <= last && (b + run) * DISK_BLOCK_SIZE + DISK_BLOCK_SIZE <= end) {
+                run++;
+            }
+            if (b + run == last && new_size == end) {
+                run++; // The final, partial block of the file
+            }
+            int run_end = (b + run) * DISK_BLOCK_SIZE < new_size ? (b + run) * DISK_BLOCK_SIZE : new_size;
+            if (cached_write(&map[b], run, data + (block_start - offset), run_end - block_start) < 0) {
+                return -3; // Write to the disk image failed
+            }
+            b += run;
+            continue;
+        }
 
-    return 0; // Success
-}
+        memset(bounce, 0, DISK_BLOCK_SIZE);
+        int old_len = old_size - block_start < DISK_BLOCK_SIZE ? old_size - block_start : DISK_BLOCK_SIZE;
+        if (old_len > 0 && cached_read(&map[b], 1, bounce, old_len) < 0) {
+            return -3; // Read from the disk image failed
+        }
+        int lo = offset > block_start ? offset : block_start;
+        int hi = end < block_start + DISK_BLOCK_SIZE ? end : block_start + DISK_BLOCK_SIZE;
+        if (hi > lo) {
+            memcpy(bounce + (lo - block_start), data + (lo - offset), hi - lo);
+        }
+        if (cached_write(&map[b], 1, bounce, block_len) < 0) {
+            return -3; // Write to the disk image failed
+        }
+        b++;
+    }
 
-// ==============================================================================
+    return commit_file_blocks(inode_index, map, blocks_needed, meta, new_size, moved > 0);
+}
 
-// Sample Helper Functions
+// Give a file exactly blocks_needed data blocks plus their pointer blocks.
+// Data blocks rewrite_from to rewrite_to - 1 are about to be overwritten:
+// those a snapshot or another file holds are moved to new blocks first
+// (see BLOCK_SHARED), and so are the pointer blocks whenever a pointer
+// changes. The first and last block of that range may be written only in
+// part, so their content moves with them.
+// Returns the number of blocks moved.
+static int resize_file_blocks ( const inode * node , int blocks_needed , int * map , int * meta , int rewrite_from , int rewrite_to ) {
 
-// ==============================================================================
+    // The file's current data and pointer blocks. The room at the end of
+    // map (see resize_lists) receives the new pointer blocks.
+    int blocks_owned = FILE_BLOCKS(node);
+    if (map_file_blocks(node, blocks_owned, map, meta) < 0) {
+        return -3; // Cannot read the file's indirect blocks
+    }
+    int meta_owned = pointer_blocks_for(blocks_owned);
+    int meta_needed = pointer_blocks_for(blocks_needed);
 
-// Find an inode by filename
-int find_inode ( const char * filename ) {
+    // Reuse the blocks the file already owns. The missing data blocks and
+    // pointer blocks are reserved in one pass, right after the file's last
+    // block if possible, so the data stays contiguous.
+    int keep = blocks_owned < blocks_needed ? blocks_owned : blocks_needed;
+    int meta_keep = meta_owned < meta_needed ? meta_owned : meta_needed;
+    int new_data = blocks_needed - keep;
+    int new_meta = meta_needed - meta_keep;
 
+    // Kept blocks that a snapshot or another file holds must not be
+    // overwritten. Their positions are noted here, as whether a block is
+    // shared can change once dedup_lock is dropped.
+    BLOCK_LIST(data_list);
+    BLOCK_LIST(meta_list);
+    int* data_at = NULL;
+    int* meta_at = NULL;
+    int moved_data = 0, moved_meta = 0;
+    rewrite_to = rewrite_to < keep ? rewrite_to : keep;
+    if (ctx->snapshot_count > 0 || ctx->block_refs != NULL) {
+        data_at = block_list_reserve(&data_list, rewrite_to > rewrite_from ? rewrite_to - rewrite_from : 0);
+        meta_at = block_list_reserve(&meta_list, meta_keep);
+        if (data_at == NULL || meta_at == NULL) {
+            return -3; // Out of memory
+        }
+        if (ctx->block_refs != NULL) {
+            pthread_mutex_lock(&ctx->dedup_lock);
+        }
+        for (int i = rewrite_from; i < rewrite_to; i++) {
+            if (BLOCK_SHARED(map[i])) {
+                data_at[moved_data++] = i;
+            }
+        }
+        for (int m = 0; m < meta_keep && (moved_data > 0 || blocks_needed != blocks_owned); m++) {
+            if (BLOCK_SHARED(meta[m])) {
+                meta_at[moved_meta++] = m;
+            }
+        }
+        if (ctx->block_refs != NULL) {
+            pthread_mutex_unlock(&ctx->dedup_lock);
+        }
+    }
 
-    inode inodes[MAX_FILES];
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to the start of the inode table
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
+    // One reservation for everything, laid out as moved data, new data,
+    // moved pointer blocks, new pointer blocks
+    int total = moved_data + new_data + moved_meta + new_meta;
+    if (total > 0) {
+        BLOCK_LIST(fresh_list);
+        int* fresh = block_list_reserve(&fresh_list, total);
+        if (fresh == NULL) {
+            return -3; // Out of memory
+        }
+        int first_moved = moved_data > 0 ? data_at[0] : -1;
+        int hint = first_moved > 0 ? map[first_moved - 1] + 1 : first_moved < 0 && keep > 0 ? map[keep - 1] + 1 : -1;
+        if (alloc_blocks(total, hint, fresh) < 0) {
+            return -2; // Out of space
+        }
 
-    // Search for the inode with the given filename
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodes[i].used && strcmp(inodes[i].name, filename) == 0) {
-            return i; // Found the inode
+        // Carry the content of the edge blocks over, then swap the moved
+        // blocks in; fresh then holds the originals, which the file lets go
+        // of (their other holders keep them)
+        char copy[DISK_BLOCK_SIZE];
+        for (int k = 0; k < moved_data; k++) {
+            int i = data_at[k];
+            if ((i == rewrite_from || i == rewrite_to - 1)
+                && (cached_read(&map[i], 1, copy, DISK_BLOCK_SIZE) < 0 || cached_write(&fresh[k], 1, copy, DISK_BLOCK_SIZE) < 0)) {
+                release_blocks(fresh, total);
+                return -3; // Read or write on the disk image failed
+            }
         }
+        for (int k = 0; k < moved_data; k++) {
+            int original = map[data_at[k]];
+            map[data_at[k]] = fresh[k];
+            fresh[k] = original;
+        }
+        memcpy(&map[keep], &fresh[moved_data], new_data * sizeof(int));
+        int* fresh_meta = &fresh[moved_data + new_data];
+        for (int k = 0; k < moved_meta; k++) {
+            int original = meta[meta_at[k]];
+            meta[meta_at[k]] = fresh_meta[k];
+            fresh_meta[k] = original;
+        }
+        memcpy(&meta[meta_keep], &fresh_meta[moved_meta], new_meta * sizeof(int));
+        release_blocks(fresh, moved_data);
+        release_blocks(fresh_meta, moved_meta);
+        stat_add(STAT(cow_blocks), moved_data + moved_meta);
     }
 
-    return -1; // Inode not found
+    // Free the blocks the new content no longer needs
+    if (blocks_owned > blocks_needed) {
+        release_blocks(&map[blocks_needed], blocks_owned - blocks_needed);
+    }
+    if (meta_owned > meta_needed) {
+        release_blocks(&meta[meta_needed], meta_owned - meta_needed);
+    }
+    return moved_data + moved_meta;
 }
 
-// Find a free inode
-int find_free_inode () {
+// Store a file's new block list and size in its inode. remapped is set
+// when resize_file_blocks moved blocks away from a snapshot.
+static int commit_file_blocks ( int inode_index , const int * map , int blocks_needed , const int * meta , int size , bool remapped ) {
 
-    inode inodes[MAX_FILES];
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to the start of the inode table
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
+    // resize_file_blocks keeps the owned prefix, so the pointer blocks only
+    // need rewriting when the number of blocks changed or blocks moved
+    int meta_needed = pointer_blocks_for(blocks_needed);
+    int blocks_owned = FILE_BLOCKS(&ctx->inode_cache[inode_index]);
+    if (blocks_needed != blocks_owned || remapped) {
+        ctx->inode_version[inode_index]++; // Cached block lists of open handles go stale
+        if (store_pointer_blocks(map, blocks_needed, meta) < 0) {
+            return -3; // Write to the disk image failed
+        }
 
-    // Search for a free inode
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!inodes[i].used) {
-            return i; // Found a free inode
+        // A grown file keeps its owned prefix, so only the new blocks need counting
+        int extents = ctx->inode_extents[inode_index];
+        if (!remapped && blocks_needed > blocks_owned && blocks_owned > 0 && extents >= 0) {
+            extents += count_extents(&map[blocks_owned], blocks_needed - blocks_owned);
+            if (map[blocks_owned] == map[blocks_owned - 1] + 1) {
+                extents--; // The first new block continues the last run
+            }
+        } else {
+            extents = count_extents(map, blocks_needed);
         }
+        ctx->inode_extents[inode_index] = extents;
     }
 
-    return -2; // No free inode found
-}
+    // Update the inode's size and block pointers in the inode cache. The
+    // name is left alone: fs_list reads it under table_lock only.
+    inode* cached = &ctx->inode_cache[inode_index];
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++) {
+        cached->blocks[i] = i < blocks_needed ? map[i] : -1;
+    }
+    cached->indirect = meta_needed > 0 ? meta[0] : -1;
+    cached->double_indirect = meta_needed > 1 ? meta[1] : -1;
+    cached->used = 1 | (cached->used & INODE_COMPRESS); // No longer inline or compressed, if it was
+    cached->size = size;
+    mark_inode_dirty(inode_index);
 
-// Find a free block
-int find_free_block () {
+    return 0; // Success
+}
 
-    unsigned char bitmap[MAX_BLOCKS / 8];
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move to the block bitmap
-    read(disk_fd, bitmap, sizeof(bitmap)); // Read the block bitmap
+// Store a file's content in its inode, which then owns no blocks
+static void commit_file_inline ( int inode_index , const char * data , int size ) {
 
-    // Search for a free block
-    // Skip the first 4 blocks (0-3) as they are reserved for superblock and metadata
-    // TODO: Check if the bitmap is correctly initialized
-    for (int i = 4; i < MAX_BLOCKS; i++) {
-        if ((bitmap[i / 8] & (1 << (i % 8)))) {
-            return i; // Found a free block
-        }
+    inode* cached = &ctx->inode_cache[inode_index];
+    if (FILE_BLOCKS(cached) != 0) {
+        ctx->inode_version[inode_index]++; // Cached block lists of open handles go stale
     }
-
-    return -1; // No free block found
+    char* content = INLINE_DATA(cached);
+    memcpy(content, data, size);
+    memset(content + size, 0, INLINE_DATA_MAX - size);
+    cached->used = INODE_INLINE | (cached->used & INODE_COMPRESS);
+    cached->size = size;
+    ctx->inode_extents[inode_index] = 0;
+    mark_inode_dirty(inode_index);
 }
 
-// Mark a block as used
-void mark_block_used ( int block_num ) {
-    
-    // Ensure block_num is within valid range
-    if (block_num < 0 || block_num >= MAX_BLOCKS) {
-        return; // Invalid block number
+// Number of runs of consecutive blocks in a block list
+static int count_extents ( const int * blocks , int count ) {
+    int extents = count > 0 ? 1 : 0;
+    for (int i = 1; i < count; i++) {
+        if (blocks[i] != blocks[i - 1] + 1) {
+            extents++;
+        }
     }
-    unsigned char bitmap[MAX_BLOCKS / 8];
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move to the block bitmap
-    read(disk_fd, bitmap, sizeof(bitmap)); // Read the block bitmap
-
-    // Mark the specified block as used
-    bitmap[block_num / 8] |= (1 << (block_num % 8));
-
-    // Write the updated bitmap back to disk
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move back to the block bitmap
-    write(disk_fd, bitmap, sizeof(bitmap)); // Write the updated bitmap
+    return extents;
 }
 
-// Mark a block as free
-void mark_block_free ( int block_num ) {
+/**
+ * @brief Reads data from a file
+ * 
+ * Reads up to 'size' bytes from the specified file into the provided buffer.
+ * If the file is smaller than the requested size, only the available data is read.
+ * 
+ * @param filename Name of the file to read from
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Size of the buffer in bytes
+ * @return Number of bytes read on success, -1 if file not found, -3 for other errors
+ */
+int fsc_read(fs_context* fs, const char* filename, void* buffer, int size) {
+    TIME_OP(FS_OP_READ);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
 
-    if (disk_fd < 0) {
-        return; // Error opening file
+    if (buffer == NULL || size < 0) {
+        return -3; // Invalid buffer or size
     }
 
-    // Ensure block_num is within valid range
-    if (block_num < 0 || block_num >= MAX_BLOCKS) {
-        return; // Invalid block number
+    int inode_index = lookup_and_lock(filename, false);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
     }
-    unsigned char bitmap[MAX_BLOCKS / 8];
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move to the block bitmap
-    read(disk_fd, bitmap, sizeof(bitmap)); // Read the block bitmap
 
-    // Mark the specified block as free
-    bitmap[block_num / 8] &= ~(1 << (block_num % 8));
+    read_ahead(inode_index, 0, size);
+    int result = read_file_range(&ctx->inode_cache[inode_index], buffer, size, 0, NULL);
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+    if (result > 0) {
+        stat_add(STAT(bytes_read), result);
+    }
 
-    // Write the updated bitmap back to disk
-    lseek(disk_fd, 1 * BLOCK_SIZE, SEEK_SET); // Move back to the block bitmap
-    write(disk_fd, bitmap, sizeof(bitmap)); // Write the updated bitmap
+    return result;
 }
 
-// Read an inode from disk
-void read_inode ( int inode_num , inode * target ) {
-
-    if (disk_fd < 0) {
-        return; // error opening file
+/**
+ * @brief Returns a file's size and block layout without reading its data
+ * 
+ * Files of up to MAX_DIRECT_BLOCKS blocks are described by the inode
+ * alone. Larger files use the extent count in inode_extents, which the
+ * first call after mounting fills in from the file's indirect blocks.
+ * 
+ * @param filename Name of the file
+ * @param info Structure to receive the metadata
+ * @return 0 on success, -1 if file not found, -3 for other errors
+ */
+int fsc_stat(fs_context* fs, const char* filename, fs_stat_info* info) {
+    TIME_OP(FS_OP_STAT);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    if (info == NULL) {
+        return -3; // Invalid info pointer
+    }
+
+    int inode_index = lookup_and_lock(filename, false);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
+    }
+
+    const inode* target_inode = &ctx->inode_cache[inode_index];
+    int blocks_used = FILE_BLOCKS(target_inode);
+    int extents;
+    if (blocks_used <= MAX_DIRECT_BLOCKS) {
+        extents = count_extents(target_inode->blocks, blocks_used);
+    } else {
+        extents = ctx->inode_extents[inode_index];
+        if (extents < 0) {
+            BLOCK_LIST(list);
+            int* map = block_list_reserve(&list, blocks_used);
+            if (map == NULL || map_file_blocks(target_inode, blocks_used, map, NULL) < 0) {
+                pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+                return -3; // Out of memory, or a corrupt indirect block
+            }
+            extents = count_extents(map, blocks_used);
+            ctx->inode_extents[inode_index] = extents;
+        }
+    }
+    info->size = target_inode->size;
+    info->blocks = blocks_used;
+    info->extents = extents;
+    info->is_inline = INODE_KIND(target_inode) == INODE_INLINE;
+    info->is_compressed = INODE_KIND(target_inode) == INODE_COMPRESSED;
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+
+    return 0;
+}
+
+// Copy a byte range of a file out (caller holds the inode lock, or the
+// snapshot's). map is the file's block list if the caller already has it,
+// or NULL.
+static int read_file_range ( const inode * node , char * buffer , int size , int offset , const int * map ) {
+
+    inode target_inode = *node;
+    if (offset >= target_inode.size) {
+        return 0; // At or past the end of the file
+    }
+    int to_read = target_inode.size - offset < size ? target_inode.size - offset : size;
+    if (to_read == 0) {
+        return 0;
+    }
+    if (INODE_KIND(&target_inode) == INODE_INLINE) {
+        memcpy(buffer, INLINE_DATA(&target_inode) + offset, to_read);
+        return to_read; // Served from the inode table, no block I/O
+    }
+    if (INODE_KIND(&target_inode) == INODE_COMPRESSED) {
+        return read_compressed_range(&target_inode, buffer, offset, to_read, map);
+    }
+
+    // Only the blocks overlapping the range are read
+    int first = offset / DISK_BLOCK_SIZE;
+    int last = (offset + to_read - 1) / DISK_BLOCK_SIZE;
+    BLOCK_LIST(local_map);
+    if (map == NULL) {
+        int* blocks = block_list_reserve(&local_map, last + 1);
+        if (blocks == NULL) {
+            return -3; // Out of memory
+        }
+        if (map_file_blocks(&target_inode, last + 1, blocks, NULL) < 0) {
+            return -3; // Cannot read the file's indirect blocks
+        }
+        map = blocks;
+    }
+
+    // An unaligned start goes through a bounce buffer; the rest is read
+    // through the block cache, one preadv per contiguous run of misses
+    int done = 0;
+    if (offset % DISK_BLOCK_SIZE != 0) {
+        char bounce[DISK_BLOCK_SIZE];
+        int block_len = target_inode.size - first * DISK_BLOCK_SIZE < DISK_BLOCK_SIZE ? target_inode.size - first * DISK_BLOCK_SIZE : DISK_BLOCK_SIZE;
+        if (cached_read(&map[first], 1, bounce, block_len) < 0) {
+            return -3; // Read from the disk image failed
+        }
+        done = DISK_BLOCK_SIZE - offset % DISK_BLOCK_SIZE < to_read ? DISK_BLOCK_SIZE - offset % DISK_BLOCK_SIZE : to_read;
+        memcpy(buffer, bounce + offset % DISK_BLOCK_SIZE, done);
+        first++;
+    }
+    if (done < to_read && cached_read(&map[first], last - first + 1, buffer + done, to_read - done) < 0) {
+        return -3; // Read from the disk image failed
+    }
+
+    return to_read;
+}
+
+// Copy to_read bytes at offset out of a compressed file. All of its blocks
+// are read, and the data is unpacked as far as the end of the range:
+// straight into buffer for a read from the start, through a scratch
+// buffer otherwise.
+static int read_compressed_range ( const inode * node , char * buffer , int offset , int to_read , const int * map ) {
+
+    int nblocks = FILE_BLOCKS(node);
+    int local_map[MAX_DIRECT_BLOCKS];
+    if (map == NULL) {
+        if (map_file_blocks(node, nblocks, local_map, NULL) < 0) {
+            return -3; // Corrupt block pointer
+        }
+        map = local_map;
+    }
+    int packed_size = node->indirect;
+    char* packed = malloc((size_t)packed_size + (offset > 0 ? offset + to_read : 0));
+    if (packed == NULL) {
+        return -3; // Out of memory
+    }
+    int result = -3; // Read from the disk image failed, or corrupt data
+    if (cached_read(map, nblocks, packed, packed_size) == 0) {
+        char* out = offset > 0 ? packed + packed_size : buffer;
+        if (lz4_decompress(packed, packed_size, out, offset + to_read) == offset + to_read) {
+            if (offset > 0) {
+                memcpy(buffer, out + offset, to_read);
+            }
+            result = to_read;
+        }
+    }
+    free(packed);
+    return result;
+}
+
+// Note a read of up to size bytes at offset of a file, before it happens
+// (inode lock held, at least shared). A read that starts where the last
+// one ended, or in its final block, grows the read-ahead window; anything
+// else clears it. If the blocks it needs were never requested, the reader
+// fetches them and the window itself; otherwise the read-ahead thread
+// tops the window up once the reader has used half of it, so requests
+// cover several blocks each. Inline and compressed files are read whole
+// and have nothing to read ahead.
+static void read_ahead ( int inode_index , int offset , int size ) {
+
+    const inode* node = &ctx->inode_cache[inode_index];
+    int length = node->size - offset < size ? node->size - offset : size;
+    if (length <= 0 || INODE_KIND(node) != 1) {
+        return;
+    }
+    struct readahead* ra = &ctx->readahead[inode_index];
+    int first = offset / DISK_BLOCK_SIZE;
+    int next = (offset + length - 1) / DISK_BLOCK_SIZE + 1;
+    int expected = ra->next;
+    int window = 0;
+    if (first == expected || first == expected - 1) {
+        window = ra->window == 0 ? READAHEAD_MIN : ra->window * 2 < READAHEAD_MAX ? ra->window * 2 : READAHEAD_MAX;
+    }
+    ra->next = next;
+    ra->window = window;
+    if (window == 0) {
+        ra->issued = 0; // Random access: nothing more is fetched for it
+        return;
+    }
+
+    // Blocks from first to next - 1 are read now; those not requested yet
+    // are fetched with the window, unless there are so many that the
+    // read's own I/O is as good
+    int issued = ra->issued;
+    int from = issued > first ? issued : first;
+    int demand = next - from > 0 ? next - from : 0;
+    if (demand > READAHEAD_MAX) {
+        from = next;
+        demand = 0;
+    } else if (demand == 0 && issued - next > window / 2) {
+        return; // Enough is still ahead of the reader
+    }
+    int nblocks = FILE_BLOCKS(node);
+    int to = next + window < nblocks ? next + window : nblocks;
+    if (from >= to) {
+        return; // At the end of the file
+    }
+    BLOCK_LIST(list);
+    int* map = block_list_reserve(&list, to);
+    if (map == NULL || map_file_blocks(node, to, map, NULL) < 0) {
+        return; // The read itself reports the problem
+    }
+    struct readahead_request req;
+    req.count = bcache_reserve(&map[from], to - from, demand, req.bufs, req.blocks);
+    ra->issued = to;
+    if (req.count > 0 && (demand > 0 || !readahead_queue(&req))) {
+        bcache_fill(req.bufs, req.blocks, req.count); // Needed now, or the thread cannot take it
+    }
+}
+
+/**
+ * @brief Reads part of a file
+ * 
+ * Only the blocks overlapping [offset, offset + size) are read.
+ * 
+ * @param filename Name of the file to read from
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Number of bytes to read
+ * @param offset Position in the file to start reading at
+ * @return Number of bytes read (0 at or past the end of the file), -1 if file not found, -3 for other errors
+ */
+int fsc_pread(fs_context* fs, const char* filename, void* buffer, int size, int offset) {
+    TIME_OP(FS_OP_PREAD);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    if (buffer == NULL || size < 0 || offset < 0) {
+        return -3; // Invalid buffer, size or offset
+    }
+
+    int inode_index = lookup_and_lock(filename, false);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
+    }
+
+    read_ahead(inode_index, offset, size);
+    int result = read_file_range(&ctx->inode_cache[inode_index], buffer, size, offset, NULL);
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+    if (result > 0) {
+        stat_add(STAT(bytes_read), result);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Writes part of a file
+ * 
+ * Only the blocks overlapping [offset, offset + size) are written, and only
+ * blocks past the current end of the file are allocated. A gap between the
+ * old end and offset reads back as zeros.
+ * 
+ * @param filename Name of the file to write to
+ * @param data Pointer to the data to write
+ * @param size Number of bytes to write
+ * @param offset Position in the file to start writing at
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
+ */
+int fsc_pwrite(fs_context* fs, const char* filename, const void* data, int size, int offset) {
+    TIME_OP(FS_OP_PWRITE);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    if (data == NULL || size < 0 || offset < 0) {
+        return -3; // Invalid data, size or offset
+    }
+
+    int inode_index = lookup_and_lock(filename, true);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
+    }
+
+    int result = write_file_range(inode_index, data, size, offset);
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+    if (result == 0) {
+        stat_add(STAT(bytes_written), size);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Appends data to the end of a file
+ * 
+ * The end of the file is read under the same lock as the write, so
+ * concurrent appends never overwrite each other.
+ * 
+ * @param filename Name of the file to append to
+ * @param data Pointer to the data to append
+ * @param size Number of bytes to append
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
+ */
+int fsc_append(fs_context* fs, const char* filename, const void* data, int size) {
+    TIME_OP(FS_OP_APPEND);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    if (data == NULL || size < 0) {
+        return -3; // Invalid data or size
+    }
+
+    int inode_index = lookup_and_lock(filename, true);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
+    }
+
+    int result = write_file_range(inode_index, data, size, ctx->inode_cache[inode_index].size);
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+    if (result == 0) {
+        stat_add(STAT(bytes_written), size);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Opens a file and returns a handle to it
+ * 
+ * The handle is bound to the file's inode, so later handle operations skip
+ * the filename validation and lookup. It also carries a position for
+ * sequential access and a cached copy of the file's block list.
+ * 
+ * @param filename Name of the file to open
+ * @return A handle (0 or greater) on success, -1 if file not found, -2 if too many open handles, -3 for other errors
+ */
+int fsc_open(fs_context* fs, const char* filename) {
+    TIME_OP(FS_OP_OPEN);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    pthread_rwlock_rdlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Filesystem not mounted
+    }
+    int inode_index = find_inode(filename);
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // File not found
+    }
+
+    // Claim a free slot
+    pthread_mutex_lock(&ctx->handles_lock);
+    int fd = 0;
+    while (fd < MAX_OPEN_FILES && ctx->open_files[fd].in_use) {
+        fd++;
+    }
+    if (fd < MAX_OPEN_FILES) {
+        ctx->open_files[fd].in_use = true;
+    }
+    pthread_mutex_unlock(&ctx->handles_lock);
+    if (fd == MAX_OPEN_FILES) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -2; // Too many open handles
+    }
+
+    // The inode cannot be deleted while table_lock is held, so the
+    // generation recorded here belongs to this file. The handle lock is
+    // taken only after table_lock is dropped, in lock_handle's order; a
+    // delete in between makes the handle report -1, as after the open.
+    unsigned generation = ctx->inode_generation[inode_index];
+    unsigned mount = ctx->mount_id;
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    struct open_file* h = &ctx->open_files[fd];
+    pthread_mutex_lock(&h->lock);
+    h->inode = inode_index;
+    h->generation = generation;
+    h->mount = mount;
+    h->position = 0;
+    h->map_count = -1; // Nothing cached yet
+    h->open = true;
+    pthread_mutex_unlock(&h->lock);
+
+    return fd;
+}
+
+/**
+ * @brief Closes a handle returned by fs_open
+ * 
+ * @param fd Handle to close
+ * @return 0 on success, -3 if fd is not an open handle
+ */
+int fsc_close(fs_context* fs, int fd) {
+    TIME_OP(FS_OP_CLOSE);
+    USE_CONTEXT(fs);
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -3; // Invalid handle
+    }
+
+    struct open_file* h = &ctx->open_files[fd];
+    pthread_mutex_lock(&h->lock);
+    if (!h->open) {
+        pthread_mutex_unlock(&h->lock);
+        return -3; // Not open
+    }
+    h->open = false;
+    free(h->map);
+    h->map = NULL;
+    h->map_capacity = 0;
+    pthread_mutex_unlock(&h->lock);
+
+    pthread_mutex_lock(&ctx->handles_lock);
+    h->in_use = false;
+    pthread_mutex_unlock(&ctx->handles_lock);
+
+    return 0;
+}
+
+/**
+ * @brief Reads from an open file at the handle's position
+ * 
+ * Reads up to 'size' bytes and advances the position past them. While the
+ * file's block list is unchanged, reads use the copy cached in the handle
+ * instead of walking the indirect blocks again.
+ * 
+ * @param fd Handle returned by fs_open
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Number of bytes to read
+ * @return Number of bytes read (0 at the end of the file), -1 if the file was deleted, -3 for other errors
+ */
+int fsc_hread(fs_context* fs, int fd, void* buffer, int size) {
+    TIME_OP(FS_OP_HREAD);
+    USE_CONTEXT(fs);
+    if (buffer == NULL || size < 0) {
+        return -3; // Invalid buffer or size
+    }
+
+    struct open_file* h;
+    int inode_index = lock_handle(fd, false, &h);
+    if (inode_index < 0) {
+        return inode_index; // File deleted (-1) or invalid handle (-3)
+    }
+
+    // Refresh the cached block list if the file's blocks changed
+    int blocks_used = FILE_BLOCKS(&ctx->inode_cache[inode_index]);
+    if (h->map_count != blocks_used || h->map_version != ctx->inode_version[inode_index]) {
+        if (h->map == NULL || h->map_capacity < blocks_used) {
+            int capacity = blocks_used > MAX_DIRECT_BLOCKS ? blocks_used : MAX_DIRECT_BLOCKS;
+            free(h->map);
+            h->map = malloc(capacity * sizeof(int));
+            h->map_capacity = h->map != NULL ? capacity : 0;
+        }
+        h->map_count = -1;
+        if (h->map != NULL && map_file_blocks(&ctx->inode_cache[inode_index], blocks_used, h->map, NULL) == 0) {
+            h->map_count = blocks_used;
+            h->map_version = ctx->inode_version[inode_index];
+        }
+    }
+
+    // Without a usable cached list, read_file_range maps the blocks itself
+    read_ahead(inode_index, h->position, size);
+    int result = read_file_range(&ctx->inode_cache[inode_index], buffer, size, h->position, h->map_count >= 0 ? h->map : NULL);
+    if (result > 0) {
+        h->position += result;
+        stat_add(STAT(bytes_read), result);
+    }
+    unlock_handle(h);
+
+    return result;
+}
+
+/**
+ * @brief Writes to an open file at the handle's position
+ * 
+ * Behaves like fs_pwrite at the handle's position, then advances the
+ * position past the written bytes.
+ * 
+ * @param fd Handle returned by fs_open
+ * @param data Pointer to the data to write
+ * @param size Number of bytes to write
+ * @return 0 on success, -1 if the file was deleted, -2 if out of space, -3 for other errors
+ */
+int fsc_hwrite(fs_context* fs, int fd, const void* data, int size) {
+    TIME_OP(FS_OP_HWRITE);
+    USE_CONTEXT(fs);
+    if (data == NULL || size < 0) {
+        return -3; // Invalid data or size
+    }
+
+    struct open_file* h;
+    int inode_index = lock_handle(fd, true, &h);
+    if (inode_index < 0) {
+        return inode_index; // File deleted (-1) or invalid handle (-3)
+    }
+
+    int result = write_file_range(inode_index, data, size, h->position);
+    if (result == 0) {
+        h->position += size;
+        stat_add(STAT(bytes_written), size);
+    }
+    unlock_handle(h);
+
+    return result;
+}
+
+/**
+ * @brief Moves the position of an open handle
+ * 
+ * @param fd Handle returned by fs_open
+ * @param offset New position, relative to 'whence'
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return The new position on success, -1 if the file was deleted, -3 for other errors
+ */
+int fsc_hseek(fs_context* fs, int fd, int offset, int whence) {
+    TIME_OP(FS_OP_HSEEK);
+    USE_CONTEXT(fs);
+    struct open_file* h;
+    int inode_index = lock_handle(fd, false, &h);
+    if (inode_index < 0) {
+        return inode_index; // File deleted (-1) or invalid handle (-3)
+    }
+
+    long long base = 0;
+    if (whence == SEEK_CUR) {
+        base = h->position;
+    } else if (whence == SEEK_END) {
+        base = ctx->inode_cache[inode_index].size;
+    } else if (whence != SEEK_SET) {
+        base = -1; // Invalid whence
+        offset = 0;
+    }
+    long long position = base + offset;
+    int result = -3; // Invalid whence, or a position outside the possible file sizes
+    if (position >= 0 && position <= MAX_FILE_BYTES) {
+        h->position = (int)position;
+        result = h->position;
+    }
+    unlock_handle(h);
+
+    return result;
+}
+
+/**
+ * @brief Returns a file's data in place, without copying it
+ * 
+ * Only available when mounted with FS_MOUNT_MMAP. Fills 'extents' with
+ * pointers into the mapped image that together hold the file's content in
+ * order; physically adjacent blocks are merged into one extent. The
+ * pointers stay valid until the file is written or deleted, or the
+ * filesystem is unmounted.
+ * 
+ * @param filename Name of the file to read
+ * @param extents Pre-allocated array to receive the extents
+ * @param max_extents Capacity of 'extents' (one per block of the file is always enough; fs_stat reports how many are needed)
+ * @return Number of extents on success, -1 if file not found, -3 for other errors (including a compressed file)
+ */
+int fsc_read_zc(fs_context* fs, const char* filename, fs_extent* extents, int max_extents) {
+    TIME_OP(FS_OP_READ_ZC);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    if (extents == NULL || max_extents < 0) {
+        return -3; // Invalid extent array
+    }
+
+    int inode_index = lookup_and_lock(filename, false);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
+    }
+    if (ctx->disk_map == NULL) {
+        pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+        return -3; // Not mounted with the mmap backend
+    }
+
+    const inode* target_inode = &ctx->inode_cache[inode_index];
+    int blocks_used = FILE_BLOCKS(target_inode);
+    BLOCK_LIST(list);
+    int* map = block_list_reserve(&list, blocks_used);
+    int count = 0;
+    if (map == NULL || map_file_blocks(target_inode, blocks_used, map, NULL) < 0) {
+        blocks_used = 0;
+        count = -3; // Out of memory, or a corrupt indirect block
+    }
+    if (INODE_KIND(target_inode) == INODE_COMPRESSED) {
+        blocks_used = 0;
+        count = -3; // The image holds only the compressed form
+    }
+    if (INODE_KIND(target_inode) == INODE_INLINE) {
+        // The content sits in the mapped inode table
+        count = max_extents > 0 ? 1 : -3;
+        if (count > 0) {
+            extents[0].data = INLINE_DATA(target_inode);
+            extents[0].len = target_inode->size;
+        }
+    }
+    for (int i = 0; i < blocks_used; i++) {
+        int chunk = target_inode->size - i * DISK_BLOCK_SIZE;
+        chunk = chunk < DISK_BLOCK_SIZE ? chunk : DISK_BLOCK_SIZE;
+        if (count > 0 && map[i] == map[i - 1] + 1) {
+            extents[count - 1].len += chunk; // Extends the previous extent
+            continue;
+        }
+        if (count == max_extents) {
+            count = -3; // Extent array too small
+            break;
+        }
+        extents[count].data = ctx->disk_map + (off_t)map[i] * DISK_BLOCK_SIZE;
+        extents[count].len = chunk;
+        count++;
+    }
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+
+    return count;
+}
+
+/**
+ * @brief Deletes an existing file
+ * 
+ * Removes a file from the filesystem, freeing its inode and any
+ * allocated data blocks.
+ * 
+ * @param filename Name of the file to delete (null-terminated)
+ * @return 0 on success, -1 if file not found, -2 for other errors
+ */
+int fsc_delete(fs_context* fs, const char* filename)
+{
+    TIME_OP(FS_OP_DELETE);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Filesystem not mounted
+    }
+
+    int inode_index = find_inode(filename);
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // File not found
+    }
+
+    delete_inode(inode_index);
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return 0; // Success
+}
+
+/**
+ * @brief Deletes many files in one call
+ * 
+ * All names are resolved under one acquisition of the table lock.
+ * 
+ * @param filenames Names of the files to delete
+ * @param count Number of entries
+ * @param results Receives each entry's result: 0 on success, -1 if file not found, -3 for an invalid filename
+ * @return Number of files deleted, or -3 if the batch itself is invalid or the filesystem is not mounted
+ */
+int fsc_delete_many(fs_context* fs, const char* const filenames[], int count, int results[])
+{
+    TIME_OP(FS_OP_DELETE_MANY);
+    USE_CONTEXT(fs);
+    if (filenames == NULL || results == NULL || count < 0) {
+        return -3; // Invalid batch
+    }
+
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Filesystem not mounted
+    }
+
+    int deleted = 0;
+    for (int i = 0; i < count; i++) {
+        const char* filename = filenames[i];
+        if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+            results[i] = -3; // Invalid filename
+            continue;
+        }
+        int inode_index = find_inode(filename);
+        if (inode_index < 0) {
+            results[i] = -1; // File not found
+            continue;
+        }
+        delete_inode(inode_index);
+        results[i] = 0;
+        deleted++;
+    }
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return deleted;
+}
+
+
+/**
+ * @brief Checks the consistency of the mounted filesystem
+ * 
+ * Walks every file's block list and compares it with the block bitmap:
+ * blocks owned by two files or by none while marked used, blocks owned
+ * while marked free, invalid block pointers, bad sizes or names, and free
+ * totals that disagree with the bitmap each count as one problem. Writes
+ * wait while it runs but reads do not, so it can run in a background thread.
+ * 
+ * @return Number of problems found (0 if consistent), -1 if not mounted or out of memory
+ */
+int fsc_check(fs_context* fs)
+{
+    TIME_OP(FS_OP_CHECK);
+    USE_CONTEXT(fs);
+    pthread_rwlock_rdlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // Filesystem not mounted
+    }
+    lock_all_inodes(); // Readers carry on, writers wait
+    int problems = check_metadata();
+    unlock_all_inodes();
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return problems;
+}
+
+/**
+ * @brief Takes a copy-on-write snapshot of the mounted filesystem
+ * 
+ * Copies the inode table, the filename index and the block bitmap, and
+ * gives every block in use a reference from the snapshot. Reads carry on
+ * meanwhile; writes in flight are waited for and new ones wait until the
+ * copy is done.
+ * 
+ * @return Snapshot id, -1 if not mounted, -2 if FS_MAX_SNAPSHOTS snapshots exist, -3 if out of memory
+ */
+int fsc_snapshot(fs_context* fs)
+{
+    TIME_OP(FS_OP_SNAPSHOT);
+    USE_CONTEXT(fs);
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // Filesystem not mounted
+    }
+    int id = 0;
+    while (id < FS_MAX_SNAPSHOTS && ctx->snapshots[id].active) {
+        id++;
+    }
+    if (id == FS_MAX_SNAPSHOTS) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -2; // No free snapshot slot
+    }
+
+    struct snapshot* snap = &ctx->snapshots[id];
+    int words = DISK_BLOCKS / 64;
+    snap->inodes = malloc(DISK_INODES * sizeof(inode));
+    snap->bitmap = malloc(words * sizeof(uint64_t));
+    snap->hash_head = malloc((ctx->name_hash_mask + 1) * sizeof(int));
+    snap->hash_next = malloc(DISK_INODES * sizeof(int));
+    snap->hash_value = malloc(DISK_INODES * sizeof(uint32_t));
+    snap->used_map = malloc(DISK_INODES / 64 * sizeof(uint64_t));
+    if (ctx->snap_refs == NULL) {
+        ctx->snap_refs = calloc(DISK_BLOCKS, sizeof(uint8_t));
+    }
+    uint64_t* pinned = ctx->snap_pinned != NULL ? ctx->snap_pinned : calloc(words, sizeof(uint64_t));
+    if (snap->inodes == NULL || snap->bitmap == NULL || snap->hash_head == NULL || snap->hash_next == NULL
+        || snap->hash_value == NULL || snap->used_map == NULL || ctx->snap_refs == NULL || pinned == NULL) {
+        if (pinned != ctx->snap_pinned) {
+            free(pinned);
+        }
+        free_snapshot(snap);
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Out of memory
+    }
+
+    // With every inode locked no write is in flight, so the copies agree
+    // with each other and the pins can change
+    lock_all_inodes();
+    memcpy(snap->inodes, ctx->inode_cache, DISK_INODES * sizeof(inode));
+    memcpy(snap->hash_head, ctx->name_hash_head, (ctx->name_hash_mask + 1) * sizeof(int));
+    memcpy(snap->hash_next, ctx->name_hash_next, DISK_INODES * sizeof(int));
+    memcpy(snap->hash_value, ctx->name_hash_value, DISK_INODES * sizeof(uint32_t));
+    memcpy(snap->used_map, ctx->inode_used_map, DISK_INODES / 64 * sizeof(uint64_t));
+    pthread_mutex_lock(&ctx->alloc_lock);
+    ctx->snap_pinned = pinned;
+    memcpy(snap->bitmap, ctx->bitmap_cache, words * sizeof(uint64_t));
+    for (int w = 0; w < words; w++) {
+        ctx->snap_pinned[w] |= snap->bitmap[w];
+        for (uint64_t used = snap->bitmap[w]; used != 0; used &= used - 1) {
+            ctx->snap_refs[w * 64 + __builtin_ctzll(used)]++;
+        }
+    }
+    pthread_mutex_unlock(&ctx->alloc_lock);
+    pthread_rwlock_wrlock(&ctx->snap_lock);
+    snap->active = true;
+    pthread_rwlock_unlock(&ctx->snap_lock);
+    ctx->snapshot_count++;
+    unlock_all_inodes();
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return id;
+}
+
+/**
+ * @brief Releases a snapshot taken by fsc_snapshot
+ * 
+ * Waits for reads of the snapshot in flight. Blocks whose last reference
+ * goes and that no file owns become allocatable again.
+ * 
+ * @param snap Snapshot id returned by fsc_snapshot
+ * @return 0 on success, -1 if there is no such snapshot
+ */
+int fsc_snapshot_release(fs_context* fs, int snap)
+{
+    TIME_OP(FS_OP_SNAPSHOT_RELEASE);
+    USE_CONTEXT(fs);
+    if (snap < 0 || snap >= FS_MAX_SNAPSHOTS) {
+        return -1; // No such snapshot
+    }
+    pthread_rwlock_wrlock(&ctx->table_lock);
+    struct snapshot* target = &ctx->snapshots[snap];
+    if (ctx->is_mounted == false || !target->active) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -1; // No such snapshot
+    }
+    pthread_rwlock_wrlock(&ctx->snap_lock);
+    target->active = false;
+    pthread_rwlock_unlock(&ctx->snap_lock);
+
+    // Nothing allocates while table_lock and every inode lock are held, so
+    // the blocks unpinned here can lose their cached copies afterwards
+    lock_all_inodes();
+    int words = DISK_BLOCKS / 64;
+    pthread_mutex_lock(&ctx->alloc_lock);
+    for (int w = 0; w < words; w++) {
+        for (uint64_t used = target->bitmap[w]; used != 0; used &= used - 1) {
+            int b = w * 64 + __builtin_ctzll(used);
+            if (--ctx->snap_refs[b] == 0) {
+                ctx->snap_pinned[w] &= ~((uint64_t)1 << (b % 64));
+                ctx->pinned_free -= !BLOCK_IN_USE(b);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->alloc_lock);
+    for (int w = 0; w < words; w++) {
+        uint64_t freed = target->bitmap[w] & ~ctx->bitmap_cache[w] & ~ctx->snap_pinned[w];
+        for (; freed != 0; freed &= freed - 1) {
+            bcache_forget(w * 64 + __builtin_ctzll(freed));
+        }
+    }
+    ctx->snapshot_count--;
+    free_snapshot(target);
+    unlock_all_inodes();
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return 0;
+}
+
+/**
+ * @brief Lists the files of a snapshot a page at a time
+ * 
+ * Works like fsc_list_entries without FS_LIST_SORTED and with
+ * FS_LIST_SIZES, on the snapshot's copy of the inode table.
+ * 
+ * @param snap Snapshot id returned by fsc_snapshot
+ * @param cursor Resume point, FS_LIST_CURSOR_INIT for a new listing
+ * @param prefix Name prefix to match, or NULL
+ * @param entries Pre-allocated array to receive the files
+ * @param max_entries Number of entries available
+ * @return Number of files returned (0 once the listing is complete), or -1 on error
+ */
+int fsc_snapshot_list(fs_context* fs, int snap, fs_list_cursor* cursor, const char* prefix, fs_dirent* entries, int max_entries)
+{
+    TIME_OP(FS_OP_SNAPSHOT_LIST);
+    USE_CONTEXT(fs);
+    if (snap < 0 || snap >= FS_MAX_SNAPSHOTS || cursor == NULL || entries == NULL || max_entries <= 0) {
+        return -1; // Invalid parameters
+    }
+    if (prefix == NULL) {
+        prefix = "";
+    }
+
+    pthread_rwlock_rdlock(&ctx->snap_lock);
+    const struct snapshot* target = &ctx->snapshots[snap];
+    if (!target->active) {
+        pthread_rwlock_unlock(&ctx->snap_lock);
+        return -1; // No such snapshot
+    }
+    int count = 0;
+    if (cursor->next >= 0) {
+        count = collect_slots(target->used_map, target->inodes, prefix, cursor, entries, max_entries);
+    }
+    for (int n = 0; n < count; n++) {
+        const inode* node = &target->inodes[entries[n].size];
+        memcpy(entries[n].name, node->name, MAX_FILENAME);
+        entries[n].name[MAX_FILENAME] = '\0'; // A full-length name has no terminator of its own
+        entries[n].size = node->size;
+    }
+    pthread_rwlock_unlock(&ctx->snap_lock);
+
+    return count;
+}
+
+/**
+ * @brief Reads part of a file as it was when a snapshot was taken
+ * 
+ * The snapshot's blocks are never overwritten, so no inode lock is taken
+ * and writers to the live file do not wait.
+ * 
+ * @param snap Snapshot id returned by fsc_snapshot
+ * @param filename Name of the file in the snapshot
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Number of bytes to read
+ * @param offset Position in the file to start reading at
+ * @return Number of bytes read (0 at or past the end of the file), -1 if there is no such snapshot or file, -3 for other errors
+ */
+int fsc_snapshot_pread(fs_context* fs, int snap, const char* filename, void* buffer, int size, int offset)
+{
+    TIME_OP(FS_OP_SNAPSHOT_PREAD);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+    if (buffer == NULL || size < 0 || offset < 0) {
+        return -3; // Invalid buffer, size or offset
+    }
+    if (snap < 0 || snap >= FS_MAX_SNAPSHOTS) {
+        return -1; // No such snapshot
+    }
+
+    pthread_rwlock_rdlock(&ctx->snap_lock);
+    const struct snapshot* target = &ctx->snapshots[snap];
+    int inode_index = target->active ? snapshot_find(target, filename) : -1;
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(&ctx->snap_lock);
+        return -1; // No such snapshot or file
+    }
+    int result = read_file_range(&target->inodes[inode_index], buffer, size, offset, NULL);
+    pthread_rwlock_unlock(&ctx->snap_lock);
+    if (result > 0) {
+        stat_add(STAT(bytes_read), result);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Turns compression of a file's content on or off
+ * 
+ * The flag lives in inode.used next to the file's kind. The content is
+ * read and written again under the new setting, so an existing file is
+ * compressed, or expanded, right away.
+ * 
+ * @param filename Name of the file
+ * @param enabled 1 to compress the file's content, 0 to store it as is
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
+ */
+int fsc_set_compression(fs_context* fs, const char* filename, int enabled)
+{
+    TIME_OP(FS_OP_SET_COMPRESSION);
+    USE_CONTEXT(fs);
+    if (filename == NULL || strlen(filename) == 0 || strlen(filename) > 28) {
+        return -3; // Invalid filename
+    }
+
+    int inode_index = lookup_and_lock(filename, true);
+    if (inode_index < 0) {
+        return inode_index; // File not found (-1) or not mounted (-3)
+    }
+
+    inode* node = &ctx->inode_cache[inode_index];
+    int result = 0;
+    if ((enabled != 0) != ((node->used & INODE_COMPRESS) != 0)) {
+        node->used ^= INODE_COMPRESS;
+        mark_inode_dirty(inode_index);
+
+        // Only content that is compressed now, or could be, is rewritten;
+        // content that would not shrink stays where it is
+        int size = node->size;
+        if (INODE_KIND(node) == INODE_COMPRESSED || (enabled && INODE_KIND(node) == 1 && size > INLINE_DATA_MAX && size <= COMPRESS_MAX_BYTES)) {
+            char* content = malloc(size);
+            result = content != NULL ? read_file_range(node, content, size, 0, NULL) : -3;
+            if (result >= 0) {
+                result = enabled ? write_file_compressed(inode_index, content, size) : write_file_blocks(inode_index, content, size);
+            }
+            free(content);
+            if (result < 0) {
+                node->used ^= INODE_COMPRESS; // The content is unchanged
+            }
+            result = result < 0 ? result : 0;
+        }
+    }
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+
+    return result;
+}
+
+// Check that an inode in use has a valid kind and a size that fits it, so
+// its block list can be trusted
+static bool inode_valid ( const inode * node ) {
+    if (node->size < 0 || node->size > MAX_FILE_BYTES || (node->used & ~(INODE_COMPRESS | 3)) != 0) {
+        return false;
+    }
+    switch (INODE_KIND(node)) {
+    case 1:
+        return true;
+    case INODE_INLINE:
+        return node->size >= 1 && node->size <= INLINE_DATA_MAX; // Must fit in the inode
+    case INODE_COMPRESSED:
+        return node->size > INLINE_DATA_MAX && node->size <= COMPRESS_MAX_BYTES
+               && node->indirect >= 1 && node->indirect <= MAX_DIRECT_BLOCKS * DISK_BLOCK_SIZE
+               && node->double_indirect == -1;
+    default:
+        return false;
+    }
+}
+
+// Count the inconsistencies between the inodes, the bitmap and the free
+// totals (table_lock and every inode lock held, at least shared)
+static int check_metadata () {
+
+    int problems = 0;
+    uint64_t* owned = calloc(DISK_BLOCKS / 64, sizeof(uint64_t)); // blocks accounted for so far
+    if (owned == NULL) {
+        return -1; // Out of memory
+    }
+    for (int b = 0; b < DATA_START_BLOCK; b++) {
+        owned[b / 64] |= 1ULL << (b % 64);
+    }
+    for (int i = 0; i < ctx->sb_cache->journal_blocks; i++) {
+        int b = ctx->sb_cache->journal_start + i;
+        owned[b / 64] |= 1ULL << (b % 64);
+    }
+
+    // Data blocks may be shared on images with block_refs; count the extra
+    // owners found so they can be compared with it
+    uint16_t* refs = NULL;
+    if (ctx->block_refs != NULL && (refs = calloc(DISK_BLOCKS, sizeof(uint16_t))) == NULL) {
+        free(owned);
+        return -1; // Out of memory
+    }
+    int journal_end = ctx->sb_cache->journal_start + ctx->sb_cache->journal_blocks;
+
+    BLOCK_LIST(list);
+    int used_inodes = 0;
+    for (int i = 0; i < DISK_INODES; i++) {
+        const inode* node = &ctx->inode_cache[i];
+        if (!node->used) {
+            continue;
+        }
+        used_inodes++;
+        if (node->name[0] == '\0' || find_inode(node->name) != i) {
+            problems++; // Empty or duplicate name; a full-length name has no terminator
+        }
+        if (!inode_valid(node)) {
+            problems++;
+            continue; // The block list cannot be trusted
+        }
+
+        // Every data and pointer block must be marked used and owned once
+        int nblocks = FILE_BLOCKS(node);
+        int* data = block_list_reserve(&list, nblocks + pointer_blocks_for(nblocks));
+        if (data == NULL) {
+            free(owned);
+            free(refs);
+            return -1; // Out of memory
+        }
+        int* meta = &data[nblocks];
+        if (map_file_blocks(node, nblocks, data, meta) < 0) {
+            problems++; // Invalid pointer or unreadable indirect block
+            continue;
+        }
+        int total = nblocks + pointer_blocks_for(nblocks);
+        for (int k = 0; k < total; k++) {
+            int b = data[k];
+            if (!BLOCK_IN_USE(b)) {
+                problems++; // Owned but marked free
+            }
+            if (owned[b / 64] & (1ULL << (b % 64))) {
+                if (refs != NULL && k < nblocks && b >= DATA_START_BLOCK
+                    && (b < ctx->sb_cache->journal_start || b >= journal_end)) {
+                    refs[b]++; // A data block another file shares
+                } else {
+                    problems++; // Owned twice, or a reserved block
+                }
+            }
+            owned[b / 64] |= 1ULL << (b % 64);
+        }
+    }
+    if (refs != NULL) {
+        pthread_mutex_lock(&ctx->dedup_lock);
+        for (int b = 0; b < DISK_BLOCKS; b++) {
+            problems += refs[b] != ctx->block_refs[b];
+        }
+        pthread_mutex_unlock(&ctx->dedup_lock);
+        free(refs);
+    }
+
+    // Used blocks that no file owns are leaked
+    int used_blocks = 0;
+    pthread_mutex_lock(&ctx->alloc_lock);
+    for (int w = 0; w < DISK_BLOCKS / 64; w++) {
+        used_blocks += __builtin_popcountll(ctx->bitmap_cache[w]);
+        problems += __builtin_popcountll(ctx->bitmap_cache[w] & ~owned[w]);
+    }
+    if (ctx->sb_cache->free_blocks != DISK_BLOCKS - used_blocks) {
+        problems++;
+    }
+    pthread_mutex_unlock(&ctx->alloc_lock);
+    if (ctx->sb_cache->free_inodes != DISK_INODES - used_inodes) {
+        problems++;
+    }
+    free(owned);
+    return problems;
+}
+
+// Free a file's blocks and inode (table_lock held exclusively)
+static void delete_inode ( int inode_index ) {
+
+    // Wait for reads and writes of this file that are already in flight
+    pthread_rwlock_wrlock(&ctx->inode_locks[inode_index]);
+
+    // Read the inode to get its data blocks
+    inode target_inode;
+    read_inode(inode_index, &target_inode);
+
+    // Free the data blocks associated with the inode, then its pointer blocks.
+    // If an indirect block cannot be read, the blocks it lists stay allocated.
+    BLOCK_LIST(lists);
+    int* meta;
+    int blocks_used = FILE_BLOCKS(&target_inode);
+    int* map = resize_lists(&lists, &target_inode, blocks_used, &meta);
+    if (map != NULL && map_file_blocks(&target_inode, blocks_used, map, meta) == 0) {
+        release_blocks(map, blocks_used);
+        release_blocks(meta, pointer_blocks_for(blocks_used));
+    }
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++) {
+        target_inode.blocks[i] = -1;
+    }
+    target_inode.indirect = -1;
+    target_inode.double_indirect = -1;
+
+    // Mark the inode as free
+    index_remove(inode_index);
+    ctx->inode_generation[inode_index]++; // Open handles of this file go stale
+    target_inode.used = false;
+    target_inode.size = 0;
+    target_inode.name[0] = '\0'; // Clear the name
+
+    // Write the updated inode back to the inode cache
+    write_inode(inode_index, &target_inode);
+
+    ctx->sb_cache->free_inodes++;
+    ctx->sb_dirty = true;
+    pthread_rwlock_unlock(&ctx->inode_locks[inode_index]);
+}
+
+// ==============================================================================
+
+// Default context
+
+// ==============================================================================
+
+// The fs_* calls: the fsc_* calls of the same name on default_context
+
+int fs_sync() {
+    return fsc_sync(default_fs());
+}
+
+int fs_create(const char* filename) {
+    return fsc_create(default_fs(), filename);
+}
+
+int fs_delete(const char* filename) {
+    return fsc_delete(default_fs(), filename);
+}
+
+int fs_create_many(const char* const filenames[], const void* const data[], const int sizes[], int count, int results[]) {
+    return fsc_create_many(default_fs(), filenames, data, sizes, count, results);
+}
+
+int fs_delete_many(const char* const filenames[], int count, int results[]) {
+    return fsc_delete_many(default_fs(), filenames, count, results);
+}
+
+int fs_check() {
+    return fsc_check(default_fs());
+}
+
+int fs_snapshot() {
+    return fsc_snapshot(default_fs());
+}
+
+int fs_snapshot_release(int snap) {
+    return fsc_snapshot_release(default_fs(), snap);
+}
+
+int fs_snapshot_list(int snap, fs_list_cursor* cursor, const char* prefix, fs_dirent* entries, int max_entries) {
+    return fsc_snapshot_list(default_fs(), snap, cursor, prefix, entries, max_entries);
+}
+
+int fs_snapshot_pread(int snap, const char* filename, void* buffer, int size, int offset) {
+    return fsc_snapshot_pread(default_fs(), snap, filename, buffer, size, offset);
+}
+
+int fs_set_compression(const char* filename, int enabled) {
+    return fsc_set_compression(default_fs(), filename, enabled);
+}
+
+int fs_list(char filenames[][MAX_FILENAME], int max_files) {
+    return fsc_list(default_fs(), filenames, max_files);
+}
+
+int fs_list_entries(fs_list_cursor* cursor, const char* prefix, int flags, fs_dirent* entries, int max_entries) {
+    return fsc_list_entries(default_fs(), cursor, prefix, flags, entries, max_entries);
+}
+
+int fs_write(const char* filename, const void* data, int size) {
+    return fsc_write(default_fs(), filename, data, size);
+}
+
+int fs_read(const char* filename, void* buffer, int size) {
+    return fsc_read(default_fs(), filename, buffer, size);
+}
+
+int fs_stat(const char* filename, fs_stat_info* info) {
+    return fsc_stat(default_fs(), filename, info);
+}
+
+int fs_pread(const char* filename, void* buffer, int size, int offset) {
+    return fsc_pread(default_fs(), filename, buffer, size, offset);
+}
+
+int fs_pwrite(const char* filename, const void* data, int size, int offset) {
+    return fsc_pwrite(default_fs(), filename, data, size, offset);
+}
+
+int fs_append(const char* filename, const void* data, int size) {
+    return fsc_append(default_fs(), filename, data, size);
+}
+
+int fs_open(const char* filename) {
+    return fsc_open(default_fs(), filename);
+}
+
+int fs_close(int fd) {
+    return fsc_close(default_fs(), fd);
+}
+
+int fs_hread(int fd, void* buffer, int size) {
+    return fsc_hread(default_fs(), fd, buffer, size);
+}
+
+int fs_hwrite(int fd, const void* data, int size) {
+    return fsc_hwrite(default_fs(), fd, data, size);
+}
+
+int fs_hseek(int fd, int offset, int whence) {
+    return fsc_hseek(default_fs(), fd, offset, whence);
+}
+
+int fs_read_zc(const char* filename, fs_extent* extents, int max_extents) {
+    return fsc_read_zc(default_fs(), filename, extents, max_extents);
+}
+
+// ==============================================================================
+
+// Sample Helper Functions
+
+// ==============================================================================
+
+// Hash a filename (FNV-1a over at most MAX_FILENAME characters)
+static uint32_t name_hash ( const char * filename ) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && filename[i] != '\0'; i++) {
+        h ^= (unsigned char)filename[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Find an inode by filename
+int find_inode ( const char * filename ) {
+
+    // Walk the hash chain for this name; compare full hashes before names
+    uint32_t h = name_hash(filename);
+    for (int i = ctx->name_hash_head[NAME_HASH_BUCKET(h)]; i >= 0; i = ctx->name_hash_next[i]) {
+        if (ctx->name_hash_value[i] == h && strncmp(ctx->inode_cache[i].name, filename, MAX_FILENAME) == 0) {
+            return i; // Found the inode
+        }
+    }
+
+    return -1; // Inode not found
+}
+
+// Find a free inode
+int find_free_inode () {
+
+    // Take the lowest clear bit of the used-slot bitmap
+    for (int w = 0; w < DISK_INODES / 64; w++) {
+        if (ctx->inode_used_map[w] != UINT64_MAX) {
+            return w * 64 + __builtin_ctzll(~ctx->inode_used_map[w]); // Found a free inode
+        }
+    }
+
+    return -2; // No free inode found
+}
+
+// Add an inode to the filename index
+void index_insert ( int inode_num ) {
+    uint32_t h = name_hash(ctx->inode_cache[inode_num].name);
+    int bucket = NAME_HASH_BUCKET(h);
+
+    ctx->name_hash_value[inode_num] = h;
+    ctx->name_hash_next[inode_num] = ctx->name_hash_head[bucket];
+    ctx->name_hash_head[bucket] = inode_num;
+    ctx->inode_used_map[inode_num / 64] |= (uint64_t)1 << (inode_num % 64);
+    ctx->sorted_valid = false;
+}
+
+// Remove an inode from the filename index
+void index_remove ( int inode_num ) {
+    int* link = &ctx->name_hash_head[NAME_HASH_BUCKET(ctx->name_hash_value[inode_num])];
+
+    while (*link >= 0 && *link != inode_num) {
+        link = &ctx->name_hash_next[*link];
+    }
+    if (*link == inode_num) {
+        *link = ctx->name_hash_next[inode_num]; // Unlink from the chain
+    }
+    ctx->name_hash_next[inode_num] = -1;
+    ctx->inode_used_map[inode_num / 64] &= ~((uint64_t)1 << (inode_num % 64));
+    ctx->sorted_valid = false;
+}
+
+// Rebuild the filename index from the inode cache
+void build_name_index () {
+    memset(ctx->name_hash_head, -1, (ctx->name_hash_mask + 1) * sizeof(int));
+    memset(ctx->name_hash_next, -1, DISK_INODES * sizeof(int));
+    memset(ctx->inode_used_map, 0, DISK_INODES / 64 * sizeof(uint64_t));
+
+    for (int i = 0; i < DISK_INODES; i++) {
+        if (!ctx->inode_cache[i].used) {
+            continue;
+        }
+        // Keep the first of any duplicate names so lookups stay unambiguous
+        if (find_inode(ctx->inode_cache[i].name) >= 0) {
+            continue;
+        }
+        index_insert(i);
+    }
+    ctx->sorted_valid = false;
+}
+
+static int compare_names ( const void * a , const void * b ) {
+    return strncmp(ctx->inode_cache[*(const int*)a].name, ctx->inode_cache[*(const int*)b].name, MAX_FILENAME);
+}
+
+// Bring the name-ordered list of indexed inodes up to date (sorted_lock held)
+static void sort_names () {
+    if (ctx->sorted_valid) {
+        return;
+    }
+    int count = 0;
+    for (int w = 0; w < DISK_INODES / 64; w++) {
+        uint64_t used = ctx->inode_used_map[w];
+        while (used != 0) {
+            ctx->sorted_names[count++] = w * 64 + __builtin_ctzll(used);
+            used &= used - 1; // Clear the lowest set bit
+        }
+    }
+    qsort(ctx->sorted_names, count, sizeof(int), compare_names);
+    ctx->sorted_count = count;
+    ctx->sorted_valid = true;
+}
+
+// First position of the name-ordered list past after and not before prefix
+static int sorted_position ( const char * after , const char * prefix ) {
+    bool from_prefix = strncmp(prefix, after, MAX_FILENAME) > 0;
+    int lo = 0, hi = ctx->sorted_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(ctx->inode_cache[ctx->sorted_names[mid]].name, from_prefix ? prefix : after, MAX_FILENAME);
+        if (cmp < 0 || (cmp == 0 && !from_prefix)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Collect the next used inode slots whose names match prefix, in slot
+// order, into entries[].size. cursor->next becomes the slot of the first
+// match left over, or -1 when there is none.
+static int collect_slots ( const uint64_t * used_map , const inode * table , const char * prefix , fs_list_cursor * cursor , fs_dirent * entries , int max_entries ) {
+    size_t prefix_len = strnlen(prefix, MAX_FILENAME);
+    int count = 0;
+    int start = cursor->next;
+    cursor->next = -1; // Unless a match is left for another call
+    for (int w = start / 64; w < DISK_INODES / 64 && cursor->next < 0; w++) {
+        uint64_t used = used_map[w];
+        if (w == start / 64) {
+            used &= UINT64_MAX << (start % 64); // Slots before the cursor were listed
+        }
+        while (used != 0) {
+            int i = w * 64 + __builtin_ctzll(used);
+            used &= used - 1; // Clear the lowest set bit
+            if (strncmp(table[i].name, prefix, prefix_len) != 0) {
+                continue;
+            }
+            if (count == max_entries) {
+                cursor->next = i;
+                break;
+            }
+            entries[count++].size = i;
+        }
+    }
+    return count;
+}
+
+// Find a file in a snapshot's copy of the filename index
+static int snapshot_find ( const struct snapshot * snap , const char * filename ) {
+    uint32_t h = name_hash(filename);
+    for (int i = snap->hash_head[NAME_HASH_BUCKET(h)]; i >= 0; i = snap->hash_next[i]) {
+        if (snap->hash_value[i] == h && strncmp(snap->inodes[i].name, filename, MAX_FILENAME) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Free a snapshot's copies of the metadata
+static void free_snapshot ( struct snapshot * snap ) {
+    free(snap->inodes);
+    free(snap->bitmap);
+    free(snap->hash_head);
+    free(snap->hash_next);
+    free(snap->hash_value);
+    free(snap->used_map);
+    memset(snap, 0, sizeof(*snap));
+}
+
+// Count the files sharing each data block from the block lists, for an
+// image with shared_blocks set. With want_index, also set up an empty dedup
+// index for FS_MOUNT_DEDUP. Returns -1 when out of memory or an indirect
+// block cannot be read.
+static int setup_block_refs ( bool want_index ) {
+
+    ctx->block_refs = calloc(DISK_BLOCKS, sizeof(uint16_t));
+    uint64_t* seen = calloc(DISK_BLOCKS / 64, sizeof(uint64_t)); // blocks with one owner so far
+    if (ctx->block_refs == NULL || seen == NULL) {
+        free(seen);
+        return -1;
+    }
+    BLOCK_LIST(list);
+    for (int i = 0; i < DISK_INODES; i++) {
+        const inode* node = &ctx->inode_cache[i];
+        if (!node->used) {
+            continue;
+        }
+        int nblocks = FILE_BLOCKS(node);
+        int* data = block_list_reserve(&list, nblocks);
+        if (data == NULL || map_file_blocks(node, nblocks, data, NULL) < 0) {
+            free(seen);
+            return -1;
+        }
+        for (int k = 0; k < nblocks; k++) {
+            int b = data[k];
+            if ((seen[b / 64] >> (b % 64)) & 1) {
+                ctx->block_refs[b]++;
+            }
+            seen[b / 64] |= (uint64_t)1 << (b % 64);
+        }
+    }
+    free(seen);
+    if (!want_index) {
+        return 0;
+    }
+
+    // Twice as many slots as blocks keeps hashes from evicting each other
+    ctx->dedup_mask = 1;
+    while (ctx->dedup_mask + 1 < 2u * DISK_BLOCKS) {
+        ctx->dedup_mask = ctx->dedup_mask * 2 + 1;
+    }
+    ctx->dedup_table = malloc((ctx->dedup_mask + 1) * sizeof(struct dedup_slot));
+    ctx->dedup_indexed = calloc(DISK_BLOCKS / 64, sizeof(uint64_t));
+    if (ctx->dedup_table == NULL || ctx->dedup_indexed == NULL) {
+        return -1;
+    }
+    for (uint32_t k = 0; k <= ctx->dedup_mask; k++) {
+        ctx->dedup_table[k].hash = 0;
+        ctx->dedup_table[k].block = -1;
+    }
+    ctx->dedup = true;
+    return 0;
+}
+
+// Hash a full block's content, 8 bytes at a time
+static uint64_t block_hash ( const char * block ) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < DISK_BLOCK_SIZE; i += 8) {
+        uint64_t w;
+        memcpy(&w, block + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Look a full block's content up in the dedup index. On a match the stored
+// block gains a reference and is returned; the content is compared first,
+// so a hash collision only costs the read. Returns -1 otherwise.
+static int dedup_share ( uint64_t hash , const char * block ) {
+    char stored[DISK_BLOCK_SIZE];
+    pthread_mutex_lock(&ctx->dedup_lock);
+    const struct dedup_slot* slot = &ctx->dedup_table[hash & ctx->dedup_mask];
+    int found = slot->block;
+    if (slot->hash != hash || found < 0 || !BLOCK_INDEXED(found) || ctx->block_refs[found] == UINT16_MAX
+        || cached_read(&found, 1, stored, DISK_BLOCK_SIZE) < 0 || memcmp(stored, block, DISK_BLOCK_SIZE) != 0) {
+        pthread_mutex_unlock(&ctx->dedup_lock);
+        return -1;
+    }
+    ctx->block_refs[found]++;
+    pthread_mutex_unlock(&ctx->dedup_lock);
+    return found;
+}
+
+// Write blocks from to to - 1 of a file's data, then add the full ones to
+// the dedup index; hashes holds their hashes from position from on. A block
+// goes into the index only once its content is final, and the block it
+// evicts from its slot keeps just the references it already has.
+static int dedup_store ( const int * map , int from , int to , const char * data , int size , const uint64_t * hashes ) {
+    if (from == to) {
+        return 0;
+    }
+    long long end = (long long)to * DISK_BLOCK_SIZE < size ? (long long)to * DISK_BLOCK_SIZE : size;
+    if (cached_write(&map[from], to - from, data + (size_t)from * DISK_BLOCK_SIZE, (int)(end - (long long)from * DISK_BLOCK_SIZE)) < 0) {
+        return -3; // Write to the disk image failed
+    }
+    pthread_mutex_lock(&ctx->dedup_lock);
+    for (int b = from; b < to && (long long)(b + 1) * DISK_BLOCK_SIZE <= size; b++) {
+        struct dedup_slot* slot = &ctx->dedup_table[hashes[b - from] & ctx->dedup_mask];
+        if (slot->block >= 0) {
+            ctx->dedup_indexed[slot->block / 64] &= ~((uint64_t)1 << (slot->block % 64));
+        }
+        slot->hash = hashes[b - from];
+        slot->block = map[b];
+        ctx->dedup_indexed[map[b] / 64] |= (uint64_t)1 << (map[b] % 64);
+    }
+    pthread_mutex_unlock(&ctx->dedup_lock);
+    return 0;
+}
+
+// Write a file's content into its count blocks (caller holds the inode lock
+// exclusively). Each full block already stored elsewhere replaces the
+// file's own block in map, which is freed, and is not written. Returns the
+// number of blocks replaced, or -3 if a write failed.
+static int dedup_write ( int * map , int count , const char * data , int size ) {
+    BLOCK_LIST(replaced_list);
+    int* replaced = block_list_reserve(&replaced_list, count);
+    if (replaced == NULL) {
+        return -3; // Out of memory
+    }
+    uint64_t hashes[IO_BATCH_BLOCKS]; // of the run not written yet
+    int shared = 0;
+    int start = 0; // first block of that run
+    int result = 0;
+    for (int b = 0; b < count && result == 0; b++) {
+        const char* block = data + (size_t)b * DISK_BLOCK_SIZE;
+        bool full = (long long)(b + 1) * DISK_BLOCK_SIZE <= size;
+        uint64_t hash = full ? block_hash(block) : 0;
+        for (int k = 0; full && k < b - start; k++) {
+            if (hashes[k] == hash) {
+                // Likely a copy of a block of this run: store the run so far
+                result = dedup_store(map, start, b, data, size, hashes);
+                start = b;
+                break;
+            }
+        }
+        hashes[b - start] = hash;
+        int found = full && result == 0 ? dedup_share(hash, block) : -1;
+        if (found >= 0) {
+            result = dedup_store(map, start, b, data, size, hashes);
+            replaced[shared++] = map[b];
+            map[b] = found;
+            start = b + 1;
+        } else if (b + 1 - start == IO_BATCH_BLOCKS) {
+            result = dedup_store(map, start, b + 1, data, size, hashes);
+            start = b + 1;
+        }
+    }
+    if (result == 0) {
+        result = dedup_store(map, start, count, data, size, hashes);
+    }
+    release_blocks(replaced, shared);
+    stat_add(STAT(dedup_blocks), shared);
+    return result < 0 ? result : shared;
+}
+
+// The LZ4 block format: a sequence is a token byte (literal length in the
+// high nibble, match length - 4 in the low one, 15 meaning more length
+// bytes follow), the literals, and a 2-byte little-endian match offset.
+// The last sequence is literals only.
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_BITS 12
+#define LZ4_LAST_LITERALS 5 // a match ends at least this far from the end
+#define LZ4_MATCH_LIMIT 12 // and starts at least this far from it
+#define LZ4_MAX_OFFSET 65535
+
+// Append a length beyond the token's nibble: 255 per byte, then the rest
+static int lz4_put_length ( uint8_t * out , int length ) {
+    int n = 0;
+    for (; length >= 255; length -= 255) {
+        out[n++] = 255;
+    }
+    out[n++] = (uint8_t)length;
+    return n;
+}
+
+// Compress size bytes of src into dst with the LZ4 block format. Matches
+// are found through a hash table of the last position of each 4-byte
+// sequence; after runs of misses the scan takes bigger steps, so data that
+// does not compress costs little. Returns the compressed length, or 0 if
+// it would exceed capacity.
+static int lz4_compress ( const char * src , int size , char * dst , int capacity ) {
+
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    int table[1 << LZ4_HASH_BITS];
+    memset(table, 0xff, sizeof(table)); // -1: no position yet
+    int anchor = 0; // first byte not yet emitted
+    int op = 0;
+    int ip = 0;
+    int misses = 0;
+    while (ip < size - LZ4_MATCH_LIMIT) {
+        uint32_t sequence;
+        memcpy(&sequence, in + ip, sizeof(sequence));
+        uint32_t h = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        uint32_t candidate = 0;
+        if (ref >= 0) {
+            memcpy(&candidate, in + ref, sizeof(candidate));
+        }
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || candidate != sequence) {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        // Extend the match backwards over pending literals, then forwards
+        while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+            ip--;
+            ref--;
+        }
+        int length = LZ4_MIN_MATCH;
+        while (ip + length < size - LZ4_LAST_LITERALS && in[ip + length] == in[ref + length]) {
+            length++;
+        }
+
+        int literals = ip - anchor;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + (length - LZ4_MIN_MATCH) / 255 + 1 > capacity) {
+            return 0; // Does not fit
+        }
+        uint8_t* token = &out[op++];
+        *token = (uint8_t)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15) {
+            op += lz4_put_length(out + op, literals - 15);
+        }
+        memcpy(out + op, in + anchor, literals);
+        op += literals;
+        out[op++] = (uint8_t)(ip - ref);
+        out[op++] = (uint8_t)((ip - ref) >> 8);
+        int extra = length - LZ4_MIN_MATCH;
+        *token |= (uint8_t)(extra < 15 ? extra : 15);
+        if (extra >= 15) {
+            op += lz4_put_length(out + op, extra - 15);
+        }
+        ip += length;
+        anchor = ip;
+    }
+
+    // The rest goes out as literals
+    int literals = size - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > capacity) {
+        return 0; // Does not fit
+    }
+    out[op++] = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op += lz4_put_length(out + op, literals - 15);
+    }
+    memcpy(out + op, in + anchor, literals);
+    return op + literals;
+}
+
+// Read a length beyond the token's nibble, or return -1 past the end of the input
+static int lz4_get_length ( const uint8_t * in , int size , int * ip ) {
+    int length = 0;
+    int byte;
+    do {
+        if (*ip >= size) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+// Decompress an LZ4 block of size bytes into dst, stopping once capacity
+// bytes are out, so a read needs to unpack only as far as it goes. Every
+// length and offset is checked, as the input comes from the image. Returns
+// the number of bytes produced, or -1 if the input is corrupt.
+static int lz4_decompress ( const char * src , int size , char * dst , int capacity ) {
+
+    const uint8_t* in = (const uint8_t*)src;
+    int ip = 0;
+    int op = 0;
+    while (ip < size) {
+        int token = in[ip++];
+        int literals = token >> 4;
+        if (literals == 15) {
+            int more = lz4_get_length(in, size, &ip);
+            if (more < 0) {
+                return -1;
+            }
+            literals += more;
+        }
+        if (literals > size - ip) {
+            return -1; // Literals past the end of the input
+        }
+        int n = literals < capacity - op ? literals : capacity - op;
+        memcpy(dst + op, in + ip, n);
+        op += n;
+        ip += literals;
+        if (op == capacity || ip == size) {
+            break; // Enough output, or the final literals
+        }
+
+        if (size - ip < 2) {
+            return -1; // Truncated offset
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1; // Match before the start of the output
+        }
+        int length = token & 15;
+        if (length == 15) {
+            int more = lz4_get_length(in, size, &ip);
+            if (more < 0) {
+                return -1;
+            }
+            length += more;
+        }
+        length += LZ4_MIN_MATCH;
+        if (length > capacity - op) {
+            length = capacity - op;
+        }
+        char* from = dst + op - offset;
+        if (offset >= length) {
+            memcpy(dst + op, from, length);
+        } else {
+            for (int k = 0; k < length; k++) {
+                dst[op + k] = from[k]; // Overlapping: repeats the last offset bytes
+            }
+        }
+        op += length;
+        if (op == capacity) {
+            break;
+        }
+    }
+    return op;
+}
+
+// Free several blocks under one acquisition of the allocator lock
+static void release_blocks ( const int * blocks , int count ) {
+
+    if (count <= 0) {
+        return; // Nothing to free
+    }
+    if (ctx->block_refs == NULL) {
+        free_block_list(blocks, count);
+        return;
+    }
+
+    // A block that other files share only loses a reference. dedup_lock
+    // stays held until the rest are free, so none gains an owner meanwhile.
+    BLOCK_LIST(unshared_list);
+    int* unshared = block_list_reserve(&unshared_list, count);
+    if (unshared == NULL) {
+        return; // Out of memory; the blocks stay allocated and fs_check reports them
+    }
+    int n = 0;
+    pthread_mutex_lock(&ctx->dedup_lock);
+    for (int i = 0; i < count; i++) {
+        int b = blocks[i];
+        if (b >= DATA_START_BLOCK && b < DISK_BLOCKS && ctx->block_refs[b] > 0) {
+            ctx->block_refs[b]--;
+        } else {
+            unshared[n++] = b;
+        }
+    }
+    free_block_list(unshared, n);
+    pthread_mutex_unlock(&ctx->dedup_lock);
+}
+
+// Free blocks that no other file shares (dedup_lock held if block_refs is set)
+static void free_block_list ( const int * blocks , int count ) {
+
+    // Stale cached copies must never be written over the blocks' next
+    // owners. Pinned blocks keep theirs, which the snapshots still read.
+    for (int i = 0; i < count; i++) {
+        if (!BLOCK_PINNED(blocks[i])) {
+            bcache_forget(blocks[i]);
+        }
+    }
+
+    pthread_mutex_lock(&ctx->alloc_lock);
+    for (int i = 0; i < count; i++) {
+        int b = blocks[i];
+        if (b >= DATA_START_BLOCK && b < DISK_BLOCKS && BLOCK_IN_USE(b)) {
+            ctx->bitmap_cache[b / 64] &= ~((uint64_t)1 << (b % 64));
+            mark_bitmap_dirty(b);
+            ctx->sb_cache->free_blocks++;
+            ctx->pinned_free += BLOCK_PINNED(b);
+            if (ctx->dedup_indexed != NULL) {
+                ctx->dedup_indexed[b / 64] &= ~((uint64_t)1 << (b % 64)); // Its content is no longer final
+            }
+        }
+    }
+    ctx->sb_dirty = true;
+    pthread_mutex_unlock(&ctx->alloc_lock);
+}
+
+// Find the first block at or after from that is taken (want_used) or free
+static int scan_bitmap ( int from , bool want_used ) {
+    int w;
+    int result = DISK_BLOCKS; // None until the end of the disk
+    for (w = from / 64; w < DISK_BLOCKS / 64; w++) {
+        uint64_t bits = want_used ? TAKEN_WORD(w) : ~TAKEN_WORD(w);
+        if (w == from / 64) {
+            bits &= UINT64_MAX << (from % 64); // Ignore blocks before from
+        }
+        if (bits != 0) {
+            result = w * 64 + __builtin_ctzll(bits);
+            w++;
+            break;
+        }
+    }
+    stat_add(STAT(alloc_scan_words), w - from / 64);
+    return result;
+}
+
+// Reserve several free blocks at once, preferring a contiguous run
+int alloc_blocks ( int count , int hint , int * out ) {
+
+    if (count <= 0) {
+        return 0; // Nothing to allocate
+    }
+    stat_add(STAT(alloc_calls), 1);
+    pthread_mutex_lock(&ctx->alloc_lock);
+    if (count > ALLOCATABLE_BLOCKS) {
+        pthread_mutex_unlock(&ctx->alloc_lock);
+        return -1; // Not enough free blocks
+    }
+
+    int start = -1;
+
+    // A run starting at hint lets a growing file stay contiguous
+    if (hint >= DATA_START_BLOCK && hint < DISK_BLOCKS && !BLOCK_TAKEN(hint)
+        && scan_bitmap(hint, true) - hint >= count) {
+        start = hint;
+    }
+
+    // Otherwise take the first free run that is long enough: first from the
+    // cursor to the end of the disk, then from the start of the data region
+    for (int pass = 0; pass < 2 && start < 0; pass++) {
+        int from = pass == 0 ? ctx->alloc_cursor : DATA_START_BLOCK;
+        int limit = pass == 0 ? DISK_BLOCKS : ctx->alloc_cursor;
+        while (from < limit) {
+            int run_start = scan_bitmap(from, false);
+            if (run_start >= limit) {
+                break;
+            }
+            int run_end = scan_bitmap(run_start, true);
+            if (run_end - run_start >= count) {
+                start = run_start;
+                break;
+            }
+            from = run_end;
+        }
+    }
+
+    if (start >= 0) {
+        for (int i = 0; i < count; i++) {
+            out[i] = start + i;
+        }
+    } else {
+        // Too fragmented for a single run: take free blocks in next-fit order.
+        // count <= ALLOCATABLE_BLOCKS, so one wrap-around is always enough.
+        int block = ctx->alloc_cursor;
+        for (int i = 0; i < count; i++) {
+            block = scan_bitmap(block, false);
+            if (block >= DISK_BLOCKS) {
+                block = scan_bitmap(DATA_START_BLOCK, false);
+            }
+            out[i] = block++;
+        }
+    }
+
+    // Commit the whole reservation to the bitmap at once
+    for (int i = 0; i < count; i++) {
+        ctx->bitmap_cache[out[i] / 64] |= (uint64_t)1 << (out[i] % 64);
+        mark_bitmap_dirty(out[i]);
+    }
+    ctx->sb_cache->free_blocks -= count;
+    ctx->sb_dirty = true;
+
+    int last = out[count - 1];
+    ctx->alloc_cursor = last + 1 < DISK_BLOCKS ? last + 1 : DATA_START_BLOCK;
+    pthread_mutex_unlock(&ctx->alloc_lock);
+
+    return count;
+}
+
+// Read an inode from the inode cache
+void read_inode ( int inode_num , inode * target ) {
+
+    // Ensure inode_num is within valid range
+    if (inode_num < 0 || inode_num >= DISK_INODES) {
+        return; // Invalid inode number
+    }
+
+    // Copy the specified inode to target
+    *target = ctx->inode_cache[inode_num];
+}
+
+// Write an inode to the inode cache
+void write_inode ( int inode_num , const inode * source ) {
+
+    // Ensure inode_num is within valid range
+    if (inode_num < 0 || inode_num >= DISK_INODES) {
+        return; // Invalid inode number
+    }
+
+    // Update the specified inode with source data
+    ctx->inode_cache[inode_num] = *source;
+    mark_inode_dirty(inode_num);
+}
+
+// Record that an inode changed, so its inode table block gets written back
+void mark_inode_dirty ( int inode_num ) {
+
+    // An inode can straddle two blocks of the table
+    size_t first = (size_t)inode_num * sizeof(inode);
+    size_t last = first + sizeof(inode) - 1;
+    for (size_t k = first / DISK_BLOCK_SIZE; k <= last / DISK_BLOCK_SIZE; k++) {
+        atomic_fetch_or(&ctx->inode_dirty[k / 64], (uint64_t)1 << (k % 64));
+    }
+}
+
+// Find the first run [*k, *end) of dirty inode table blocks at or after *k.
+// Returns false if there is none.
+static bool next_dirty_run ( int * k , int * end ) {
+
+    int n = INODE_TABLE_BLOCKS;
+    int b = *k;
+    while (b < n) {
+        uint64_t bits = atomic_load(&ctx->inode_dirty[b / 64]) >> (b % 64);
+        if (bits == 0) {
+            b = (b / 64 + 1) * 64; // The rest of this word is clean
+            continue;
+        }
+        b += __builtin_ctzll(bits);
+        break;
+    }
+    if (b >= n) {
+        return false;
+    }
+    int e = b + 1;
+    while (e < n && ((atomic_load(&ctx->inode_dirty[e / 64]) >> (e % 64)) & 1)) {
+        e++;
+    }
+    *k = b;
+    *end = e;
+    return true;
+}
+
+// Record that a block's bitmap bit changed (alloc_lock held)
+void mark_bitmap_dirty ( int block_num ) {
+
+    int w = block_num / 64;
+    if (w < ctx->bitmap_dirty_lo) {
+        ctx->bitmap_dirty_lo = w;
+    }
+    if (w + 1 > ctx->bitmap_dirty_hi) {
+        ctx->bitmap_dirty_hi = w + 1;
+    }
+}
+
+// Transfer an iovec array at a byte offset of the disk image
+int dev_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) {
+    return ctx->backend->rw(offset, iov, iovcnt, is_write);
+}
+
+// Transfer several iovec arrays, as one batch where the backend supports it
+static int dev_rw_runs ( struct io_run * runs , int count , bool is_write ) {
+    if (ctx->backend->rw_runs != NULL) {
+        return ctx->backend->rw_runs(runs, count, is_write);
+    }
+    for (int i = 0; i < count; i++) {
+        if (ctx->backend->rw(runs[i].offset, runs[i].iov, runs[i].iovcnt, is_write) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// pread backend: one preadv/pwritev per call
+static int pread_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) {
+
+    // Positional I/O never touches the shared file offset.
+    // Short transfers are resumed until the whole array is done.
+    while (iovcnt > 0) {
+        stat_add(is_write ? STAT(write_syscalls) : STAT(read_syscalls), 1);
+        ssize_t n = is_write ? pwritev(ctx->disk_fd, iov, iovcnt, offset) : preadv(ctx->disk_fd, iov, iovcnt, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1; // I/O error or unexpected end of the image
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// mmap backend: copy between the iovecs and the mapped image
+static int mmap_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) {
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (offset < 0 || offset + (off_t)iov[i].iov_len > DISK_SIZE) {
+            return -1; // Outside the image
+        }
+        if (is_write) {
+            memcpy(ctx->disk_map + offset, iov[i].iov_base, iov[i].iov_len);
+        } else {
+            memcpy(iov[i].iov_base, ctx->disk_map + offset, iov[i].iov_len);
+        }
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+// Unmap and close the calling thread's ring (also run at thread exit)
+static void ring_close ( void * arg ) {
+
+    struct uring_ring* r = arg;
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_map != NULL && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    if (r->sq_map != NULL) {
+        munmap(r->sq_map, r->sq_map_size);
+    }
+    close(r->fd);
+    free(r);
+    my_ring = NULL;
+}
+
+static void ring_make_key () {
+    pthread_key_create(&ring_key, ring_close);
+}
+
+// Give the calling thread its ring on first use. Returns NULL, once and for
+// all for this thread, when the kernel does not offer io_uring.
+static struct uring_ring * ring_attach () {
+
+    if (my_ring_failed) {
+        return NULL;
+    }
+    pthread_once(&ring_key_once, ring_make_key);
+    struct uring_ring* r = calloc(1, sizeof(struct uring_ring));
+    if (r == NULL) {
+        my_ring_failed = true;
+        return NULL;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (r->fd < 0) {
+        free(r);
+        my_ring_failed = true;
+        return NULL; // No io_uring in this kernel, or not allowed
+    }
+
+    // Map the submission and completion rings, which share one mapping on
+    // kernels with IORING_FEAT_SINGLE_MMAP, and the submission entries
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) {
+            r->sq_map_size = r->cq_map_size;
+        }
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sq = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sq_map = sq == MAP_FAILED ? NULL : sq;
+    if (r->sq_map != NULL && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_map = r->sq_map;
+    } else if (r->sq_map != NULL) {
+        void* cq = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        r->cq_map = cq == MAP_FAILED ? NULL : cq;
+    }
+    void* sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    r->sqes = sqes == MAP_FAILED ? NULL : sqes;
+    if (r->sq_map == NULL || r->cq_map == NULL || r->sqes == NULL) {
+        ring_close(r);
+        my_ring_failed = true;
+        return NULL;
+    }
+
+    char* sq_ring = r->sq_map;
+    char* cq_ring = r->cq_map;
+    r->sq_head = (unsigned*)(sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq_ring + p.cq_off.cqes);
+
+    pthread_setspecific(ring_key, r); // so ring_close runs at thread exit
+    my_ring = r;
+    return r;
+}
+
+// Check a completed run; a short transfer is finished with preadv/pwritev
+static int uring_finish_run ( struct io_run * run , int res , bool is_write ) {
+
+    if (res < 0) {
+        return -1; // I/O error
+    }
+    size_t done = res;
+    while (run->iovcnt > 0 && done >= run->iov->iov_len) {
+        done -= run->iov->iov_len;
+        run->offset += run->iov->iov_len;
+        run->iov++;
+        run->iovcnt--;
+    }
+    if (run->iovcnt == 0) {
+        return 0;
+    }
+    run->iov->iov_base = (char*)run->iov->iov_base + done;
+    run->iov->iov_len -= done;
+    return pread_rw(run->offset + done, run->iov, run->iovcnt, is_write);
+}
+
+// io_uring backend: queue every run of the batch, then submit them with one
+// io_uring_enter that also waits for all of them to complete
+static int uring_rw_runs ( struct io_run * runs , int count , bool is_write ) {
+
+    struct uring_ring* r = my_ring;
+    if (r == NULL && (r = ring_attach()) == NULL) {
+        // This thread has no ring, so it does the runs one by one
+        for (int i = 0; i < count; i++) {
+            if (pread_rw(runs[i].offset, runs[i].iov, runs[i].iovcnt, is_write) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    int result = 0;
+    for (int first = 0; first < count; first += URING_DEPTH) {
+        int n = count - first < URING_DEPTH ? count - first : URING_DEPTH;
+
+        // Only this thread touches its ring, and all earlier entries have
+        // completed, so there is room for the whole batch
+        unsigned tail = *r->sq_tail;
+        for (int k = 0; k < n; k++) {
+            unsigned idx = tail & *r->sq_mask;
+            struct io_uring_sqe* sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = ctx->disk_fd;
+            sqe->off = runs[first + k].offset;
+            sqe->addr = (uintptr_t)runs[first + k].iov;
+            sqe->len = runs[first + k].iovcnt;
+            sqe->user_data = first + k;
+            r->sq_array[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        stat_add(STAT(uring_requests), n);
+
+        int to_submit = n, pending = n;
+        while (pending > 0) {
+            unsigned head = *r->cq_head;
+            unsigned ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != ready; head++, pending--) {
+                struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+                if (uring_finish_run(&runs[cqe->user_data], cqe->res, is_write) < 0) {
+                    result = -1;
+                }
+            }
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+            if (pending == 0) {
+                break;
+            }
+
+            stat_add(STAT(uring_submits), 1);
+            int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret >= 0) {
+                to_submit -= ret;
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY && to_submit > 0) {
+                // Nothing more was consumed: take the unsubmitted entries
+                // back, but still wait for those already in flight
+                tail -= to_submit;
+                __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+                pending -= to_submit;
+                to_submit = 0;
+                result = -1;
+            }
+        }
+    }
+    return result;
+}
+
+// io_uring backend for a single run
+static int uring_rw ( off_t offset , struct iovec * iov , int iovcnt , bool is_write ) {
+    struct io_run run = { offset, iov, iovcnt };
+    return uring_rw_runs(&run, 1, is_write);
+}
+#endif
+
+// Close the disk image and drop its mapping, if any
+void release_disk () {
+
+    if (ctx->disk_map != NULL) {
+        munmap(ctx->disk_map, DISK_SIZE);
+        ctx->disk_map = NULL;
+    }
+    if (ctx->disk_fd >= 0) {
+        close(ctx->disk_fd);
+        ctx->disk_fd = -1;
+    }
+
+    // Back to the default backend, with nothing allocated for the geometry.
+    // No thread holds or waits for an inode lock here: unmount_context has
+    // waited for every holder with lock_all_inodes_exclusive, a failed mount
+    // never handed one out, and table_lock, held exclusively, keeps new ones out.
+    if (ctx->inode_locks != NULL) {
+        for (int i = 0; i < DISK_INODES; i++) {
+            pthread_rwlock_destroy(&ctx->inode_locks[i]);
+        }
+    }
+    free(ctx->inode_locks);
+    free(ctx->bitmap_buf);
+    free(ctx->inode_buf);
+    free((void*)ctx->inode_dirty);
+    free(ctx->journal_buf);
+    free(ctx->bcache_data);
+    free(ctx->name_hash_head);
+    free(ctx->name_hash_next);
+    free(ctx->name_hash_value);
+    free(ctx->inode_used_map);
+    free(ctx->sorted_names);
+    free(ctx->inode_generation);
+    free(ctx->inode_version);
+    free((void*)ctx->inode_extents);
+    free(ctx->readahead);
+    free(ctx->snap_refs);
+    free(ctx->snap_pinned);
+    free(ctx->block_refs);
+    free(ctx->dedup_table);
+    free(ctx->dedup_indexed);
+    ctx->inode_locks = NULL;
+    ctx->bitmap_buf = NULL;
+    ctx->inode_buf = NULL;
+    ctx->inode_dirty = NULL;
+    ctx->journal_buf = NULL;
+    ctx->bcache_data = NULL;
+    ctx->name_hash_head = NULL;
+    ctx->name_hash_next = NULL;
+    ctx->name_hash_value = NULL;
+    ctx->inode_used_map = NULL;
+    ctx->sorted_names = NULL;
+    ctx->sorted_valid = false;
+    ctx->inode_generation = NULL;
+    ctx->inode_version = NULL;
+    ctx->inode_extents = NULL;
+    ctx->readahead = NULL;
+    ctx->snap_refs = NULL;
+    ctx->snap_pinned = NULL;
+    ctx->pinned_free = 0;
+    ctx->snapshot_count = 0;
+    ctx->block_refs = NULL;
+    ctx->dedup_table = NULL;
+    ctx->dedup_indexed = NULL;
+    ctx->dedup = false;
+    ctx->backend = &pread_backend;
+    ctx->journal_enabled = false;
+    ctx->sb_cache = &ctx->sb_buf;
+    ctx->bitmap_cache = NULL;
+    ctx->inode_cache = NULL;
+}
+
+// Allocate everything a mount sizes by ctx->geo. A mapped image needs no
+// metadata buffers and no block cache. Returns -1 when out of memory; the
+// caller's release_disk frees whatever was allocated.
+static int mount_alloc ( bool mapped ) {
+
+    size_t words = (INODE_TABLE_BLOCKS + 63) / 64;
+    ctx->inode_dirty = calloc(words, sizeof(uint64_t));
+    ctx->name_hash_mask = 1;
+    while (ctx->name_hash_mask + 1 < 2u * DISK_INODES) {
+        ctx->name_hash_mask = ctx->name_hash_mask * 2 + 1;
+    }
+    ctx->name_hash_head = malloc((ctx->name_hash_mask + 1) * sizeof(int));
+    ctx->name_hash_next = malloc(DISK_INODES * sizeof(int));
+    ctx->name_hash_value = malloc(DISK_INODES * sizeof(uint32_t));
+    ctx->inode_used_map = malloc(DISK_INODES / 64 * sizeof(uint64_t));
+    ctx->sorted_names = malloc(DISK_INODES * sizeof(int));
+    ctx->inode_generation = calloc(DISK_INODES, sizeof(unsigned));
+    ctx->inode_version = calloc(DISK_INODES, sizeof(unsigned));
+    ctx->inode_extents = malloc(DISK_INODES * sizeof(int));
+    ctx->readahead = calloc(DISK_INODES, sizeof(struct readahead));
+    if (ctx->inode_dirty == NULL || ctx->name_hash_head == NULL || ctx->name_hash_next == NULL
+        || ctx->name_hash_value == NULL || ctx->inode_used_map == NULL || ctx->sorted_names == NULL
+        || ctx->inode_generation == NULL || ctx->inode_version == NULL || ctx->inode_extents == NULL
+        || ctx->readahead == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < DISK_INODES; i++) {
+        ctx->inode_extents[i] = -1; // Unknown until fs_stat maps the file
+    }
+
+    // Aligned to a block, as the buffers of direct block I/O
+    void* memory;
+    if (ctx->geo.journal_blocks > 0) {
+        if (posix_memalign(&memory, DISK_BLOCK_SIZE, JOURNAL_SLOT_BYTES) != 0) {
+            return -1;
+        }
+        ctx->journal_buf = memory;
+    }
+    if (!mapped) {
+        if (posix_memalign(&memory, DISK_BLOCK_SIZE, (size_t)BCACHE_BUFFERS * DISK_BLOCK_SIZE) != 0) {
+            return -1;
+        }
+        ctx->bcache_data = memory;
+        memset(memory, 0, (size_t)BCACHE_BUFFERS * DISK_BLOCK_SIZE); // fault the pages in now rather than on the first writes
+        ctx->bitmap_buf = malloc(BITMAP_BYTES);
+        ctx->inode_buf = malloc(INODE_TABLE_BYTES);
+        if (ctx->bitmap_buf == NULL || ctx->inode_buf == NULL) {
+            return -1;
+        }
+        ctx->bitmap_cache = ctx->bitmap_buf;
+        ctx->inode_cache = ctx->inode_buf;
+    }
+
+    ctx->inode_locks = malloc(DISK_INODES * sizeof(pthread_rwlock_t));
+    if (ctx->inode_locks == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < DISK_INODES; i++) {
+        pthread_rwlock_init(&ctx->inode_locks[i], NULL);
+    }
+    return 0;
+}
+
+// Entries of a scratch block list, growing it to count (see BLOCK_LIST).
+// Returns NULL when out of memory.
+static int * block_list_reserve ( struct block_list * list , int count ) {
+    if (count <= BLOCK_LIST_LOCAL) {
+        return list->local;
+    }
+    if (count > list->capacity) {
+        free(list->entries);
+        list->entries = malloc((size_t)count * sizeof(int));
+        list->capacity = list->entries != NULL ? count : 0;
+    }
+    return list->entries;
+}
+
+// Free a scratch block list when it goes out of scope
+static void block_list_release ( struct block_list * list ) {
+    free(list->entries);
+}
+
+// Room for resize_file_blocks taking a file to blocks_needed blocks: the
+// block list, with space after it for new pointer blocks, and *meta, the
+// pointer block list. Returns NULL when out of memory.
+static int * resize_lists ( struct block_list * list , const inode * node , int blocks_needed , int ** meta ) {
+    int blocks_owned = FILE_BLOCKS(node);
+    int most = blocks_owned > blocks_needed ? blocks_owned : blocks_needed;
+    int pointers = pointer_blocks_for(most);
+    int* map = block_list_reserve(list, most + 2 * pointers);
+    if (map != NULL) {
+        *meta = map + most + pointers;
+    }
+    return map;
+}
+
+// Set up a context with nothing mounted
+static void context_init ( fs_context * fs ) {
+    memset(fs, 0, sizeof(*fs));
+    fs->disk_fd = -1;
+    fs->sb_cache = &fs->sb_buf;
+    fs->backend = &pread_backend;
+    fs->journal_sequence = 1;
+    fs->lru_head = fs->lru_tail = -1;
+
+    pthread_mutex_init(&fs->sync_lock, NULL);
+    pthread_cond_init(&fs->sync_cond, NULL);
+    pthread_rwlock_init(&fs->table_lock, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->bcache_lock, NULL);
+    pthread_cond_init(&fs->bcache_cond, NULL);
+    pthread_cond_init(&fs->flusher_cond, NULL);
+    pthread_mutex_init(&fs->ra_lock, NULL);
+    pthread_cond_init(&fs->ra_cond, NULL);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_init(&fs->open_files[i].lock, NULL);
+    }
+    pthread_mutex_init(&fs->handles_lock, NULL);
+    pthread_mutex_init(&fs->sorted_lock, NULL);
+    pthread_rwlock_init(&fs->snap_lock, NULL);
+    pthread_mutex_init(&fs->dedup_lock, NULL);
+}
+
+// Tear down an unmounted context, including handles that were never closed
+static void context_destroy ( fs_context * fs ) {
+    pthread_mutex_destroy(&fs->dedup_lock);
+    pthread_rwlock_destroy(&fs->snap_lock);
+    pthread_mutex_destroy(&fs->sorted_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        free(fs->open_files[i].map);
+        pthread_mutex_destroy(&fs->open_files[i].lock);
+    }
+    pthread_mutex_destroy(&fs->handles_lock);
+    pthread_cond_destroy(&fs->ra_cond);
+    pthread_mutex_destroy(&fs->ra_lock);
+    pthread_cond_destroy(&fs->flusher_cond);
+    pthread_cond_destroy(&fs->bcache_cond);
+    pthread_mutex_destroy(&fs->bcache_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_rwlock_destroy(&fs->table_lock);
+    pthread_cond_destroy(&fs->sync_cond);
+    pthread_mutex_destroy(&fs->sync_lock);
+}
+
+static void init_default_context () {
+    context_init(&default_context);
+}
+
+// The context of the fs_* calls, set up by the first of them
+static fs_context * default_fs () {
+    pthread_once(&default_context_once, init_default_context);
+    return &default_context;
+}
+
+// Restore the caller's context when an fs_* call returns (see USE_CONTEXT)
+static void context_leave ( fs_context ** saved ) {
+    ctx = *saved;
+}
+
+// Resolve a filename and lock its inode (shared or exclusive)
+int lookup_and_lock ( const char * filename , bool exclusive ) {
+
+    pthread_rwlock_rdlock(&ctx->table_lock);
+    if (ctx->is_mounted == false) {
+        pthread_rwlock_unlock(&ctx->table_lock);
+        return -3; // Filesystem not mounted
+    }
+
+    // The inode lock is taken before table_lock is dropped, so the inode
+    // cannot be deleted or reused between the lookup and the caller's I/O
+    int inode_index = find_inode(filename);
+    if (inode_index >= 0) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(&ctx->inode_locks[inode_index]);
+        } else {
+            pthread_rwlock_rdlock(&ctx->inode_locks[inode_index]);
+        }
+    }
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    return inode_index; // -1 if not found
+}
+
+// Lock an open handle and its inode (shared or exclusive)
+static int lock_handle ( int fd , bool exclusive , struct open_file ** out ) {
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -3; // Invalid handle
+    }
+    struct open_file* h = &ctx->open_files[fd];
+    pthread_mutex_lock(&h->lock);
+    if (!h->open) {
+        pthread_mutex_unlock(&h->lock);
+        return -3; // Not open
+    }
+
+    // Same rule as lookup_and_lock: the inode lock is taken before
+    // table_lock is dropped, so the inode cannot change hands in between
+    pthread_rwlock_rdlock(&ctx->table_lock);
+    int result = h->inode;
+    if (ctx->is_mounted == false || h->mount != ctx->mount_id) {
+        result = -3; // Not mounted, or the handle is from an earlier mount
+    } else if (ctx->inode_generation[h->inode] != h->generation) {
+        result = -1; // The file was deleted
+    } else if (exclusive) {
+        pthread_rwlock_wrlock(&ctx->inode_locks[h->inode]);
+    } else {
+        pthread_rwlock_rdlock(&ctx->inode_locks[h->inode]);
+    }
+    pthread_rwlock_unlock(&ctx->table_lock);
+
+    if (result < 0) {
+        pthread_mutex_unlock(&h->lock);
+        return result;
+    }
+    *out = h;
+    return result;
+}
+
+// Release the locks taken by lock_handle
+static void unlock_handle ( struct open_file * h ) {
+    pthread_rwlock_unlock(&ctx->inode_locks[h->inode]);
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Lock every inode shared, so that no write is in flight (table_lock held, at least shared).
+// Only used slots can have one: an inode is locked only after its lookup
+// under table_lock, and delete_inode waits for it before freeing the slot.
+// The used slots cannot change while table_lock is held, so the cost
+// follows the number of files, not the size of the inode table.
+void lock_all_inodes () {
+    for (int w = 0; w < DISK_INODES / 64; w++) {
+        for (uint64_t used = ctx->inode_used_map[w]; used != 0; used &= used - 1) {
+            pthread_rwlock_rdlock(&ctx->inode_locks[w * 64 + __builtin_ctzll(used)]);
+        }
+    }
+}
+
+// Lock every inode exclusively, so that no read or write is in flight
+// either (table_lock held exclusively). A reader keeps its inode lock,
+// but not table_lock, for the whole of its I/O, so only this waits for
+// it; unmount needs it before anything a reader uses goes away.
+void lock_all_inodes_exclusive () {
+    for (int w = 0; w < DISK_INODES / 64; w++) {
+        for (uint64_t used = ctx->inode_used_map[w]; used != 0; used &= used - 1) {
+            pthread_rwlock_wrlock(&ctx->inode_locks[w * 64 + __builtin_ctzll(used)]);
+        }
+    }
+}
+
+// Release the locks taken by lock_all_inodes or lock_all_inodes_exclusive (table_lock still held)
+void unlock_all_inodes () {
+    for (int w = 0; w < DISK_INODES / 64; w++) {
+        for (uint64_t used = ctx->inode_used_map[w]; used != 0; used &= used - 1) {
+            pthread_rwlock_unlock(&ctx->inode_locks[w * 64 + __builtin_ctzll(used)]);
+        }
+    }
+}
+
+// Transfer blocks that each have their own buffer
+int transfer_blocks ( const int * blocks , struct iovec * iov , int count , bool is_write ) {
+
+    // Gather each run of physically adjacent blocks into one iovec array,
+    // so a contiguous file costs a single preadv/pwritev. Only a full-block
+    // buffer can be followed by another one in the same run. The runs are
+    // handed to the backend together, so io_uring submits them as one batch.
+    struct io_run runs[IO_RUNS_PER_BATCH];
+    int nruns = 0;
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run
+               && iov[i + run - 1].iov_len == (size_t)DISK_BLOCK_SIZE) {
+            run++;
+        }
+
+        runs[nruns].offset = (off_t)blocks[i] * DISK_BLOCK_SIZE;
+        runs[nruns].iov = &iov[i];
+        runs[nruns].iovcnt = run;
+        nruns++;
+        i += run;
+        if (nruns == IO_RUNS_PER_BATCH || i == count) {
+            if (dev_rw_runs(runs, nruns, is_write) < 0) {
+                return -1;
+            }
+            nruns = 0;
+        }
+    }
+    return 0;
+}
+
+// Number of indirect blocks a file of nblocks data blocks needs
+static int pointer_blocks_for ( int nblocks ) {
+    if (nblocks <= MAX_DIRECT_BLOCKS) {
+        return 0;
+    }
+    if (nblocks <= INDIRECT_LIMIT) {
+        return 1; // The single indirect block
+    }
+    // Both indirect blocks plus one child of the double indirect block per DISK_POINTERS blocks
+    return 2 + (nblocks - INDIRECT_LIMIT + DISK_POINTERS - 1) / DISK_POINTERS;
+}
+
+// Collect the first count data blocks of a file, and its indirect blocks
+static int map_file_blocks ( const inode * node , int count , int * data , int * meta ) {
+
+    // Every index is checked before use, so a corrupt inode or indirect
+    // block is reported instead of sending I/O outside the data region
+    int direct = count < MAX_DIRECT_BLOCKS ? count : MAX_DIRECT_BLOCKS;
+    memcpy(data, node->blocks, direct * sizeof(int));
+    if (!blocks_valid(data, direct)) {
+        return -1;
+    }
+    if (count <= MAX_DIRECT_BLOCKS) {
+        return 0;
+    }
+
+    // The indirect blocks are read through the block cache like data, so a
+    // large sequential read does not go back to the disk for them
+    int single = (count < INDIRECT_LIMIT ? count : INDIRECT_LIMIT) - MAX_DIRECT_BLOCKS;
+    if (!blocks_valid(&node->indirect, 1)
+        || cached_read(&node->indirect, 1, (char*)&data[MAX_DIRECT_BLOCKS], single * sizeof(int)) < 0
+        || !blocks_valid(&data[MAX_DIRECT_BLOCKS], single)) {
+        return -1;
+    }
+    if (meta != NULL) {
+        meta[0] = node->indirect;
+    }
+    if (count <= INDIRECT_LIMIT) {
+        return 0;
+    }
+
+    int children_count = pointer_blocks_for(count) - 2;
+    int children[children_count]; // at most DISK_POINTERS
+    if (!blocks_valid(&node->double_indirect, 1)
+        || cached_read(&node->double_indirect, 1, (char*)children, children_count * sizeof(int)) < 0
+        || !blocks_valid(children, children_count)) {
+        return -1;
+    }
+    for (int k = 0; k < children_count; k++) {
+        int first = INDIRECT_LIMIT + k * DISK_POINTERS;
+        int n = count - first < DISK_POINTERS ? count - first : DISK_POINTERS;
+        if (cached_read(&children[k], 1, (char*)&data[first], n * sizeof(int)) < 0
+            || !blocks_valid(&data[first], n)) {
+            return -1;
+        }
+    }
+    if (meta != NULL) {
+        meta[1] = node->double_indirect;
+        memcpy(&meta[2], children, children_count * sizeof(int));
+    }
+    return 0;
+}
+
+// Check that every block in a list is a data block
+static bool blocks_valid ( const int * blocks , int count ) {
+    for (int i = 0; i < count; i++) {
+        if (blocks[i] < DATA_START_BLOCK || blocks[i] >= DISK_BLOCKS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Write the indirect blocks describing a file's block list
+static int store_pointer_blocks ( const int * data , int count , const int * meta ) {
+
+    // Each pointer block holds a slice of the block list as it is laid out
+    // in memory; entries past the end of the file are left zero
+    if (count <= MAX_DIRECT_BLOCKS) {
+        return 0;
+    }
+    int single = (count < INDIRECT_LIMIT ? count : INDIRECT_LIMIT) - MAX_DIRECT_BLOCKS;
+    if (cached_write(&meta[0], 1, (const char*)&data[MAX_DIRECT_BLOCKS], single * sizeof(int)) < 0) {
+        return -1;
+    }
+    if (count <= INDIRECT_LIMIT) {
+        return 0;
+    }
+
+    int children_count = pointer_blocks_for(count) - 2;
+    if (cached_write(&meta[1], 1, (const char*)&meta[2], children_count * sizeof(int)) < 0) {
+        return -1;
+    }
+    for (int k = 0; k < children_count; k++) {
+        int first = INDIRECT_LIMIT + k * DISK_POINTERS;
+        int n = count - first < DISK_POINTERS ? count - first : DISK_POINTERS;
+        if (cached_write(&meta[2 + k], 1, (const char*)&data[first], n * sizeof(int)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ==============================================================================
+
+// Block Cache
+
+// ==============================================================================
+
+// Unlink a buffer from the LRU list (bcache_lock held)
+static void lru_unlink ( int b ) {
+    if (ctx->bcache[b].lru_prev >= 0) {
+        ctx->bcache[ctx->bcache[b].lru_prev].lru_next = ctx->bcache[b].lru_next;
+    } else {
+        ctx->lru_head = ctx->bcache[b].lru_next;
+    }
+    if (ctx->bcache[b].lru_next >= 0) {
+        ctx->bcache[ctx->bcache[b].lru_next].lru_prev = ctx->bcache[b].lru_prev;
+    } else {
+        ctx->lru_tail = ctx->bcache[b].lru_prev;
+    }
+}
+
+// Move a buffer to the most recently used end (bcache_lock held)
+static void lru_touch ( int b ) {
+    lru_unlink(b);
+    ctx->bcache[b].lru_prev = -1;
+    ctx->bcache[b].lru_next = ctx->lru_head;
+    if (ctx->lru_head >= 0) {
+        ctx->bcache[ctx->lru_head].lru_prev = b;
+    }
+    ctx->lru_head = b;
+    if (ctx->lru_tail < 0) {
+        ctx->lru_tail = b;
+    }
+}
+
+// Find the buffer caching a block (bcache_lock held)
+static int bcache_lookup ( int block_num ) {
+    for (int b = ctx->bcache_hash[block_num % BCACHE_HASH_BUCKETS]; b >= 0; b = ctx->bcache[b].hash_next) {
+        if (ctx->bcache[b].block == block_num) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+// Remove a buffer from its hash chain (bcache_lock held)
+static void bcache_unhash ( int b ) {
+    int* link = &ctx->bcache_hash[ctx->bcache[b].block % BCACHE_HASH_BUCKETS];
+    while (*link >= 0 && *link != b) {
+        link = &ctx->bcache[*link].hash_next;
+    }
+    if (*link == b) {
+        *link = ctx->bcache[b].hash_next;
+    }
+    if (ctx->bcache[b].dirty) {
+        ctx->bcache_dirty_count--;
+    }
+    ctx->bcache[b].block = -1;
+    ctx->bcache[b].valid = false;
+    ctx->bcache[b].dirty = false;
+    ctx->bcache[b].prefetched = false;
+}
+
+// Reset the block cache to empty
+void bcache_reset () {
+
+    pthread_mutex_lock(&ctx->bcache_lock);
+    memset(ctx->bcache_hash, -1, sizeof(ctx->bcache_hash));
+    for (int b = 0; b < BCACHE_BUFFERS; b++) {
+        ctx->bcache[b].block = -1;
+        ctx->bcache[b].valid = false;
+        ctx->bcache[b].dirty = false;
+        ctx->bcache[b].busy = false;
+        ctx->bcache[b].refs = 0;
+        ctx->bcache[b].prefetched = false;
+        ctx->bcache[b].hash_next = -1;
+        ctx->bcache[b].lru_prev = b - 1;
+        ctx->bcache[b].lru_next = b + 1 < BCACHE_BUFFERS ? b + 1 : -1;
+    }
+    ctx->lru_head = 0;
+    ctx->lru_tail = BCACHE_BUFFERS - 1;
+    ctx->bcache_dirty_count = 0;
+    ctx->bcache_enabled = (ctx->backend != &mmap_backend);
+    pthread_mutex_unlock(&ctx->bcache_lock);
+}
+
+// Pin the buffer for a block, assigning an evicted buffer on a miss (bcache_lock held).
+// Returns -1 when the cache is off or every buffer is pinned; the caller then
+// does direct I/O. Only writers wait for a busy buffer, and they never hold a
+// busy buffer themselves, so waiting here cannot deadlock.
+static int bcache_grab ( int block_num , bool for_write ) {
+
+    while (ctx->bcache_enabled) {
+        int b = bcache_lookup(block_num);
+        if (b >= 0) {
+            if (for_write && ctx->bcache[b].busy) {
+                pthread_cond_wait(&ctx->bcache_cond, &ctx->bcache_lock); // Writeback in flight
+                continue;
+            }
+            ctx->bcache[b].refs++;
+            lru_touch(b);
+            return b;
+        }
+
+        // Evict the least recently used buffer that nobody is using. With
+        // write-behind a clean one goes first, leaving dirty ones to the flusher.
+        int victim = -1;
+        for (int pass = ctx->write_behind ? 0 : 1; pass < 2 && victim < 0; pass++) {
+            victim = ctx->lru_tail;
+            while (victim >= 0 && (ctx->bcache[victim].refs > 0 || ctx->bcache[victim].busy || (pass == 0 && ctx->bcache[victim].dirty))) {
+                victim = ctx->bcache[victim].lru_prev;
+            }
+        }
+        if (victim < 0) {
+            return -1; // Everything is pinned
+        }
+
+        if (ctx->bcache[victim].dirty) {
+            // Write the victim back without holding the cache lock, then look again
+            pthread_cond_signal(&ctx->flusher_cond); // The flusher is falling behind
+            ctx->bcache[victim].busy = true;
+            pthread_mutex_unlock(&ctx->bcache_lock);
+            struct iovec iov = { BUF_DATA(victim), DISK_BLOCK_SIZE };
+            int result = dev_rw((off_t)ctx->bcache[victim].block * DISK_BLOCK_SIZE, &iov, 1, true);
+            stat_add(STAT(cache_writebacks), 1);
+            pthread_mutex_lock(&ctx->bcache_lock);
+            ctx->bcache[victim].busy = false;
+            pthread_cond_broadcast(&ctx->bcache_cond);
+            if (result < 0) {
+                return -1; // Keep the dirty data; the caller goes direct
+            }
+            ctx->bcache[victim].dirty = false;
+            ctx->bcache_dirty_count--;
+            continue;
+        }
+
+        if (ctx->bcache[victim].block >= 0) {
+            bcache_unhash(victim);
+        }
+        ctx->bcache[victim].block = block_num;
+        ctx->bcache[victim].hash_next = ctx->bcache_hash[block_num % BCACHE_HASH_BUCKETS];
+        ctx->bcache_hash[block_num % BCACHE_HASH_BUCKETS] = victim;
+        ctx->bcache[victim].refs = 1;
+        lru_touch(victim);
+        return victim;
+    }
+    return -1;
+}
+
+// Read up to IO_BATCH_BLOCKS blocks through the block cache
+static int cached_read_batch ( const int * blocks , int count , char * dst , int size ) {
+
+    int buf_of[IO_BATCH_BLOCKS]; // pinned buffer per block, -1 if none
+    bool filling[IO_BATCH_BLOCKS];
+    int io_blocks[IO_BATCH_BLOCKS];
+    struct iovec iov[IO_BATCH_BLOCKS];
+    int io_count = 0;
+    int prefetch_hits = 0;
+
+    // Pin hits and collect misses. A miss is read into a fresh buffer, or
+    // straight into dst when no buffer is free or another thread is
+    // already filling that block.
+    pthread_mutex_lock(&ctx->bcache_lock);
+    for (int i = 0; i < count; i++) {
+        int chunk = size - i * DISK_BLOCK_SIZE;
+        chunk = chunk < DISK_BLOCK_SIZE ? chunk : DISK_BLOCK_SIZE;
+        int b = bcache_grab(blocks[i], false);
+        filling[i] = false;
+        while (b >= 0 && ctx->bcache[b].busy && ctx->bcache[b].prefetched) {
+            // Read-ahead is filling it: wait rather than read it twice. The
+            // read-ahead never waits for a buffer, so this cannot deadlock.
+            pthread_cond_wait(&ctx->bcache_cond, &ctx->bcache_lock);
+        }
+        if (b >= 0 && ctx->bcache[b].prefetched && ctx->bcache[b].valid) {
+            ctx->bcache[b].prefetched = false;
+            prefetch_hits++;
+        }
+        if (b >= 0 && !ctx->bcache[b].valid && ctx->bcache[b].refs == 1 && !ctx->bcache[b].busy) {
+            ctx->bcache[b].busy = true; // This thread fills it
+            filling[i] = true;
+            io_blocks[io_count] = blocks[i];
+            iov[io_count].iov_base = BUF_DATA(b);
+            iov[io_count].iov_len = DISK_BLOCK_SIZE;
+            io_count++;
+        } else if (b < 0 || !ctx->bcache[b].valid) {
+            if (b >= 0) {
+                ctx->bcache[b].refs--;
+                b = -1;
+            }
+            io_blocks[io_count] = blocks[i];
+            iov[io_count].iov_base = dst + i * DISK_BLOCK_SIZE;
+            iov[io_count].iov_len = chunk;
+            io_count++;
+        }
+        buf_of[i] = b;
+    }
+    bool counted = ctx->bcache_enabled;
+    pthread_mutex_unlock(&ctx->bcache_lock);
+    if (counted) {
+        stat_add(STAT(cache_hits), count - io_count);
+        stat_add(STAT(cache_misses), io_count);
+        stat_add(STAT(readahead_hits), prefetch_hits);
+    }
+
+    // One preadv per run of adjacent missing blocks
+    int result = transfer_blocks(io_blocks, iov, io_count, false);
+
+    // Pinned buffers cannot be evicted or rewritten, so copy out unlocked
+    if (result == 0) {
+        for (int i = 0; i < count; i++) {
+            if (buf_of[i] >= 0) {
+                int chunk = size - i * DISK_BLOCK_SIZE;
+                memcpy(dst + i * DISK_BLOCK_SIZE, BUF_DATA(buf_of[i]), chunk < DISK_BLOCK_SIZE ? chunk : DISK_BLOCK_SIZE);
+            }
+        }
     }
 
-    // Ensure inode_num is within valid range
-    if (inode_num < 0 || inode_num >= MAX_FILES) {
-        return; // Invalid inode number
+    pthread_mutex_lock(&ctx->bcache_lock);
+    for (int i = 0; i < count; i++) {
+        int b = buf_of[i];
+        if (b < 0) {
+            continue;
+        }
+        if (filling[i]) {
+            ctx->bcache[b].busy = false;
+            if (result == 0) {
+                ctx->bcache[b].valid = true;
+            } else {
+                bcache_unhash(b); // Failed fill, forget the buffer
+            }
+        }
+        ctx->bcache[b].refs--;
     }
+    pthread_cond_broadcast(&ctx->bcache_cond);
+    pthread_mutex_unlock(&ctx->bcache_lock);
 
-    // Read the inode table from disk
-    inode inodes[MAX_FILES];
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to the start of the inode table
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
+    return result;
+}
 
-    // Copy the specified inode to target
-    *target = inodes[inode_num];
+// Claim buffers for up to IO_BATCH_BLOCKS blocks for read-ahead, marked
+// busy until bcache_fill, and return how many were claimed. The first
+// demand blocks are the ones the caller is about to read, and are not
+// counted as read ahead. Blocks already cached or being filled are
+// skipped, and so is the rest once no buffer is free: read-ahead never
+// waits and never bypasses the cache. With the mmap backend the kernel is
+// asked to page the blocks in instead, and nothing is claimed.
+static int bcache_reserve ( const int * blocks , int count , int demand , int * bufs , int * io_blocks ) {
+
+    int claimed = 0;
+    pthread_mutex_lock(&ctx->bcache_lock);
+    bool enabled = ctx->bcache_enabled;
+    for (int i = 0; i < count && enabled; i++) {
+        int b = bcache_grab(blocks[i], false);
+        if (b < 0) {
+            break; // Everything is pinned
+        }
+        if (ctx->bcache[b].valid || ctx->bcache[b].refs > 1 || ctx->bcache[b].busy) {
+            ctx->bcache[b].refs--; // Cached already, or a reader is filling it
+            continue;
+        }
+        ctx->bcache[b].busy = true;
+        ctx->bcache[b].prefetched = i >= demand;
+        bufs[claimed] = b;
+        io_blocks[claimed] = blocks[i];
+        claimed++;
+    }
+    pthread_mutex_unlock(&ctx->bcache_lock);
+
+    if (!enabled && ctx->disk_map != NULL) {
+        // Hint each run of adjacent blocks, from the page that holds its start
+        long page = sysconf(_SC_PAGESIZE);
+        for (int i = 0; i < count; ) {
+            int run = 1;
+            while (i + run < count && blocks[i + run] == blocks[i] + run) {
+                run++;
+            }
+            off_t start = (off_t)blocks[i] * DISK_BLOCK_SIZE;
+            off_t aligned = start - start % page;
+            madvise(ctx->disk_map + aligned, (size_t)(start - aligned) + (size_t)run * DISK_BLOCK_SIZE, MADV_WILLNEED);
+            i += run;
+        }
+    }
+    return claimed;
 }
 
-// Write an inode to disk
-void write_inode ( int inode_num , const inode * source ) {
+// Read the blocks claimed by bcache_reserve into their buffers, one preadv
+// per run, and release them
+static void bcache_fill ( const int * bufs , const int * blocks , int count ) {
 
-    // Read the inode table from disk
-    inode inodes[MAX_FILES];
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move to the start of the inode table
-    read(disk_fd, inodes, sizeof(inodes)); // Read the inode table
+    struct iovec iov[IO_BATCH_BLOCKS];
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = BUF_DATA(bufs[i]);
+        iov[i].iov_len = DISK_BLOCK_SIZE;
+    }
+    int result = transfer_blocks(blocks, iov, count, false);
 
-    // Update the specified inode with source data
-    inodes[inode_num] = *source;
+    int ahead = 0;
+    pthread_mutex_lock(&ctx->bcache_lock);
+    for (int i = 0; i < count; i++) {
+        int b = bufs[i];
+        ctx->bcache[b].busy = false;
+        if (result == 0) {
+            ctx->bcache[b].valid = true;
+            ahead += ctx->bcache[b].prefetched;
+        } else {
+            bcache_unhash(b); // Failed fill, forget the buffer
+        }
+        ctx->bcache[b].refs--;
+    }
+    pthread_cond_broadcast(&ctx->bcache_cond);
+    pthread_mutex_unlock(&ctx->bcache_lock);
+    stat_add(STAT(readahead_blocks), ahead);
+}
+
+// Write up to IO_BATCH_BLOCKS blocks into the block cache
+static int cached_write_batch ( const int * blocks , int count , const char * src , int size ) {
+
+    int buf_of[IO_BATCH_BLOCKS];
+    int io_blocks[IO_BATCH_BLOCKS];
+    struct iovec iov[IO_BATCH_BLOCKS];
+    int io_count = 0;
+
+    pthread_mutex_lock(&ctx->bcache_lock);
+    for (int i = 0; i < count; i++) {
+        buf_of[i] = bcache_grab(blocks[i], true);
+        if (buf_of[i] < 0) {
+            // No buffer to spare: this block goes straight to the image
+            int chunk = size - i * DISK_BLOCK_SIZE;
+            io_blocks[io_count] = blocks[i];
+            iov[io_count].iov_base = (char*)src + i * DISK_BLOCK_SIZE;
+            iov[io_count].iov_len = chunk < DISK_BLOCK_SIZE ? chunk : DISK_BLOCK_SIZE;
+            io_count++;
+        }
+    }
+    bool counted = ctx->bcache_enabled;
+    pthread_mutex_unlock(&ctx->bcache_lock);
+    if (counted) {
+        stat_add(STAT(cache_bypasses), io_count);
+    }
+
+    // The caller holds the inode lock exclusively, so nobody else touches these buffers
+    for (int i = 0; i < count; i++) {
+        if (buf_of[i] >= 0) {
+            int chunk = size - i * DISK_BLOCK_SIZE;
+            chunk = chunk < DISK_BLOCK_SIZE ? chunk : DISK_BLOCK_SIZE;
+            memcpy(BUF_DATA(buf_of[i]), src + i * DISK_BLOCK_SIZE, chunk);
+            memset(BUF_DATA(buf_of[i]) + chunk, 0, DISK_BLOCK_SIZE - chunk);
+        }
+    }
+
+    int result = transfer_blocks(io_blocks, iov, io_count, true);
+
+    pthread_mutex_lock(&ctx->bcache_lock);
+    for (int i = 0; i < count; i++) {
+        int b = buf_of[i];
+        if (b >= 0) {
+            if (!ctx->bcache[b].dirty) {
+                ctx->bcache_dirty_count++;
+            }
+            ctx->bcache[b].valid = true;
+            ctx->bcache[b].dirty = true;
+            ctx->bcache[b].prefetched = false;
+            ctx->bcache[b].refs--;
+        }
+    }
+    if (ctx->write_behind && ctx->bcache_dirty_count >= FLUSH_THRESHOLD) {
+        pthread_cond_signal(&ctx->flusher_cond);
+    }
+    pthread_mutex_unlock(&ctx->bcache_lock);
+
+    return result;
+}
+
+// Read a file's blocks through the block cache
+int cached_read ( const int * blocks , int count , char * dst , int size ) {
+
+    // A batch pins at most IO_BATCH_BLOCKS buffers, so one large read
+    // cannot pin the whole cache
+    for (int i = 0; i < count; i += IO_BATCH_BLOCKS) {
+        int n = count - i < IO_BATCH_BLOCKS ? count - i : IO_BATCH_BLOCKS;
+        int bytes = size - i * DISK_BLOCK_SIZE < n * DISK_BLOCK_SIZE ? size - i * DISK_BLOCK_SIZE : n * DISK_BLOCK_SIZE;
+        if (cached_read_batch(blocks + i, n, dst + (size_t)i * DISK_BLOCK_SIZE, bytes) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write a file's blocks into the block cache
+int cached_write ( const int * blocks , int count , const char * src , int size ) {
+
+    for (int i = 0; i < count; i += IO_BATCH_BLOCKS) {
+        int n = count - i < IO_BATCH_BLOCKS ? count - i : IO_BATCH_BLOCKS;
+        int bytes = size - i * DISK_BLOCK_SIZE < n * DISK_BLOCK_SIZE ? size - i * DISK_BLOCK_SIZE : n * DISK_BLOCK_SIZE;
+        if (cached_write_batch(blocks + i, n, src + (size_t)i * DISK_BLOCK_SIZE, bytes) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Drop a freed block from the block cache without writing it back
+void bcache_forget ( int block_num ) {
+
+    pthread_mutex_lock(&ctx->bcache_lock);
+    int b = bcache_lookup(block_num);
+    while (b >= 0 && ctx->bcache[b].busy) {
+        pthread_cond_wait(&ctx->bcache_cond, &ctx->bcache_lock); // Let an in-flight writeback finish
+        b = bcache_lookup(block_num);
+    }
+    if (b >= 0 && ctx->bcache[b].refs == 0) {
+        bcache_unhash(b);
+    }
+    pthread_mutex_unlock(&ctx->bcache_lock);
+}
+
+// Order buffers by the block they cache
+static int compare_buf_block ( const void * a , const void * b ) {
+    return ctx->bcache[*(const int*)a].block - ctx->bcache[*(const int*)b].block;
+}
+
+// Write back the dirty buffers nobody is using, in block order (bcache_lock
+// held, dropped during the I/O). Returns how many were written, or -1.
+static int bcache_writeback () {
+
+    int dirty[BCACHE_BUFFERS];
+    int count = 0;
+    for (int b = 0; b < BCACHE_BUFFERS; b++) {
+        if (ctx->bcache[b].block >= 0 && ctx->bcache[b].dirty && ctx->bcache[b].refs == 0 && !ctx->bcache[b].busy) {
+            ctx->bcache[b].busy = true; // Writers wait, readers may still copy out
+            dirty[count++] = b;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    qsort(dirty, count, sizeof(int), compare_buf_block);
+
+    // Adjacent dirty blocks go out together in one pwritev
+    int blocks[BCACHE_BUFFERS];
+    struct iovec iov[BCACHE_BUFFERS];
+    for (int i = 0; i < count; i++) {
+        blocks[i] = ctx->bcache[dirty[i]].block;
+        iov[i].iov_base = BUF_DATA(dirty[i]);
+        iov[i].iov_len = DISK_BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&ctx->bcache_lock);
+    int result = transfer_blocks(blocks, iov, count, true);
+    pthread_mutex_lock(&ctx->bcache_lock);
+
+    for (int i = 0; i < count; i++) {
+        ctx->bcache[dirty[i]].busy = false;
+        if (result == 0) {
+            ctx->bcache[dirty[i]].dirty = false;
+            ctx->bcache_dirty_count--;
+        }
+    }
+    pthread_cond_broadcast(&ctx->bcache_cond);
+    return result < 0 ? -1 : count;
+}
+
+// Write every dirty cached block back to the disk image
+int bcache_flush () {
+
+    // Called with every inode locked, so only the flusher can be using a
+    // buffer. Wait for its writes in flight, then take whatever is left.
+    pthread_mutex_lock(&ctx->bcache_lock);
+    for (int b = 0; b < BCACHE_BUFFERS; b++) {
+        if (ctx->bcache[b].dirty && ctx->bcache[b].busy) {
+            pthread_cond_wait(&ctx->bcache_cond, &ctx->bcache_lock);
+            b = -1; // Rescan, the flusher may have moved on to other buffers
+        }
+    }
+    int result = bcache_writeback();
+    pthread_mutex_unlock(&ctx->bcache_lock);
+
+    return result < 0 ? -1 : 0;
+}
+
+// Body of the write-behind flusher thread
+static void* flusher_main ( void * arg ) {
+
+    ctx = arg; // This thread works for the context that started it
+    pthread_mutex_lock(&ctx->bcache_lock);
+    while (!ctx->flusher_stop) {
+        int written = bcache_writeback();
+        if (written > 0) {
+            stat_add(STAT(flusher_writebacks), written);
+        }
+        if (ctx->flusher_stop) {
+            break;
+        }
+        // Keep going while the backlog is large; after an error or when
+        // nothing could be written, wait for the timer rather than spin
+        if (written <= 0 || ctx->bcache_dirty_count < FLUSH_THRESHOLD) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ctx->flusher_cond, &ctx->bcache_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&ctx->bcache_lock);
+    return NULL;
+}
+
+// Start the write-behind flusher thread
+static void start_flusher () {
+
+    pthread_mutex_lock(&ctx->bcache_lock);
+    ctx->flusher_stop = false;
+    if (ctx->bcache_enabled && pthread_create(&ctx->flusher_thread, NULL, flusher_main, ctx) == 0) {
+        ctx->write_behind = true;
+    } // Otherwise every write stays synchronous, as without the flag
+    pthread_mutex_unlock(&ctx->bcache_lock);
+}
+
+// Stop the write-behind flusher thread, leaving any dirty buffers to bcache_flush
+static void stop_flusher () {
+
+    pthread_mutex_lock(&ctx->bcache_lock);
+    bool running = ctx->write_behind;
+    ctx->flusher_stop = true;
+    ctx->write_behind = false;
+    pthread_cond_signal(&ctx->flusher_cond);
+    pthread_mutex_unlock(&ctx->bcache_lock);
+    if (running) {
+        pthread_join(ctx->flusher_thread, NULL);
+    }
+}
+
+// Body of the read-ahead thread: serve requests in order until stopped.
+// Every queued request holds busy buffers, so the queue is always drained.
+static void* readahead_main ( void * arg ) {
+
+    ctx = arg; // This thread works for the context that started it
+    pthread_mutex_lock(&ctx->ra_lock);
+    while (!ctx->ra_stop || ctx->ra_count > 0) {
+        if (ctx->ra_count == 0) {
+            pthread_cond_wait(&ctx->ra_cond, &ctx->ra_lock);
+            continue;
+        }
+        struct readahead_request req = ctx->ra_queue[ctx->ra_head];
+        ctx->ra_head = (ctx->ra_head + 1) % READAHEAD_QUEUE;
+        ctx->ra_count--;
+        pthread_mutex_unlock(&ctx->ra_lock);
+        bcache_fill(req.bufs, req.blocks, req.count);
+        pthread_mutex_lock(&ctx->ra_lock);
+    }
+    pthread_mutex_unlock(&ctx->ra_lock);
+    return NULL;
+}
+
+// Queue a read-ahead request, starting the thread on first use. Returns
+// false if the queue is full or there is no thread, and the caller has to
+// fill the buffers itself.
+static bool readahead_queue ( const struct readahead_request * req ) {
+
+    pthread_mutex_lock(&ctx->ra_lock);
+    if (!ctx->ra_running && !ctx->ra_stop && pthread_create(&ctx->ra_thread, NULL, readahead_main, ctx) == 0) {
+        ctx->ra_running = true;
+    }
+    bool queued = ctx->ra_running && ctx->ra_count < READAHEAD_QUEUE;
+    if (queued) {
+        ctx->ra_queue[(ctx->ra_head + ctx->ra_count) % READAHEAD_QUEUE] = *req;
+        ctx->ra_count++;
+        pthread_cond_signal(&ctx->ra_cond);
+    }
+    pthread_mutex_unlock(&ctx->ra_lock);
+    return queued;
+}
+
+// Stop the read-ahead thread once it has served its pending requests. The
+// caller holds every inode lock, so no new request can arrive meanwhile.
+static void stop_readahead () {
+
+    pthread_mutex_lock(&ctx->ra_lock);
+    bool running = ctx->ra_running;
+    ctx->ra_stop = true;
+    pthread_cond_signal(&ctx->ra_cond);
+    pthread_mutex_unlock(&ctx->ra_lock);
+    if (running) {
+        pthread_join(ctx->ra_thread, NULL);
+    }
+    pthread_mutex_lock(&ctx->ra_lock);
+    ctx->ra_running = false;
+    ctx->ra_stop = false;
+    ctx->ra_head = 0;
+    ctx->ra_count = 0;
+    pthread_mutex_unlock(&ctx->ra_lock);
+}
+
+// Load the superblock, bitmap and inode table into memory
+int load_metadata () {
+
+    // The superblock, bitmap and inode table are contiguous on disk (see
+    // read_geometry), so a single preadv fills all three caches. The unused
+    // tails of the superblock and the bitmap are read into scratch space.
+    char pad[DISK_BLOCK_SIZE];
+    struct iovec iov[5] = {
+        { ctx->sb_cache, sizeof(superblock) },
+        { pad, DISK_BLOCK_SIZE - sizeof(superblock) },
+        { ctx->bitmap_cache, BITMAP_BYTES },
+        { pad, (size_t)ctx->geo.bitmap_blocks * DISK_BLOCK_SIZE - BITMAP_BYTES },
+        { ctx->inode_cache, INODE_TABLE_BYTES },
+    };
+    if (dev_rw(SUPERBLOCK_BLOCK * DISK_BLOCK_SIZE, iov, 5, false) < 0) {
+        return -1;
+    }
+
+    ctx->sb_dirty = false;
+    ctx->bitmap_dirty_lo = DISK_BLOCKS / 64;
+    ctx->bitmap_dirty_hi = 0;
+    memset((void*)ctx->inode_dirty, 0, (INODE_TABLE_BLOCKS + 63) / 64 * sizeof(uint64_t));
+    return 0;
+}
+
+// Write dirty cached metadata back to disk
+int flush_metadata () {
+
+    if (ctx->disk_map != NULL) {
+        // The metadata lives in the shared mapping and is already in the image
+        ctx->sb_dirty = false;
+        ctx->bitmap_dirty_lo = DISK_BLOCKS / 64;
+        ctx->bitmap_dirty_hi = 0;
+        memset((void*)ctx->inode_dirty, 0, (INODE_TABLE_BLOCKS + 63) / 64 * sizeof(uint64_t));
+        return 0;
+    }
+
+    if (ctx->sb_dirty) {
+        struct iovec iov = { ctx->sb_cache, sizeof(superblock) };
+        if (dev_rw(SUPERBLOCK_BLOCK * DISK_BLOCK_SIZE, &iov, 1, true) < 0) {
+            return -1;
+        }
+        ctx->sb_dirty = false;
+    }
+
+    // Only the bitmap words that changed since the last sync
+    if (ctx->bitmap_dirty_lo < ctx->bitmap_dirty_hi) {
+        struct iovec iov = { &ctx->bitmap_cache[ctx->bitmap_dirty_lo], (ctx->bitmap_dirty_hi - ctx->bitmap_dirty_lo) * sizeof(uint64_t) };
+        if (dev_rw((off_t)BITMAP_BLOCK * DISK_BLOCK_SIZE + ctx->bitmap_dirty_lo * sizeof(uint64_t), &iov, 1, true) < 0) {
+            return -1;
+        }
+        ctx->bitmap_dirty_lo = DISK_BLOCKS / 64;
+        ctx->bitmap_dirty_hi = 0;
+    }
+
+    // Only the inode table blocks holding a changed inode; adjacent
+    // dirty blocks are written together
+    int k = 0, end;
+    while (next_dirty_run(&k, &end)) {
+        size_t from = (size_t)k * DISK_BLOCK_SIZE;
+        size_t to = (size_t)end * DISK_BLOCK_SIZE < INODE_TABLE_BYTES ? (size_t)end * DISK_BLOCK_SIZE : INODE_TABLE_BYTES;
+        struct iovec iov = { (char*)ctx->inode_cache + from, to - from };
+        if (dev_rw((off_t)INODE_TABLE_BLOCK * DISK_BLOCK_SIZE + from, &iov, 1, true) < 0) {
+            return -1;
+        }
+        for (; k < end; k++) {
+            atomic_fetch_and(&ctx->inode_dirty[k / 64], ~((uint64_t)1 << (k % 64)));
+        }
+    }
+
+    return 0;
+}
+
+// ==============================================================================
+
+// Journal
+
+// ==============================================================================
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_make_table () {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc32_table[n] = c;
+    }
+}
+
+// CRC-32 (IEEE) of a buffer, continuing from crc (0 to start)
+static uint32_t crc32_update ( uint32_t crc , const void * data , size_t len ) {
+    pthread_once(&crc32_once, crc32_make_table);
+    const unsigned char* p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Byte offset of a journal slot in the image
+static off_t journal_slot_offset ( const struct geometry * g , int slot ) {
+    return ((off_t)g->journal_start + slot * (g->journal_blocks / 2)) * g->block_size;
+}
+
+// Read a journal slot into journal_buf and check its transaction.
+// Transactions older than the superblock's journal_sequence were already
+// complete at a clean unmount and are ignored.
+// Returns the number of record bytes, or -1 if the slot holds none.
+static int journal_read_slot ( const superblock * sb , int slot , uint32_t * sequence ) {
+    const struct geometry* g = &ctx->geo;
+
+    // The header alone rules out an empty or stale slot, which is the
+    // common case and keeps a clean mount to a few small reads
+    struct journal_header h;
+    struct iovec hv = { &h, sizeof(h) };
+    if (dev_rw(journal_slot_offset(g, slot), &hv, 1, false) < 0) {
+        return -1;
+    }
+    if (h.magic != JOURNAL_MAGIC || h.length > JOURNAL_SLOT_BYTES - sizeof(h)
+        || (int32_t)(h.sequence - sb->journal_sequence) < 0) {
+        return -1; // Empty slot
+    }
+    struct iovec iov = { ctx->journal_buf, sizeof(h) + h.length };
+    if (dev_rw(journal_slot_offset(g, slot), &iov, 1, false) < 0) {
+        return -1;
+    }
+    memcpy(&h, ctx->journal_buf, sizeof(h));
+    uint32_t checksum = h.checksum;
+    h.checksum = 0;
+    uint32_t crc = crc32_update(0, &h, sizeof(h));
+    crc = crc32_update(crc, ctx->journal_buf + sizeof(h), h.length);
+    if (crc != checksum) {
+        return -1; // Torn or stale transaction
+    }
+    *sequence = h.sequence;
+    return h.length;
+}
+
+// Replay the newest committed journal transaction into place, before the
+// metadata is loaded. With clear set the journal is emptied afterwards.
+// Returns 0 on success (also when there is no journal), -1 on error.
+static int journal_replay ( bool clear ) {
+
+    superblock sb;
+    struct iovec iov = { &sb, sizeof(sb) };
+    if (dev_rw(SUPERBLOCK_BLOCK * DISK_BLOCK_SIZE, &iov, 1, false) < 0) {
+        return -1;
+    }
+    ctx->journal_sequence = sb.journal_sequence != 0 ? sb.journal_sequence : 1;
+    if (sb.journal_blocks == 0) {
+        return 0; // Image formatted without a journal
+    }
+    if (sb.journal_blocks != ctx->geo.journal_blocks || sb.journal_start != ctx->geo.journal_start) {
+        return -1; // Not the journal read_geometry checked
+    }
+
+    // The newer of the two slots wins; sequence numbers may wrap
+    int best = -1;
+    uint32_t best_sequence = 0;
+    for (int slot = 0; slot < 2; slot++) {
+        uint32_t sequence;
+        if (journal_read_slot(&sb, slot, &sequence) >= 0
+            && (best < 0 || (int32_t)(sequence - best_sequence) > 0)) {
+            best = slot;
+            best_sequence = sequence;
+        }
+    }
+    if (best < 0) {
+        return 0; // Nothing committed
+    }
+    ctx->journal_sequence = best_sequence + 1;
+
+    // Write every record back to its place in the metadata blocks
+    int length = journal_read_slot(&sb, best, &best_sequence);
+    int pos = sizeof(struct journal_header);
+    int end = pos + length;
+    while (pos < end) {
+        struct journal_record r;
+        if (end - pos < (int)sizeof(r)) {
+            return -1;
+        }
+        memcpy(&r, ctx->journal_buf + pos, sizeof(r));
+        pos += sizeof(r);
+        uint32_t metadata_bytes = (uint32_t)DATA_START_BLOCK * DISK_BLOCK_SIZE;
+        if (r.length > (uint32_t)(end - pos) || r.offset > metadata_bytes || r.length > metadata_bytes - r.offset) {
+            return -1; // A record outside the metadata blocks
+        }
+        struct iovec rec = { ctx->journal_buf + pos, r.length };
+        if (dev_rw(r.offset, &rec, 1, true) < 0) {
+            return -1;
+        }
+        pos += r.length;
+    }
+    stat_add(STAT(journal_replays), 1);
+
+    if (clear) {
+        // The replayed metadata must be durable before the journal is gone
+        struct journal_header empty;
+        memset(&empty, 0, sizeof(empty));
+        stat_add(STAT(sync_syscalls), 1);
+        if (fdatasync(ctx->disk_fd) < 0) {
+            return -1;
+        }
+        for (int slot = 0; slot < 2; slot++) {
+            struct iovec hv = { &empty, sizeof(empty) };
+            if (dev_rw(journal_slot_offset(&ctx->geo, slot), &hv, 1, true) < 0) {
+                return -1;
+            }
+        }
+        stat_add(STAT(sync_syscalls), 1);
+        if (fdatasync(ctx->disk_fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Checksum of the superblock (without its checksum field), bitmap and inode table
+static uint32_t metadata_checksum ( const superblock * sb , const void * bitmap , const inode * inodes ) {
+    superblock copy = *sb;
+    copy.checksum = 0;
+    uint32_t crc = crc32_update(0, &copy, sizeof(copy));
+    crc = crc32_update(crc, bitmap, sb->total_blocks / 8);
+    return crc32_update(crc, inodes, (size_t)sb->total_inodes * sizeof(inode));
+}
+
+// Record a clean unmount in the superblock (table_lock held exclusively,
+// everything else already committed)
+static int mark_clean () {
+
+    // The metadata written in place by the last commit must be durable
+    // before the flag claims it is complete
+    if (ctx->journal_enabled) {
+        stat_add(STAT(sync_syscalls), 1);
+        if (fdatasync(ctx->disk_fd) < 0) {
+            return -1;
+        }
+    }
+    ctx->sb_cache->clean = 1;
+    ctx->sb_cache->journal_sequence = ctx->journal_sequence; // The journal so far is complete
+    ctx->sb_cache->checksum = metadata_checksum(ctx->sb_cache, ctx->bitmap_cache, ctx->inode_cache);
+    if (ctx->disk_map == NULL) {
+        struct iovec iov = { ctx->sb_cache, sizeof(superblock) };
+        if (dev_rw(SUPERBLOCK_BLOCK * DISK_BLOCK_SIZE, &iov, 1, true) < 0) {
+            return -1;
+        }
+    }
+    ctx->sb_dirty = false;
+    stat_add(STAT(sync_syscalls), 1);
+    return fdatasync(ctx->disk_fd) < 0 ? -1 : 0;
+}
+
+// Append a record to the transaction being built in journal_buf
+static int journal_add ( int pos , off_t offset , const void * data , size_t length ) {
+    struct journal_record r = { (uint32_t)offset, (uint32_t)length };
+    memcpy(ctx->journal_buf + pos, &r, sizeof(r));
+    memcpy(ctx->journal_buf + pos + sizeof(r), data, length);
+    return pos + sizeof(r) + length;
+}
+
+// Write the dirty metadata to the next journal slot as one transaction
+// (table_lock held exclusively, every inode locked). Returns 1 when a
+// transaction was written, 0 when nothing was dirty, -1 on error.
+static int journal_write () {
+
+    int pos = sizeof(struct journal_header);
+    if (ctx->sb_dirty) {
+        pos = journal_add(pos, SUPERBLOCK_BLOCK * DISK_BLOCK_SIZE, ctx->sb_cache, sizeof(superblock));
+    }
+    if (ctx->bitmap_dirty_lo < ctx->bitmap_dirty_hi) {
+        pos = journal_add(pos, BITMAP_BLOCK * DISK_BLOCK_SIZE + ctx->bitmap_dirty_lo * sizeof(uint64_t),
+                          &ctx->bitmap_cache[ctx->bitmap_dirty_lo], (ctx->bitmap_dirty_hi - ctx->bitmap_dirty_lo) * sizeof(uint64_t));
+    }
+    // One record per run of dirty inode table blocks, as flush_metadata writes them
+    int k = 0, end;
+    while (next_dirty_run(&k, &end)) {
+        size_t from = (size_t)k * DISK_BLOCK_SIZE;
+        size_t to = (size_t)end * DISK_BLOCK_SIZE < INODE_TABLE_BYTES ? (size_t)end * DISK_BLOCK_SIZE : INODE_TABLE_BYTES;
+        pos = journal_add(pos, (off_t)INODE_TABLE_BLOCK * DISK_BLOCK_SIZE + from, (char*)ctx->inode_cache + from, to - from);
+        k = end;
+    }
+    if (pos == sizeof(struct journal_header)) {
+        return 0; // No metadata changed
+    }
+
+    struct journal_header h = { JOURNAL_MAGIC, ctx->journal_sequence, pos - sizeof(struct journal_header), 0 };
+    uint32_t crc = crc32_update(0, &h, sizeof(h));
+    h.checksum = crc32_update(crc, ctx->journal_buf + sizeof(h), h.length);
+    memcpy(ctx->journal_buf, &h, sizeof(h));
+
+    struct iovec iov = { ctx->journal_buf, pos };
+    if (dev_rw(journal_slot_offset(&ctx->geo, ctx->journal_sequence % 2), &iov, 1, true) < 0) {
+        return -1;
+    }
+    ctx->journal_sequence++;
+    stat_add(STAT(journal_commits), 1);
+    return 1;
+}
+
+// Make the dirty metadata durable (table_lock held exclusively, every
+// inode locked, the dirty data already written back).
+//
+// With a journal the changed metadata is first written to the journal as
+// one transaction, and a single fdatasync then makes both the data and the
+// transaction durable. Only after that is the metadata written in place;
+// those writes become durable with the next commit's fdatasync, which is
+// why each commit goes to the other slot and leaves the previous
+// transaction intact until then. After a crash, fs_mount replays the newest
+// complete transaction. Without a journal (images from older formats, or a
+// mapped image) the metadata is written in place before the fdatasync.
+static int commit_metadata () {
+
+    if (ctx->journal_enabled) {
+        int written = journal_write();
+        if (written < 0) {
+            return -1;
+        }
+        stat_add(STAT(sync_syscalls), 1);
+        if (fdatasync(ctx->disk_fd) < 0) {
+            return -1;
+        }
+        return written > 0 ? flush_metadata() : 0;
+    }
+
+    if (flush_metadata() < 0) {
+        return -1;
+    }
+    stat_add(STAT(sync_syscalls), 1);
+    return fdatasync(ctx->disk_fd) < 0 ? -1 : 0;
+}
+
+// ==============================================================================
+
+// Statistics
+
+// ==============================================================================
+
+// Fold an exiting thread's counters into the retired totals
+static void stats_retire ( void * block ) {
+    struct stats_block* mine = block;
+
+    pthread_mutex_lock(&stats_lock);
+    for (size_t i = 0; i < STAT_SLOTS; i++) {
+        stats_retired[i] += atomic_load_explicit(&mine->v[i], memory_order_relaxed);
+    }
+    struct stats_block** link = &stats_list;
+    while (*link != NULL && *link != mine) {
+        link = &(*link)->next;
+    }
+    if (*link == mine) {
+        *link = mine->next;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    free(mine);
+    my_stats = NULL;
+}
+
+static void stats_make_key () {
+    pthread_key_create(&stats_key, stats_retire);
+}
+
+// Give the calling thread its counter block on first use
+static struct stats_block* stats_attach () {
+    pthread_once(&stats_key_once, stats_make_key);
+    struct stats_block* mine = calloc(1, sizeof(struct stats_block));
+    if (mine == NULL) {
+        return NULL; // Counting is best effort
+    }
 
-    // Write the updated inode table back to disk
-    lseek(disk_fd, 2 * BLOCK_SIZE, SEEK_SET); // Move back to the start of the inode table
-    write(disk_fd, inodes, sizeof(inodes)); // Write the updated inode table
-}
\ No newline at end of file
+    pthread_mutex_lock(&stats_lock);
+    mine->next = stats_list;
+    stats_list = mine;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, mine); // so stats_retire runs at thread exit
+    my_stats = mine;
+    return mine;
+}
+
+// Add n to one of the calling thread's counters (see STAT)
+static void stat_add ( size_t slot , unsigned long long n ) {
+    struct stats_block* mine = my_stats;
+    if (mine == NULL && (mine = stats_attach()) == NULL) {
+        return;
+    }
+
+    // Only this thread writes the block, so a relaxed load and store is
+    // enough; fs_stats may read it concurrently but never writes it
+    unsigned long long v = atomic_load_explicit(&mine->v[slot], memory_order_relaxed);
+    atomic_store_explicit(&mine->v[slot], v + n, memory_order_relaxed);
+}
+
+// Monotonic clock in nanoseconds, for the per-operation timers
+static unsigned long long stat_clock () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Record one call of an fs_* entry point and the time it took
+static void op_timer_end ( struct op_timer * t ) {
+    stat_add(STAT(calls) + t->op, 1);
+    stat_add(STAT(nanos) + t->op, stat_clock() - t->start);
+}
+
+// Sum the counters of every thread, live or exited (stats_lock held)
+static void stats_total ( unsigned long long * total ) {
+    memcpy(total, stats_retired, sizeof(stats_retired));
+    for (struct stats_block* b = stats_list; b != NULL; b = b->next) {
+        for (size_t i = 0; i < STAT_SLOTS; i++) {
+            total[i] += atomic_load_explicit(&b->v[i], memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Reads the filesystem's activity counters
+ * 
+ * The per-thread blocks are summed under stats_lock, which the fs_* calls
+ * never take after a thread's first counted event, so reading the stats
+ * does not slow down the operations being measured.
+ * 
+ * @param out Structure to receive the counters
+ * @return 0 on success, -1 if out is NULL
+ */
+int fs_stats(fs_counters* out)
+{
+    if (out == NULL) {
+        return -1; // Invalid parameter
+    }
+
+    unsigned long long total[STAT_SLOTS];
+    pthread_mutex_lock(&stats_lock);
+    stats_total(total);
+    for (size_t i = 0; i < STAT_SLOTS; i++) {
+        total[i] -= stats_baseline[i];
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    memcpy(out, total, sizeof(fs_counters));
+    return 0;
+}
+
+/**
+ * @brief Restarts all activity counters from zero
+ * 
+ * Other threads' blocks are never written from here; the current totals
+ * become the baseline that fs_stats subtracts.
+ */
+void fs_stats_reset()
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_total(stats_baseline);
+    pthread_mutex_unlock(&stats_lock);
+}
@@ -30,37 +30,104 @@
 #define MAX_FILENAME 28
 
 /**
- * @brief Maximum number of files supported by the filesystem
+ * @brief Number of files a filesystem from fs_format can hold
  * 
- * The filesystem can hold up to 256 files simultaneously. This value
- * determines the size of the inode table.
+ * fs_format creates an inode table of 256 inodes, so up to 256 files can
+ * exist at once. fs_format_geometry takes the inode count as a parameter;
+ * a mounted image's own count is in its superblock.
  */
 #define MAX_FILES 256
 
 /**
- * @brief Total number of blocks in the filesystem
+ * @brief Total number of blocks in a filesystem from fs_format
  * 
- * The filesystem contains 2560 blocks in total. With a block size of 4KB,
- * this gives a total virtual disk size of 10MB (2560 * 4096 = 10,485,760 bytes).
+ * fs_format creates 2560 blocks in total. With a block size of 4KB, this
+ * gives a total virtual disk size of 10MB (2560 * 4096 = 10,485,760 bytes).
+ * Images from fs_format_geometry can be much larger.
  */
 #define MAX_BLOCKS 2560
 
 /**
- * @brief Size of each block in bytes
+ * @brief Size of each block in bytes in a filesystem from fs_format
  * 
  * Each block is 4KB (4096 bytes) in size. This value affects file I/O operations
- * and determines the granularity of storage allocation.
+ * and determines the granularity of storage allocation. fs_format_geometry
+ * accepts any power of two from 1KB to 64KB.
  */
 #define BLOCK_SIZE 4096
 
 /**
  * @brief Maximum number of direct block pointers per file
  * 
- * Each file can reference up to 12 direct blocks, which means the maximum
- * file size is 12 * 4KB = 48KB. This filesystem does not support indirect blocks.
+ * Each inode references its first 12 blocks (48KB) directly. Larger files
+ * continue through the single and double indirect blocks (see BLOCK_POINTERS).
  */
 #define MAX_DIRECT_BLOCKS 12
 
+/**
+ * @brief Number of block indices held by one indirect block of BLOCK_SIZE
+ * 
+ * The single indirect block adds 1024 blocks (4MB) to a file and the double
+ * indirect block 1024 * 1024 more, so in practice a single file is limited
+ * only by the free space in the data region. With other block sizes an
+ * indirect block holds block_size / 4 indices, and a file is also limited
+ * to sizes that fit an int.
+ */
+#define BLOCK_POINTERS (BLOCK_SIZE / (int)sizeof(int))
+
+/**
+ * @brief Data blocks fs_format reserves for the metadata journal
+ * 
+ * The journal follows the inode table (blocks 10-21). It holds the two
+ * most recent metadata transactions written by fs_sync, which fs_mount
+ * replays after a crash. fs_format_geometry sizes the journal to the
+ * metadata of the geometry instead.
+ */
+#define JOURNAL_BLOCKS 12
+
+/**
+ * @brief Mount modes accepted by fs_mount_mode
+ * 
+ * FS_MOUNT_PREAD (the default used by fs_mount) keeps the metadata in memory
+ * and performs data I/O with preadv/pwritev. FS_MOUNT_MMAP maps the whole
+ * disk image and accesses metadata and data blocks in place, which suits
+ * images kept on tmpfs.
+ * 
+ * When fs.c is compiled with -DFS_IO_URING, FS_MOUNT_PREAD does its I/O
+ * through io_uring instead: the runs of blocks behind one cache pass or one
+ * sync are submitted as a single batch, keeping many requests in flight.
+ * If the kernel does not offer io_uring the mount uses preadv/pwritev.
+ */
+#define FS_MOUNT_PREAD 0
+#define FS_MOUNT_MMAP 1
+
+/**
+ * @brief Write-behind flag, OR'd into FS_MOUNT_PREAD
+ * 
+ * fs_write and the other writes then return once the data is in the block
+ * cache, and a background thread writes dirty blocks back in block order,
+ * merging adjacent ones into large pwritev calls. fs_sync and fs_unmount
+ * wait for it and remain the durability points. Ignored with FS_MOUNT_MMAP.
+ */
+#define FS_MOUNT_WRITE_BEHIND 2
+
+/**
+ * @brief Deduplication flag, OR'd into either mount mode
+ * 
+ * fs_write and fs_create_many then hash every full block they write and
+ * look the hash up in an index of the blocks written since the mount. A
+ * block whose content is already stored is not written: the file shares
+ * the stored block, which gains a reference. A write to a shared block
+ * moves the file to a new block, and deleting a file only frees the blocks
+ * no other file shares. Blocks in the index are never overwritten in place,
+ * so rewriting part of them costs a new block each.
+ * 
+ * The image records that it may contain shared blocks, and every later
+ * mount, with or without this flag, counts each block's owners from the
+ * inodes. Images that never had it mounted are unaffected.
+ */
+#define FS_MOUNT_DEDUP 4
+
 /**
  * @brief Superblock structure containing filesystem metadata
  * 
@@ -69,11 +136,22 @@
  * the first block of the filesystem (block 0).
  */
 typedef struct {
-    int total_blocks;  /**< Total number of blocks in the filesystem (2560) */
-    int block_size;    /**< Size of each block in bytes (4096) */
+    int total_blocks;  /**< Total number of blocks in the filesystem (2560 from fs_format) */
+    int block_size;    /**< Size of each block in bytes (4096 from fs_format) */
     int free_blocks;   /**< Number of blocks currently available for allocation */
-    int total_inodes;  /**< Total number of inodes/files the filesystem can hold (256) */
+    int total_inodes;  /**< Total number of inodes/files the filesystem can hold (256 from fs_format) */
     int free_inodes;   /**< Number of inodes currently available for allocation */
+    int journal_start; /**< First block of the metadata journal (0 on images without one) */
+    int journal_blocks; /**< Blocks in the metadata journal (JOURNAL_BLOCKS from fs_format), or 0 */
+    int clean;         /**< 1 after a clean unmount, 0 while mounted or after a crash */
+    unsigned int checksum; /**< CRC-32 of the superblock (this field as 0), bitmap and inode table, set with clean */
+    unsigned int journal_sequence; /**< First journal transaction not yet covered by a clean unmount */
+    int bitmap_start;  /**< First block of the block bitmap (1) */
+    int bitmap_blocks; /**< Blocks in the block bitmap; 0 on images with the original fixed layout */
+    int inode_table_start;  /**< First block of the inode table */
+    int inode_table_blocks; /**< Blocks in the inode table */
+    int data_start;    /**< First block of the data region, where the journal starts (10 or more) */
+    int shared_blocks; /**< 1 once the image was mounted with FS_MOUNT_DEDUP, so files may share data blocks */
 } superblock;
 
 /**
@@ -81,15 +159,185 @@ typedef struct {
  * 
  * Each file in the filesystem is represented by an inode, which stores
  * metadata about the file and pointers to its data blocks. The inode table
- * starts at block 2 and occupies 8 blocks (blocks 2-9).
+ * starts at block 2 in images from fs_format and ends before block 10; the
+ * superblock of any image records where it is.
+ * 
+ * A file of 1 to INLINE_DATA_MAX bytes is stored inline: used is
+ * INODE_INLINE and the content fills the block pointer fields instead, so
+ * the file owns no data block at all.
+ * 
+ * A file written with compression on (see fs_set_compression) may be
+ * stored compressed: used is INODE_COMPRESSED, size is still the length
+ * of the content, and indirect holds the length of the compressed data
+ * in the direct blocks.
  */
 typedef struct {
-    int used;                          /**< Flag indicating if this inode is in use (1) or free (0) */
+    int used;                          /**< Flag indicating if this inode is in use (1, INODE_INLINE or INODE_COMPRESSED, plus INODE_COMPRESS) or free (0) */
     char name[MAX_FILENAME];           /**< Name of the file (up to 28 characters + null terminator) */
     int size;                          /**< Size of the file in bytes */
     int blocks[MAX_DIRECT_BLOCKS];     /**< Array of block indices containing file data */
+    int indirect;                      /**< Block holding the indices of blocks 12-1035, or -1 */
+    int double_indirect;               /**< Block holding the indices of further indirect blocks, or -1 */
 } inode;
 
+/**
+ * @brief Value of inode.used for a file whose content is stored in the inode
+ */
+#define INODE_INLINE 2
+
+/**
+ * @brief Value of inode.used for a file whose content is stored compressed
+ */
+#define INODE_COMPRESSED 3
+
+/**
+ * @brief Flag in inode.used of a file with compression on
+ */
+#define INODE_COMPRESS 0x100
+
+/**
+ * @brief Largest file stored inline: the space of the block pointers (56 bytes)
+ */
+#define INLINE_DATA_MAX ((int)((MAX_DIRECT_BLOCKS + 2) * sizeof(int)))
+
+/**
+ * @brief A contiguous piece of file data returned by fs_read_zc
+ */
+typedef struct {
+    const void* data;  /**< Start of the data inside the mapped disk image */
+    int len;           /**< Number of bytes available at data */
+} fs_extent;
+
+/**
+ * @brief One file returned by fs_list_entries
+ */
+typedef struct {
+    char name[MAX_FILENAME + 1]; /**< Name of the file, null-terminated */
+    int size;                    /**< Size of the file in bytes, or -1 without FS_LIST_SIZES */
+} fs_dirent;
+
+/**
+ * @brief Resume point of a paged listing, see fs_list_entries
+ * 
+ * Set it to FS_LIST_CURSOR_INIT (or zero it) before the first call and pass
+ * the same cursor to every following call of the listing. The fields are
+ * internal to the filesystem.
+ */
+typedef struct {
+    int next;                     /**< Next inode slot of an unsorted listing, -1 once the listing is complete */
+    char after[MAX_FILENAME + 1]; /**< Last name returned by a sorted listing */
+} fs_list_cursor;
+
+#define FS_LIST_CURSOR_INIT { 0, "" }
+
+/**
+ * @brief fs_list_entries flag: return the files in name order (strcmp)
+ */
+#define FS_LIST_SORTED 1
+
+/**
+ * @brief fs_list_entries flag: fill in fs_dirent.size
+ */
+#define FS_LIST_SIZES 2
+
+/**
+ * @brief A file's metadata returned by fs_stat
+ * 
+ * The data blocks are contiguous when extents is 1 or less.
+ */
+typedef struct {
+    int size;           /**< Size of the file in bytes */
+    int blocks;         /**< Data blocks holding the content, compressed or not (0 for inline and empty files) */
+    int extents;        /**< Runs of consecutive data blocks (0 for inline and empty files) */
+    int is_inline;      /**< 1 if the content is stored in the inode, 0 otherwise */
+    int is_compressed;  /**< 1 if the content is stored compressed, 0 otherwise */
+} fs_stat_info;
+
+/**
+ * @brief Number of snapshots a mounted filesystem can hold at once
+ */
+#define FS_MAX_SNAPSHOTS 16
+
+/**
+ * @brief Operation indices for the calls and nanos arrays of fs_counters
+ */
+#define FS_OP_FORMAT 0
+#define FS_OP_MOUNT 1
+#define FS_OP_UNMOUNT 2
+#define FS_OP_SYNC 3
+#define FS_OP_CREATE 4
+#define FS_OP_DELETE 5
+#define FS_OP_LIST 6
+#define FS_OP_WRITE 7
+#define FS_OP_READ 8
+#define FS_OP_READ_ZC 9
+#define FS_OP_PREAD 10
+#define FS_OP_PWRITE 11
+#define FS_OP_APPEND 12
+#define FS_OP_OPEN 13
+#define FS_OP_CLOSE 14
+#define FS_OP_HREAD 15
+#define FS_OP_HWRITE 16
+#define FS_OP_HSEEK 17
+#define FS_OP_CREATE_MANY 18
+#define FS_OP_DELETE_MANY 19
+#define FS_OP_CHECK 20
+#define FS_OP_LIST_ENTRIES 21
+#define FS_OP_STAT 22
+#define FS_OP_SNAPSHOT 23
+#define FS_OP_SNAPSHOT_RELEASE 24
+#define FS_OP_SNAPSHOT_LIST 25
+#define FS_OP_SNAPSHOT_PREAD 26
+#define FS_OP_SET_COMPRESSION 27
+#define FS_OP_COUNT 28
+
+/**
+ * @brief Activity counters returned by fs_stats
+ * 
+ * Every count is cumulative since the program started or since the last
+ * fs_stats_reset, summed over all threads.
+ */
+typedef struct {
+    unsigned long long calls[FS_OP_COUNT];   /**< Calls of each fs_* entry point */
+    unsigned long long nanos[FS_OP_COUNT];   /**< Wall-clock time spent in each entry point */
+    unsigned long long bytes_read;           /**< File bytes returned by fs_read, fs_pread and fs_hread */
+    unsigned long long bytes_written;        /**< File bytes accepted by fs_write, fs_pwrite, fs_append, fs_hwrite and fs_create_many */
+    unsigned long long read_syscalls;        /**< preadv calls on the disk image */
+    unsigned long long write_syscalls;       /**< pwritev calls on the disk image */
+    unsigned long long sync_syscalls;        /**< fdatasync calls on the disk image */
+    unsigned long long cache_hits;           /**< Blocks read from the block cache */
+    unsigned long long cache_misses;         /**< Blocks read from the disk image */
+    unsigned long long cache_writebacks;     /**< Dirty blocks written back on eviction */
+    unsigned long long cache_bypasses;       /**< Blocks transferred directly because every buffer was pinned */
+    unsigned long long flusher_writebacks;   /**< Dirty blocks written back by the write-behind flusher */
+    unsigned long long uring_submits;        /**< io_uring_enter calls (FS_IO_URING builds only) */
+    unsigned long long uring_requests;       /**< Read and write requests queued on io_uring */
+    unsigned long long journal_commits;      /**< Metadata transactions written to the journal */
+    unsigned long long journal_replays;      /**< Transactions replayed by fs_mount */
+    unsigned long long clean_mounts;         /**< Mounts that skipped validation after a clean unmount */
+    unsigned long long alloc_calls;          /**< Block allocations (alloc_blocks calls, one per reservation) */
+    unsigned long long alloc_scan_words;     /**< 64-bit bitmap words examined by those allocations */
+    unsigned long long cow_blocks;           /**< Blocks a write moved to a new location because a snapshot or another file holds them */
+    unsigned long long dedup_blocks;         /**< Full blocks FS_MOUNT_DEDUP found already stored and shared instead of writing */
+    unsigned long long compressed_blocks;    /**< Blocks writes saved by storing content compressed */
+    unsigned long long readahead_blocks;     /**< Blocks read into the block cache ahead of sequential readers */
+    unsigned long long readahead_hits;       /**< Reads served from blocks read ahead and not read before */
+} fs_counters;
+
+/**
+ * @brief A mounted filesystem image
+ * 
+ * Returned by fsc_mount and passed to the fsc_* calls, which behave like
+ * the fs_* calls of the same name on that context's image. Any number of
+ * images can be mounted at once, each in its own context, and calls on
+ * different contexts can run in parallel from different threads without
+ * contending on any lock. The fs_* calls are thin wrappers that work on a
+ * built-in default context. File handles from fsc_open belong to the
+ * context that returned them. An image can be mounted in only one context
+ * at a time.
+ */
+typedef struct fs_context fs_context;
+
 /**
  * @brief Creates and formats a new filesystem
  * 
@@ -99,35 +347,100 @@ typedef struct {
  * Disk layout:
  * - Block 0: Superblock (4KB)
  * - Block 1: Block bitmap (4KB)
- * - Blocks 2-9: Inode table (32KB = 256 inodes × 128B)
- * - Blocks 10-2559: Data blocks (~9.96MB)
+ * - Blocks 2-9: Inode table (256 inodes × 92B, padded to 32KB)
+ * - Blocks 10-21: Metadata journal (JOURNAL_BLOCKS)
+ * - Blocks 22-2559: Data blocks (~9.9MB)
  * 
  * @param disk_path Path where the disk image file will be created
  * @return 0 on success, -1 on error (e.g., cannot create file)
  */
 int fs_format(const char* disk_path);
 
+/**
+ * @brief Creates and formats a new filesystem with a chosen geometry
+ * 
+ * Like fs_format, but with the number of blocks, the number of inodes and
+ * the block size given by the caller, so images can reach many GB and hold
+ * tens of thousands of files. The superblock records the geometry, and
+ * fs_mount reads it back from there.
+ * 
+ * Disk layout:
+ * - Block 0: Superblock
+ * - Blocks 1 onwards: Block bitmap (total_blocks / 8 bytes)
+ * - Next: Inode table (total_inodes × 92B)
+ * - Next, from block 10 at the earliest: Metadata journal, sized to hold
+ *   all of the above twice, then the data blocks
+ * 
+ * fs_format(path) is fs_format_geometry(path, MAX_BLOCKS, MAX_FILES, BLOCK_SIZE).
+ * 
+ * @param disk_path Path where the disk image file will be created
+ * @param total_blocks Blocks in the image, a multiple of 64 from 64 to 2^24
+ * @param total_inodes Files the image can hold, a multiple of 64 from 64 to 2^18
+ * @param block_size Bytes per block, a power of two from 1024 to 65536
+ * @return 0 on success, -1 on error (e.g., invalid geometry, too few blocks for the metadata, or cannot create file)
+ */
+int fs_format_geometry(const char* disk_path, int total_blocks, int total_inodes, int block_size);
+
 /**
  * @brief Mounts an existing filesystem
  * 
  * Opens the disk image file and reads the filesystem metadata into memory,
  * preparing it for use. This function should verify that the disk image
- * contains a valid filesystem structure.
+ * contains a valid filesystem structure. If the last fs_sync before a crash
+ * committed its metadata to the journal but had not finished writing it in
+ * place, the journal is replayed first.
+ * 
+ * After a clean fs_unmount only the superblock checksum is verified; the
+ * inode and bitmap checks run only when the image was not cleanly
+ * unmounted. fs_check performs the full consistency scan on demand.
  * 
  * @param disk_path Path to the disk image file to mount
  * @return 0 on success, -1 on error (e.g., file not found or invalid filesystem)
  */
 int fs_mount(const char* disk_path);
 
+/**
+ * @brief Mounts an existing filesystem with a chosen I/O backend
+ * 
+ * Same as fs_mount, but selects how the disk image is accessed. With
+ * FS_MOUNT_MMAP the whole image is mapped into memory and fs_read_zc
+ * becomes available.
+ * 
+ * @param disk_path Path to the disk image file to mount
+ * @param mode FS_MOUNT_PREAD or FS_MOUNT_MMAP, optionally with FS_MOUNT_WRITE_BEHIND and FS_MOUNT_DEDUP
+ * @return 0 on success, -1 on error (e.g., file not found or invalid filesystem)
+ */
+int fs_mount_mode(const char* disk_path, int mode);
+
 /**
  * @brief Unmounts the filesystem
  * 
  * Ensures all pending changes are written to the disk image file and
- * closes the file. After unmounting, no further filesystem operations
- * should be performed until the filesystem is mounted again.
+ * closes the file. Calls already in flight on other threads finish first;
+ * calls made afterwards fail until the filesystem is mounted again.
  */
 void fs_unmount();
 
+/**
+ * @brief Writes all cached changes back to the disk image
+ * 
+ * Data written by fs_write is held in a write-back block cache, and the
+ * superblock, block bitmap and inode table are kept in memory while the
+ * filesystem is mounted. This writes every dirty block and then the changed
+ * metadata back to the disk image and flushes it to stable storage.
+ * With FS_MOUNT_WRITE_BEHIND it first waits for the flusher's writes in
+ * flight. fs_unmount writes the same changes back implicitly.
+ * 
+ * The metadata changes of every operation since the last sync are written
+ * to the journal as one transaction, so a single fdatasync makes them
+ * durable and a crash leaves either all or none of them. Threads calling
+ * fs_sync at the same time share commits: each waits for at most the
+ * commit in progress and the one after it.
+ * 
+ * @return 0 on success, -1 on error (e.g., not mounted or write failed)
+ */
+int fs_sync();
+
 /**
  * @brief Creates a new empty file
  * 
@@ -150,6 +463,123 @@ int fs_create(const char* filename);
  */
 int fs_delete(const char* filename);
 
+/**
+ * @brief Creates many files, optionally with content, in one call
+ * 
+ * Equivalent to calling fs_create and then fs_write for each entry, but all
+ * names are resolved in one pass over the inode table, the blocks for all
+ * payloads are reserved together, and the changed metadata is written back
+ * together. An entry whose content cannot be stored is not created.
+ * 
+ * @param filenames Names of the files to create
+ * @param data Content of each file, or NULL to create empty files
+ * @param sizes Size of each content in bytes, or NULL to create empty files
+ * @param count Number of entries
+ * @param results Receives each entry's result: 0 on success, -1 if the file already exists, -2 if no free inode or out of space, -3 for other errors
+ * @return Number of files created, or -3 if the batch itself is invalid or the filesystem is not mounted
+ */
+int fs_create_many(const char* const filenames[], const void* const data[], const int sizes[], int count, int results[]);
+
+/**
+ * @brief Deletes many files in one call
+ * 
+ * Equivalent to calling fs_delete for each entry, with all names resolved
+ * in one pass.
+ * 
+ * @param filenames Names of the files to delete
+ * @param count Number of entries
+ * @param results Receives each entry's result: 0 on success, -1 if file not found, -3 for an invalid filename
+ * @return Number of files deleted, or -3 if the batch itself is invalid or the filesystem is not mounted
+ */
+int fs_delete_many(const char* const filenames[], int count, int results[]);
+
+/**
+ * @brief Checks the consistency of the mounted filesystem
+ * 
+ * Walks every file's block list and compares it with the block bitmap:
+ * blocks owned by two files or by none while marked used, blocks owned
+ * while marked free, invalid block pointers, bad sizes or names, and free
+ * totals that disagree with the bitmap each count as one problem. On an
+ * image mounted with FS_MOUNT_DEDUP, a data block may be shared as long as
+ * its owners agree with its reference count. Writes
+ * wait while it runs but reads do not, so it can run in a background thread.
+ * 
+ * @return Number of problems found (0 if consistent), -1 if not mounted or out of memory
+ */
+int fs_check();
+
+/**
+ * @brief Takes a copy-on-write snapshot of the mounted filesystem
+ * 
+ * Freezes the current inode table and block bitmap. Every block in use
+ * gains a reference from the snapshot, and from then on a write to such a
+ * block puts the new data in a newly allocated block instead, so the
+ * snapshot goes on seeing the old content while writers carry on. Taking
+ * a snapshot costs a copy of the metadata and waits only for the writes
+ * already in flight.
+ * 
+ * Snapshots live in memory until fs_snapshot_release or fs_unmount and are
+ * not stored in the image. Blocks that only snapshots still hold are free
+ * in the on-disk bitmap, so a crash loses the snapshots and nothing else.
+ * 
+ * @return Snapshot id (0 to FS_MAX_SNAPSHOTS - 1), -1 if not mounted, -2 if FS_MAX_SNAPSHOTS snapshots exist, -3 if out of memory
+ */
+int fs_snapshot();
+
+/**
+ * @brief Releases a snapshot taken by fs_snapshot
+ * 
+ * Blocks that no longer belong to any file or snapshot become free.
+ * 
+ * @param snap Snapshot id returned by fs_snapshot
+ * @return 0 on success, -1 if there is no such snapshot
+ */
+int fs_snapshot_release(int snap);
+
+/**
+ * @brief Lists the files of a snapshot a page at a time
+ * 
+ * Works like fs_list_entries without FS_LIST_SORTED, with every size
+ * filled in, on the files as they were when the snapshot was taken.
+ * 
+ * @param snap Snapshot id returned by fs_snapshot
+ * @param cursor Resume point, FS_LIST_CURSOR_INIT for a new listing
+ * @param prefix Name prefix to match, or NULL
+ * @param entries Pre-allocated array to receive the files
+ * @param max_entries Number of entries available
+ * @return Number of files returned (0 once the listing is complete), or -1 if there is no such snapshot or the arguments are invalid
+ */
+int fs_snapshot_list(int snap, fs_list_cursor* cursor, const char* prefix, fs_dirent* entries, int max_entries);
+
+/**
+ * @brief Reads part of a file as it was when a snapshot was taken
+ * 
+ * @param snap Snapshot id returned by fs_snapshot
+ * @param filename Name of the file in the snapshot
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Number of bytes to read
+ * @param offset Position in the file to start reading at
+ * @return Number of bytes read (0 at or past the end of the file), -1 if there is no such snapshot or file, -3 for other errors
+ */
+int fs_snapshot_pread(int snap, const char* filename, void* buffer, int size, int offset);
+
+/**
+ * @brief Turns compression of a file's content on or off
+ * 
+ * With compression on, writes store the content compressed with an LZ4
+ * block codec when that saves at least one block and the compressed data
+ * fits in the MAX_DIRECT_BLOCKS direct blocks; otherwise it is stored as
+ * usual. Reads decompress transparently, and fs_stat reports the blocks
+ * actually used. A compressed file is read and rewritten whole, so only
+ * files of up to 64 blocks are compressed. The setting is kept in the
+ * inode, and the current content is rewritten under the new setting.
+ * 
+ * @param filename Name of the file
+ * @param enabled 1 to compress the file's content, 0 to store it as is
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
+ */
+int fs_set_compression(const char* filename, int enabled);
+
 /**
  * @brief Lists the files in the filesystem
  * 
@@ -162,12 +592,34 @@ int fs_delete(const char* filename);
  */
 int fs_list(char filenames[][MAX_FILENAME], int max_files);
 
+/**
+ * @brief Lists files a page at a time, optionally sorted and filtered by prefix
+ * 
+ * Each call returns the next files of the listing that cursor describes,
+ * and advances the cursor past them. Only names starting with prefix are
+ * returned; NULL or "" matches every file. With FS_LIST_SORTED the files
+ * come in name order, otherwise in inode order, which is cheaper. Use the
+ * same prefix and flags for every call of one listing.
+ * 
+ * A file that exists for the whole listing is returned exactly once. Files
+ * created or deleted between two calls may or may not be returned.
+ * 
+ * @param cursor Resume point, FS_LIST_CURSOR_INIT for a new listing
+ * @param prefix Name prefix to match, or NULL
+ * @param flags FS_LIST_SORTED and FS_LIST_SIZES, or 0
+ * @param entries Pre-allocated array to receive the files
+ * @param max_entries Number of entries available
+ * @return Number of files returned (0 once the listing is complete), or -1 on error
+ */
+int fs_list_entries(fs_list_cursor* cursor, const char* prefix, int flags, fs_dirent* entries, int max_entries);
+
 /**
  * @brief Writes data to a file
  * 
  * Writes the specified data to a file, overwriting any existing content.
  * The function allocates or frees blocks as necessary to accommodate the
- * new file size.
+ * new file size. Content of at most INLINE_DATA_MAX bytes is kept in the
+ * inode itself and needs no data block.
  * 
  * @param filename Name of the file to write to
  * @param data Pointer to the data to write
@@ -189,4 +641,209 @@ int fs_write(const char* filename, const void* data, int size);
  */
 int fs_read(const char* filename, void* buffer, int size);
 
+/**
+ * @brief Returns a file's size and block layout without reading its data
+ * 
+ * Answered from the in-memory inode table. The extent count of a file
+ * with indirect blocks is kept up to date by every write; only the first
+ * fs_stat after mounting reads the file's indirect blocks to learn it.
+ * 
+ * @param filename Name of the file
+ * @param info Structure to receive the metadata
+ * @return 0 on success, -1 if file not found, -3 for other errors
+ */
+int fs_stat(const char* filename, fs_stat_info* info);
+
+/**
+ * @brief Reads part of a file
+ * 
+ * Reads up to 'size' bytes starting at byte 'offset' of the file. Only the
+ * blocks overlapping that range are read.
+ * 
+ * @param filename Name of the file to read from
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Number of bytes to read
+ * @param offset Position in the file to start reading at
+ * @return Number of bytes read (0 at or past the end of the file), -1 if file not found, -3 for other errors
+ */
+int fs_pread(const char* filename, void* buffer, int size, int offset);
+
+/**
+ * @brief Writes part of a file
+ * 
+ * Overwrites 'size' bytes starting at byte 'offset', leaving the rest of
+ * the file untouched. Writing past the end grows the file, allocating only
+ * the new blocks; a gap between the old end and 'offset' reads back as zeros.
+ * 
+ * @param filename Name of the file to write to
+ * @param data Pointer to the data to write
+ * @param size Number of bytes to write
+ * @param offset Position in the file to start writing at
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
+ */
+int fs_pwrite(const char* filename, const void* data, int size, int offset);
+
+/**
+ * @brief Appends data to the end of a file
+ * 
+ * Equivalent to fs_pwrite at the current file size, performed atomically
+ * with respect to other writers of the same file.
+ * 
+ * @param filename Name of the file to append to
+ * @param data Pointer to the data to append
+ * @param size Number of bytes to append
+ * @return 0 on success, -1 if file not found, -2 if out of space, -3 for other errors
+ */
+int fs_append(const char* filename, const void* data, int size);
+
+/**
+ * @brief Opens a file and returns a handle to it
+ * 
+ * The handle is bound to the file's inode, so handle operations skip the
+ * filename lookup, and it carries a position for sequential access that
+ * starts at 0. Up to 64 handles can be open at once. Handles do not survive
+ * fs_unmount: operations on them then return -3, but they must still be
+ * passed to fs_close.
+ * 
+ * @param filename Name of the file to open
+ * @return A handle (0 or greater) on success, -1 if file not found, -2 if too many open handles, -3 for other errors
+ */
+int fs_open(const char* filename);
+
+/**
+ * @brief Closes a handle returned by fs_open
+ * 
+ * @param fd Handle to close
+ * @return 0 on success, -3 if fd is not an open handle
+ */
+int fs_close(int fd);
+
+/**
+ * @brief Reads from an open file at the handle's position
+ * 
+ * Reads up to 'size' bytes and advances the position past them.
+ * 
+ * @param fd Handle returned by fs_open
+ * @param buffer Pre-allocated buffer to receive the data
+ * @param size Number of bytes to read
+ * @return Number of bytes read (0 at the end of the file), -1 if the file was deleted, -3 for other errors
+ */
+int fs_hread(int fd, void* buffer, int size);
+
+/**
+ * @brief Writes to an open file at the handle's position
+ * 
+ * Behaves like fs_pwrite at the handle's position, then advances the
+ * position past the written bytes.
+ * 
+ * @param fd Handle returned by fs_open
+ * @param data Pointer to the data to write
+ * @param size Number of bytes to write
+ * @return 0 on success, -1 if the file was deleted, -2 if out of space, -3 for other errors
+ */
+int fs_hwrite(int fd, const void* data, int size);
+
+/**
+ * @brief Moves the position of an open handle
+ * 
+ * @param fd Handle returned by fs_open
+ * @param offset New position, relative to 'whence'
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return The new position on success, -1 if the file was deleted, -3 for other errors
+ */
+int fs_hseek(int fd, int offset, int whence);
+
+/**
+ * @brief Returns a file's data in place, without copying it
+ * 
+ * Only available when mounted with FS_MOUNT_MMAP. Fills 'extents' with
+ * pointers into the mapped image that together hold the file's content in
+ * order. The pointers stay valid until the file is written or deleted, or
+ * the filesystem is unmounted. A file stored compressed has no such
+ * content in the image.
+ * 
+ * @param filename Name of the file to read
+ * @param extents Pre-allocated array to receive the extents
+ * @param max_extents Capacity of 'extents' (one per block of the file is always enough)
+ * @return Number of extents on success, -1 if file not found, -3 for other errors (including a compressed file)
+ */
+int fs_read_zc(const char* filename, fs_extent* extents, int max_extents);
+
+/**
+ * @brief Mounts an existing filesystem in a new context
+ * 
+ * Same as fs_mount_mode, but the image gets a context of its own instead of
+ * the default one used by the fs_* calls.
+ * 
+ * @param disk_path Path to the disk image file to mount
+ * @param mode FS_MOUNT_PREAD or FS_MOUNT_MMAP, optionally with FS_MOUNT_WRITE_BEHIND and FS_MOUNT_DEDUP
+ * @return The new context, or NULL on error (e.g., invalid filesystem or the image is already mounted)
+ */
+fs_context* fsc_mount(const char* disk_path, int mode);
+
+/**
+ * @brief Unmounts the filesystem of a context and frees the context
+ * 
+ * Same as fs_unmount, but the context itself is freed as well, so no other
+ * thread may be calling into it, or call into it later: unlike fs_unmount,
+ * this does not wait for calls in flight. NULL is ignored.
+ * 
+ * @param fs Context returned by fsc_mount
+ */
+void fsc_unmount(fs_context* fs);
+
+/**
+ * @name Operations on a context
+ * 
+ * Each takes a context returned by fsc_mount, followed by the arguments and
+ * return values of the fs_* call of the same name.
+ * @{
+ */
+int fsc_sync(fs_context* fs);
+int fsc_create(fs_context* fs, const char* filename);
+int fsc_delete(fs_context* fs, const char* filename);
+int fsc_create_many(fs_context* fs, const char* const filenames[], const void* const data[], const int sizes[], int count, int results[]);
+int fsc_delete_many(fs_context* fs, const char* const filenames[], int count, int results[]);
+int fsc_check(fs_context* fs);
+int fsc_snapshot(fs_context* fs);
+int fsc_snapshot_release(fs_context* fs, int snap);
+int fsc_snapshot_list(fs_context* fs, int snap, fs_list_cursor* cursor, const char* prefix, fs_dirent* entries, int max_entries);
+int fsc_snapshot_pread(fs_context* fs, int snap, const char* filename, void* buffer, int size, int offset);
+int fsc_set_compression(fs_context* fs, const char* filename, int enabled);
+int fsc_list(fs_context* fs, char filenames[][MAX_FILENAME], int max_files);
+int fsc_list_entries(fs_context* fs, fs_list_cursor* cursor, const char* prefix, int flags, fs_dirent* entries, int max_entries);
+int fsc_write(fs_context* fs, const char* filename, const void* data, int size);
+int fsc_read(fs_context* fs, const char* filename, void* buffer, int size);
+int fsc_stat(fs_context* fs, const char* filename, fs_stat_info* info);
+int fsc_pread(fs_context* fs, const char* filename, void* buffer, int size, int offset);
+int fsc_pwrite(fs_context* fs, const char* filename, const void* data, int size, int offset);
+int fsc_append(fs_context* fs, const char* filename, const void* data, int size);
+int fsc_open(fs_context* fs, const char* filename);
+int fsc_close(fs_context* fs, int fd);
+int fsc_hread(fs_context* fs, int fd, void* buffer, int size);
+int fsc_hwrite(fs_context* fs, int fd, const void* data, int size);
+int fsc_hseek(fs_context* fs, int fd, int offset, int whence);
+int fsc_read_zc(fs_context* fs, const char* filename, fs_extent* extents, int max_extents);
+/** @} */
+
+/**
+ * @brief Reads the filesystem's activity counters
+ * 
+ * Each thread counts into its own private block, so the fs_* calls never
+ * contend on the counters; this call adds up the blocks of all threads,
+ * including threads that have exited. The counters cover every context.
+ * It works whether or not a filesystem is mounted.
+ * 
+ * @param out Structure to receive the counters
+ * @return 0 on success, -1 if out is NULL
+ */
+int fs_stats(fs_counters* out);
+
+/**
+ * @brief Restarts all activity counters from zero
+ * 
+ * Later fs_stats calls report only the activity after the reset.
+ */
+void fs_stats_reset();
+
 #endif /* FS_H */
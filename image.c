@@ -0,0 +1,504 @@
+/**
+ * @file image.c
+ * @brief Bulk import and export between a host directory and a disk image
+ *
+ * import formats a fresh disk image and copies every regular file of a host
+ * directory into it. Several threads read the host files while the main
+ * thread stores them with fs_create_many, in batches of up to BATCH_FILES
+ * files or BATCH_BYTES bytes. Each batch reserves the blocks of all its
+ * files at once, so the files are laid out back to back, and the image is
+ * mounted with FS_MOUNT_WRITE_BEHIND, so the data reaches the image in
+ * large pwritev calls in block order. Reading runs at most WINDOW batches
+ * ahead of writing, which bounds the memory in use.
+ *
+ * export mounts an image with FS_MOUNT_MMAP and writes every file into a
+ * host directory, several files at a time, straight from the mapped image
+ * with fs_read_zc. Compressed files have no plain content in the image to
+ * point at, so they are copied with fs_pread instead.
+ *
+ * Both report the number of files and bytes copied and the rate in MB/s.
+ *
+ * Usage: ./fs_image import <dir> <disk_path> [-t threads] [-b blocks] [-i inodes] [-s block_size]
+ *        ./fs_image export <disk_path> <dir> [-t threads]
+ *   -t  number of host I/O threads, default the number of online CPUs (at most 16)
+ *   -b, -i, -s  geometry for fs_format_geometry; fs_format's defaults otherwise.
+ *               Blocks and inodes must be multiples of 64, the block size a
+ *               power of two from 1024 to 65536
+ */
+
+#include "fs.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 16
+#define BATCH_FILES 1024
+#define BATCH_BYTES (16 << 20)
+#define WINDOW 2 // batches read ahead of the one being written
+#define PREAD_CHUNK (64 << 10) // bytes per fs_pread when exporting a compressed file
+
+/**
+ * @brief One file being copied
+ */
+typedef struct {
+    char name[MAX_FILENAME + 1]; /**< Name inside the image */
+    int size;                /**< Size in bytes */
+    int batch;               /**< Import batch the file belongs to */
+    char* data;              /**< Content read from the host (import only) */
+    int failed;              /**< Set when the host file could not be read or written */
+} entry;
+
+static entry* entries = NULL;
+static int entry_count = 0;
+static const char* host_dir = NULL;
+
+// Work sharing between the I/O threads and the main thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER; // a file was read or a batch was written
+static int next_entry = 0;
+static int batches_written = 0;
+static int* batch_ready = NULL; // files of each batch read so far
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* what, int files, long long bytes, double seconds)
+{
+    double mb = bytes / (1024.0 * 1024.0);
+    printf("%s %d files, %.1f MB in %.3f s (%.1f MB/s)\n", what, files, mb, seconds,
+           seconds > 0 ? mb / seconds : 0);
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const entry*)a)->name, ((const entry*)b)->name);
+}
+
+// Hand out the next file to an I/O thread, or -1 when none are left
+static int take_entry()
+{
+    pthread_mutex_lock(&lock);
+    int i = next_entry < entry_count ? next_entry++ : -1;
+    pthread_mutex_unlock(&lock);
+    return i;
+}
+
+/**
+ * @brief Collects the regular files of host_dir, sorted by name
+ *
+ * @return Number of files skipped because of their name or size, or -1 on error
+ */
+static int scan_directory()
+{
+    DIR* dir = opendir(host_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", host_dir, strerror(errno));
+        return -1;
+    }
+    int capacity = 0, skipped = 0;
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(dir), d->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (strlen(d->d_name) > MAX_FILENAME || st.st_size > 0x7fffffff) {
+            fprintf(stderr, "Skipping %s: name longer than %d characters or file too large\n",
+                    d->d_name, MAX_FILENAME);
+            skipped++;
+            continue;
+        }
+        if (entry_count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            entry* grown = realloc(entries, capacity * sizeof(entry));
+            if (grown == NULL) {
+                closedir(dir);
+                return -1;
+            }
+            entries = grown;
+        }
+        entry* e = &entries[entry_count++];
+        memset(e, 0, sizeof(*e));
+        strcpy(e->name, d->d_name);
+        e->size = (int)st.st_size;
+    }
+    closedir(dir);
+    qsort(entries, entry_count, sizeof(entry), compare_entries);
+    return skipped;
+}
+
+// Read a whole host file into e->data
+static int read_host_file(entry* e)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", host_dir, e->name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    e->data = malloc(e->size > 0 ? e->size : 1);
+    int done = 0;
+    while (e->data != NULL && done < e->size) {
+        ssize_t n = read(fd, e->data + done, e->size - done);
+        if (n <= 0) {
+            break; // Error, or the file shrank since the scan
+        }
+        done += n;
+    }
+    close(fd);
+    return e->data != NULL && done == e->size ? 0 : -1;
+}
+
+static void* import_worker(void* arg)
+{
+    (void)arg;
+    int i;
+    while ((i = take_entry()) >= 0) {
+        entry* e = &entries[i];
+
+        // Stay within WINDOW batches of the writer
+        pthread_mutex_lock(&lock);
+        while (e->batch >= batches_written + WINDOW) {
+            pthread_cond_wait(&progress, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        e->failed = read_host_file(e) != 0;
+
+        pthread_mutex_lock(&lock);
+        batch_ready[e->batch]++;
+        pthread_cond_broadcast(&progress);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static int import_directory(const char* disk_path, int threads, int blocks, int inodes, int block_size)
+{
+    int skipped = scan_directory();
+    if (skipped < 0) {
+        return 1;
+    }
+
+    // Split the files into batches
+    int batches = 0;
+    long long batch_bytes = 0, total_bytes = 0;
+    int batch_files = 0;
+    for (int i = 0; i < entry_count; i++) {
+        if (batch_files > 0 && (batch_files == BATCH_FILES || batch_bytes + entries[i].size > BATCH_BYTES)) {
+            batches++;
+            batch_files = 0;
+            batch_bytes = 0;
+        }
+        entries[i].batch = batches;
+        batch_files++;
+        batch_bytes += entries[i].size;
+        total_bytes += entries[i].size;
+    }
+    if (batch_files > 0) {
+        batches++;
+    }
+
+    int result = blocks > 0 || inodes > 0 || block_size > 0
+                     ? fs_format_geometry(disk_path, blocks > 0 ? blocks : MAX_BLOCKS, inodes > 0 ? inodes : MAX_FILES,
+                                          block_size > 0 ? block_size : BLOCK_SIZE)
+                     : fs_format(disk_path);
+    if (result != 0) {
+        fprintf(stderr, "Cannot format %s with that geometry (blocks and inodes must be multiples of 64)\n", disk_path);
+        return 1;
+    }
+    if (fs_mount_mode(disk_path, FS_MOUNT_PREAD | FS_MOUNT_WRITE_BEHIND) != 0) {
+        fprintf(stderr, "Cannot mount %s\n", disk_path);
+        return 1;
+    }
+
+    double start = now_seconds();
+    batch_ready = calloc(batches > 0 ? batches : 1, sizeof(int));
+    const char** names = malloc(BATCH_FILES * sizeof(char*));
+    const void** data = malloc(BATCH_FILES * sizeof(void*));
+    int* sizes = malloc(BATCH_FILES * sizeof(int));
+    int* results = malloc(BATCH_FILES * sizeof(int));
+    if (batch_ready == NULL || names == NULL || data == NULL || sizes == NULL || results == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    pthread_t workers[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, import_worker, NULL);
+    }
+
+    // Store each batch once all its files have been read
+    int imported = 0, failed = 0, first = 0;
+    long long imported_bytes = 0;
+    for (int b = 0; b < batches; b++) {
+        int end = first;
+        while (end < entry_count && entries[end].batch == b) {
+            end++;
+        }
+        pthread_mutex_lock(&lock);
+        while (batch_ready[b] < end - first) {
+            pthread_cond_wait(&progress, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        int count = 0;
+        for (int i = first; i < end; i++) {
+            if (entries[i].failed) {
+                fprintf(stderr, "Cannot read %s/%s\n", host_dir, entries[i].name);
+                failed++;
+                continue;
+            }
+            names[count] = entries[i].name;
+            data[count] = entries[i].data;
+            sizes[count] = entries[i].size;
+            count++;
+        }
+        int created = fs_create_many(names, data, sizes, count, results);
+        if (created < 0) {
+            fprintf(stderr, "fs_create_many failed (code: %d)\n", created);
+            failed += count;
+        } else {
+            for (int i = 0; i < count; i++) {
+                if (results[i] != 0) {
+                    fprintf(stderr, "Cannot store %s (code: %d)%s\n", names[i], results[i],
+                            results[i] == -2 ? ", the image is full; use -b, -i or -s" : "");
+                    failed++;
+                } else {
+                    imported_bytes += sizes[i];
+                }
+            }
+            imported += created;
+        }
+        for (int i = first; i < end; i++) {
+            free(entries[i].data);
+            entries[i].data = NULL;
+        }
+        first = end;
+
+        pthread_mutex_lock(&lock);
+        batches_written = b + 1;
+        pthread_cond_broadcast(&progress);
+        pthread_mutex_unlock(&lock);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    fs_unmount(); // Writes back the remaining data and the metadata
+    report("Imported", imported, imported_bytes, now_seconds() - start);
+    if (skipped + failed > 0) {
+        printf("%d files skipped, %d failed, out of %lld bytes\n", skipped, failed, total_bytes);
+    }
+
+    free(results);
+    free(sizes);
+    free(data);
+    free(names);
+    free(batch_ready);
+    return failed > 0 ? 1 : 0;
+}
+
+// Write len bytes to a host file
+static int write_all(int fd, const char* p, int left)
+{
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return 0;
+}
+
+// Copy a file of the mounted image to a host file through fs_pread
+static int copy_with_pread(const entry* e, int fd)
+{
+    char buffer[PREAD_CHUNK];
+    int offset = 0, n;
+    while ((n = fs_pread(e->name, buffer, sizeof(buffer), offset)) > 0) {
+        if (write_all(fd, buffer, n) != 0) {
+            return -1;
+        }
+        offset += n;
+    }
+    return n == 0 ? 0 : -1;
+}
+
+// Write one file of the mounted image into host_dir
+static int export_file(entry* e, fs_extent** extents, int* capacity)
+{
+    fs_stat_info info;
+    if (fs_stat(e->name, &info) != 0) {
+        return -1;
+    }
+    int needed = info.extents > 0 ? info.extents : 1;
+    if (*capacity < needed) {
+        fs_extent* grown = realloc(*extents, needed * sizeof(fs_extent));
+        if (grown == NULL) {
+            return -1;
+        }
+        *extents = grown;
+        *capacity = needed;
+    }
+    // fs_read_zc refuses a compressed file (-3), also one compressed since fs_stat
+    int count = info.is_compressed ? -3 : fs_read_zc(e->name, *extents, *capacity);
+    if (count < 0 && count != -3) {
+        return -1;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", host_dir, e->name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = 0;
+    if (count == -3) {
+        result = copy_with_pread(e, fd);
+    }
+    for (int k = 0; k < count && result == 0; k++) {
+        result = write_all(fd, (*extents)[k].data, (*extents)[k].len);
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+static void* export_worker(void* arg)
+{
+    (void)arg;
+    fs_extent* extents = NULL;
+    int capacity = 0;
+    int i;
+    while ((i = take_entry()) >= 0) {
+        entries[i].failed = export_file(&entries[i], &extents, &capacity) != 0;
+    }
+    free(extents);
+    return NULL;
+}
+
+static int export_image(const char* disk_path, int threads)
+{
+    if (mkdir(host_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", host_dir, strerror(errno));
+        return 1;
+    }
+    if (fs_mount_mode(disk_path, FS_MOUNT_MMAP) != 0) {
+        fprintf(stderr, "Cannot mount %s\n", disk_path);
+        return 1;
+    }
+
+    double start = now_seconds();
+    fs_list_cursor cursor = FS_LIST_CURSOR_INIT;
+    int capacity = 0, count;
+    fs_dirent page[256];
+    while ((count = fs_list_entries(&cursor, NULL, FS_LIST_SIZES, page, 256)) > 0) {
+        if (entry_count + count > capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            entry* grown = realloc(entries, capacity * sizeof(entry));
+            if (grown == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                fs_unmount();
+                return 1;
+            }
+            entries = grown;
+        }
+        for (int i = 0; i < count; i++) {
+            entry* e = &entries[entry_count++];
+            memset(e, 0, sizeof(*e));
+            memcpy(e->name, page[i].name, MAX_FILENAME + 1);
+            e->size = page[i].size;
+        }
+    }
+
+    pthread_t workers[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, export_worker, NULL);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    int failed = 0;
+    long long bytes = 0;
+    for (int i = 0; i < entry_count; i++) {
+        if (entries[i].failed) {
+            fprintf(stderr, "Cannot export %s\n", entries[i].name);
+            failed++;
+        } else {
+            bytes += entries[i].size;
+        }
+    }
+    fs_unmount();
+    report("Exported", entry_count - failed, bytes, now_seconds() - start);
+    return failed > 0 ? 1 : 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s import <dir> <disk_path> [-t threads] [-b blocks] [-i inodes] [-s block_size]\n"
+                    "       %s export <disk_path> <dir> [-t threads]\n"
+                    "  -b and -i must be multiples of 64, -s a power of two from 1024 to 65536\n",
+            program, program);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4 || (strcmp(argv[1], "import") != 0 && strcmp(argv[1], "export") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    int importing = strcmp(argv[1], "import") == 0;
+    host_dir = importing ? argv[2] : argv[3];
+    const char* disk_path = importing ? argv[3] : argv[2];
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    int blocks = 0, inodes = 0, block_size = 0;
+    int opt;
+    optind = 4;
+    while ((opt = getopt(argc, argv, "t:b:i:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'b':
+            blocks = atoi(optarg);
+            break;
+        case 'i':
+            inodes = atoi(optarg);
+            break;
+        case 's':
+            block_size = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+
+    int result = importing ? import_directory(disk_path, threads, blocks, inodes, block_size)
+                           : export_image(disk_path, threads);
+    free(entries);
+    return result;
+}
@@ -0,0 +1,591 @@
+/**
+ * @file stress.c
+ * @brief Multithreaded stress test and scalability benchmark for the OnlyFiles filesystem
+ *
+ * For every thread count from 1 up to the number of online CPUs (doubling,
+ * and the maximum itself), this program formats a fresh disk image and runs
+ * that many threads at once. Each thread performs a random mix of
+ * operations:
+ * - fs_create and fs_delete of its own files, including the error cases
+ *   of creating a file that exists and deleting one that does not
+ * - fs_write, fs_pwrite and fs_append of its own files
+ * - fs_read, fs_pread and handle reads (fs_open, fs_hread) of its own files
+ * - fs_list_entries of its own files, with and without FS_LIST_SORTED
+ * - fs_write and fs_read of a few files that every thread shares
+ *
+ * Every thread keeps a copy of what its own files should contain and checks
+ * each read against it. A shared file always holds a header naming the
+ * content that follows it, so a read that sees parts of two writes is
+ * caught. Once the threads have finished, the content of every file and
+ * fs_check are verified, once on the mounted image and again after
+ * unmounting and mounting it.
+ *
+ * Each thread count reports the operations per second over all threads,
+ * the speedup over one thread and the scaling efficiency (speedup divided
+ * by threads). Any wrong result stops the program with exit status 1.
+ *
+ * By default all threads share one image and one context. With -c every
+ * thread gets its own image and context instead, so the two can be
+ * compared: contention inside one image against independent images.
+ *
+ * Usage: ./fs_stress [-t threads] [-n ops] [-f files] [-s size] [-m] [-w] [-D] [-z] [-c] [-d disk_path]
+ *   -t  maximum number of threads, default the number of online CPUs (at most MAX_THREADS)
+ *   -n  operations per thread for each thread count, default 10000
+ *   -f  files per thread, default 8
+ *   -s  maximum file size in bytes, default 16 blocks (64KB)
+ *   -m  mount with the mmap backend instead of pread
+ *   -w  mount with FS_MOUNT_WRITE_BEHIND
+ *   -D  mount with FS_MOUNT_DEDUP
+ *   -z  turn on compression for every file a thread creates
+ *   -c  give every thread its own image and context
+ *   -d  disk image to use, default stress.img; with -c, disk_path.0, disk_path.1, ...
+ */
+
+#include "fs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define MAX_PATH 256
+#define SHARED_FILES 4
+#define SHARED_HEADER 8 // seed and size at the start of every shared file
+#define LIST_PAGE 16    // entries per fs_list_entries call
+
+/**
+ * @brief What a thread expects one of its own files to hold
+ */
+typedef struct {
+    char name[MAX_FILENAME]; /**< Name of the file */
+    int exists;              /**< Set while the file should exist */
+    int size;                /**< Expected size in bytes */
+    char* content;           /**< Expected content, max_size bytes allocated */
+} model_file;
+
+/**
+ * @brief One worker thread
+ */
+typedef struct {
+    int id;              /**< Thread number, also part of its file names */
+    fs_context* fs;      /**< Context the thread works on */
+    uint32_t rng;        /**< State of the thread's random number generator */
+    model_file* files;   /**< The thread's own files */
+    char* buffer;        /**< Scratch space of max_size bytes for reads */
+    char* data;          /**< Scratch space of max_size bytes for writes */
+    long ops;            /**< Operations performed */
+} worker;
+
+static int num_files = 8;
+static int max_size = 16 * BLOCK_SIZE;
+static int ops_per_thread = 10000;
+static int use_compression = 0;
+static pthread_barrier_t start_barrier; // releases the workers together with the clock
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(int thread, const char* what, const char* name, int code)
+{
+    fprintf(stderr, "Stress test failed: thread %d, %s of %s (code: %d)\n", thread, what, name, code);
+    exit(1);
+}
+
+// xorshift32, one generator per thread so the threads do not share state
+static uint32_t next_random(worker* w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 17;
+    w->rng ^= w->rng << 5;
+    return w->rng;
+}
+
+// Random number from 0 to n - 1
+static int random_below(worker* w, int n)
+{
+    return (int)(next_random(w) % (uint32_t)n);
+}
+
+/**
+ * @brief Fills buf with content derived from seed
+ *
+ * Repeats with a period of a few hundred bytes, so files compress with -z,
+ * and differs between seeds, so mixed-up content does not go unnoticed.
+ */
+static void fill(char* buf, int size, uint32_t seed, int offset)
+{
+    int base = (int)(seed % 26), step = 1 + (int)(seed / 26 % 25);
+    for (int i = 0; i < size; i++) {
+        int at = offset + i;
+        buf[i] = (char)('a' + (base + (at >> 4) * step + at % 3) % 26);
+    }
+}
+
+// Random size from 1 to max_size, most of them small
+static int random_size(worker* w)
+{
+    int limit = random_below(w, 4) == 0 ? max_size : max_size / 8 + 1;
+    return 1 + random_below(w, limit);
+}
+
+static void shared_name(char* name, int i)
+{
+    snprintf(name, MAX_FILENAME, "shared_%d", i);
+}
+
+/**
+ * @brief Writes a shared file whole: a header with seed and size, then content from seed
+ */
+static void write_shared(worker* w, const char* name)
+{
+    uint32_t seed = next_random(w);
+    int size = SHARED_HEADER + random_size(w);
+    size = size < max_size ? size : max_size;
+    memcpy(w->data, &seed, 4);
+    memcpy(w->data + 4, &size, 4);
+    fill(w->data + SHARED_HEADER, size - SHARED_HEADER, seed, 0);
+    int result = fsc_write(w->fs, name, w->data, size);
+    if (result != 0) {
+        fail(w->id, "fs_write", name, result);
+    }
+}
+
+/**
+ * @brief Reads a shared file and checks it holds exactly one write
+ */
+static void check_shared(worker* w, const char* name)
+{
+    int result = fsc_read(w->fs, name, w->buffer, max_size);
+    if (result < SHARED_HEADER) {
+        fail(w->id, "fs_read", name, result);
+    }
+    uint32_t seed;
+    int size;
+    memcpy(&seed, w->buffer, 4);
+    memcpy(&size, w->buffer + 4, 4);
+    if (size < SHARED_HEADER || size > max_size) {
+        fail(w->id, "a torn fs_read", name, size);
+    }
+    fill(w->data, size - SHARED_HEADER, seed, 0);
+    if (size != result || memcmp(w->buffer + SHARED_HEADER, w->data, size - SHARED_HEADER) != 0) {
+        fail(w->id, "a torn fs_read", name, result);
+    }
+}
+
+// Compare size bytes read from a file at offset with what it should hold
+static void check_content(worker* w, const model_file* f, const char* what, int result, int offset, int size)
+{
+    int expected = f->size - offset < size ? f->size - offset : size;
+    expected = expected > 0 ? expected : 0;
+    if (result != expected) {
+        fail(w->id, what, f->name, result);
+    }
+    if (memcmp(w->buffer, f->content + offset, expected) != 0) {
+        fail(w->id, what, f->name, -100); // Wrong content
+    }
+}
+
+// Reads a file back with a handle, a random number of bytes at a time
+static void check_with_handle(worker* w, const model_file* f)
+{
+    int fd = fsc_open(w->fs, f->name);
+    if (fd < 0) {
+        fail(w->id, "fs_open", f->name, fd);
+    }
+    int position = 0, result;
+    do {
+        int chunk = 1 + random_below(w, 2 * BLOCK_SIZE);
+        result = fsc_hread(w->fs, fd, w->buffer, chunk);
+        check_content(w, f, "fs_hread", result, position, chunk);
+        position += result;
+    } while (result > 0);
+    result = fsc_close(w->fs, fd);
+    if (result != 0) {
+        fail(w->id, "fs_close", f->name, result);
+    }
+}
+
+/**
+ * @brief Lists the thread's own files and checks names and sizes against the model
+ */
+static void check_listing(worker* w, int flags)
+{
+    char prefix[MAX_FILENAME];
+    snprintf(prefix, sizeof(prefix), "t%d_", w->id);
+    fs_list_cursor cursor = FS_LIST_CURSOR_INIT;
+    fs_dirent entries[LIST_PAGE];
+    int found = 0, expected = 0, result;
+    char last[MAX_FILENAME + 1] = "";
+    while ((result = fsc_list_entries(w->fs, &cursor, prefix, flags | FS_LIST_SIZES, entries, LIST_PAGE)) > 0) {
+        for (int i = 0; i < result; i++) {
+            int k = atoi(entries[i].name + strlen(prefix));
+            if (k < 0 || k >= num_files || strcmp(entries[i].name, w->files[k].name) != 0
+                || !w->files[k].exists || entries[i].size != w->files[k].size) {
+                fail(w->id, "fs_list_entries", entries[i].name, entries[i].size);
+            }
+            if ((flags & FS_LIST_SORTED) && strcmp(last, entries[i].name) >= 0) {
+                fail(w->id, "a sorted fs_list_entries", entries[i].name, 0);
+            }
+            strcpy(last, entries[i].name);
+            found++;
+        }
+    }
+    for (int k = 0; k < num_files; k++) {
+        expected += w->files[k].exists;
+    }
+    if (result != 0 || found != expected) {
+        fail(w->id, "fs_list_entries", prefix, result < 0 ? result : found);
+    }
+}
+
+/**
+ * @brief Performs one random operation and checks its result
+ */
+static void random_op(worker* w)
+{
+    model_file* f = &w->files[random_below(w, num_files)];
+    int op = random_below(w, 100);
+    int result;
+
+    if (!f->exists && op < 62) {
+        op = 0; // Most operations need the file, so create it first
+    }
+    if (op < 6) {
+        result = fsc_create(w->fs, f->name);
+        if (result != (f->exists ? -1 : 0)) {
+            fail(w->id, "fs_create", f->name, result);
+        }
+        if (!f->exists && use_compression) {
+            result = fsc_set_compression(w->fs, f->name, 1);
+            if (result != 0) {
+                fail(w->id, "fs_set_compression", f->name, result);
+            }
+        }
+        if (!f->exists) {
+            f->exists = 1;
+            f->size = 0;
+        }
+    } else if (op < 20) {
+        int size = random_size(w);
+        fill(f->content, size, next_random(w), 0);
+        result = fsc_write(w->fs, f->name, f->content, size);
+        if (result != 0) {
+            fail(w->id, "fs_write", f->name, result);
+        }
+        f->size = size;
+    } else if (op < 28) {
+        int offset = random_below(w, (f->size < max_size ? f->size : max_size - 1) + 1);
+        int size = 1 + random_below(w, max_size - offset);
+        size = size < 2 * BLOCK_SIZE ? size : 2 * BLOCK_SIZE;
+        fill(w->data, size, next_random(w), offset);
+        result = fsc_pwrite(w->fs, f->name, w->data, size, offset);
+        if (result != 0) {
+            fail(w->id, "fs_pwrite", f->name, result);
+        }
+        memcpy(f->content + offset, w->data, size);
+        f->size = offset + size > f->size ? offset + size : f->size;
+    } else if (op < 32) {
+        int size = 1 + random_below(w, BLOCK_SIZE);
+        if (f->size + size <= max_size) {
+            fill(w->data, size, next_random(w), f->size);
+            result = fsc_append(w->fs, f->name, w->data, size);
+            if (result != 0) {
+                fail(w->id, "fs_append", f->name, result);
+            }
+            memcpy(f->content + f->size, w->data, size);
+            f->size += size;
+        }
+    } else if (op < 48) {
+        result = fsc_read(w->fs, f->name, w->buffer, max_size);
+        check_content(w, f, "fs_read", result, 0, max_size);
+    } else if (op < 58) {
+        int offset = random_below(w, f->size + 1);
+        int size = 1 + random_below(w, 2 * BLOCK_SIZE);
+        result = fsc_pread(w->fs, f->name, w->buffer, size, offset);
+        check_content(w, f, "fs_pread", result, offset, size);
+    } else if (op < 62) {
+        check_with_handle(w, f);
+    } else if (op < 70) {
+        result = fsc_delete(w->fs, f->name);
+        if (result != (f->exists ? 0 : -1)) {
+            fail(w->id, "fs_delete", f->name, result);
+        }
+        f->exists = 0;
+        f->size = 0;
+    } else if (op < 80) {
+        check_listing(w, op < 75 ? FS_LIST_SORTED : 0);
+    } else {
+        char name[MAX_FILENAME];
+        shared_name(name, random_below(w, SHARED_FILES));
+        if (op < 86) {
+            write_shared(w, name);
+        } else {
+            check_shared(w, name);
+        }
+    }
+    w->ops++;
+}
+
+static void* worker_main(void* arg)
+{
+    worker* w = arg;
+    pthread_barrier_wait(&start_barrier);
+    for (int i = 0; i < ops_per_thread; i++) {
+        random_op(w);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks every file of a thread, its listing and the shared files
+ */
+static void verify(worker* w)
+{
+    for (int k = 0; k < num_files; k++) {
+        model_file* f = &w->files[k];
+        int result = fsc_read(w->fs, f->name, w->buffer, max_size);
+        if (!f->exists) {
+            if (result != -1) {
+                fail(w->id, "fs_read of a deleted file", f->name, result);
+            }
+            continue;
+        }
+        check_content(w, f, "fs_read", result, 0, max_size);
+    }
+    check_listing(w, FS_LIST_SORTED);
+    for (int i = 0; i < SHARED_FILES; i++) {
+        char name[MAX_FILENAME];
+        shared_name(name, i);
+        check_shared(w, name);
+    }
+}
+
+// Blocks and inodes for an image holding the files of threads workers
+static void image_geometry(int threads, int* blocks, int* inodes)
+{
+    int files = threads * num_files + SHARED_FILES;
+    int per_file = (max_size + BLOCK_SIZE - 1) / BLOCK_SIZE + 3; // data and indirect blocks
+    *blocks = ((files * per_file + 1024) + 63) / 64 * 64;
+    *inodes = (files + 64 + 63) / 64 * 64;
+}
+
+// Formats a fresh image, creates the shared files and returns its context
+static fs_context* prepare_image(const char* path, int threads, int mode, worker* w)
+{
+    int blocks, inodes;
+    image_geometry(threads, &blocks, &inodes);
+    if (fs_format_geometry(path, blocks, inodes, BLOCK_SIZE) != 0) {
+        fail(-1, "fs_format_geometry", path, -1);
+    }
+    fs_context* fs = fsc_mount(path, mode);
+    if (fs == NULL) {
+        fail(-1, "fsc_mount", path, -1);
+    }
+    w->fs = fs;
+    for (int i = 0; i < SHARED_FILES; i++) {
+        char name[MAX_FILENAME];
+        shared_name(name, i);
+        int result = fsc_create(fs, name);
+        if (result != 0) {
+            fail(-1, "fs_create", name, result);
+        }
+        write_shared(w, name);
+    }
+    return fs;
+}
+
+// Runs fs_check on a context, stopping on any inconsistency
+static void check_image(fs_context* fs, const char* path)
+{
+    int result = fsc_check(fs);
+    if (result != 0) {
+        fail(-1, "fs_check", path, result);
+    }
+}
+
+/**
+ * @brief Runs and verifies one thread count
+ *
+ * @return Operations per second over all threads
+ */
+static double run_threads(const char* disk_path, int mode, int separate, int threads)
+{
+    static worker workers[MAX_THREADS];
+    static char paths[MAX_THREADS][MAX_PATH];
+    pthread_t tids[MAX_THREADS];
+    int images = separate ? threads : 1;
+
+    for (int t = 0; t < threads; t++) {
+        worker* w = &workers[t];
+        w->id = t;
+        w->rng = 2654435761u * (uint32_t)(t + 1) + (uint32_t)threads;
+        w->ops = 0;
+        w->files = calloc(num_files, sizeof(model_file));
+        w->buffer = malloc(max_size);
+        w->data = malloc(max_size);
+        if (w->files == NULL || w->buffer == NULL || w->data == NULL) {
+            fail(t, "allocation", "", -1);
+        }
+        for (int k = 0; k < num_files; k++) {
+            snprintf(w->files[k].name, MAX_FILENAME, "t%d_%d", t, k);
+            w->files[k].content = malloc(max_size);
+            if (w->files[k].content == NULL) {
+                fail(t, "allocation", "", -1);
+            }
+        }
+    }
+    for (int i = 0; i < images; i++) {
+        if (separate) {
+            snprintf(paths[i], MAX_PATH, "%s.%d", disk_path, i);
+        } else {
+            snprintf(paths[i], MAX_PATH, "%s", disk_path);
+        }
+        prepare_image(paths[i], separate ? 1 : threads, mode, &workers[i]);
+    }
+    for (int t = 0; t < threads; t++) {
+        workers[t].fs = workers[separate ? t : 0].fs;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, worker_main, &workers[t]) != 0) {
+            fail(t, "pthread_create", "", -1);
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    double start = now_seconds();
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double seconds = now_seconds() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    // Verify on the mounted images, then again after mounting them anew
+    for (int pass = 0; pass < 2; pass++) {
+        for (int t = 0; t < threads; t++) {
+            verify(&workers[t]);
+        }
+        for (int i = 0; i < images; i++) {
+            check_image(workers[i].fs, paths[i]);
+            fsc_unmount(workers[i].fs);
+            workers[i].fs = pass == 0 ? fsc_mount(paths[i], mode) : NULL;
+            if (pass == 0 && workers[i].fs == NULL) {
+                fail(-1, "fsc_mount", paths[i], -1);
+            }
+        }
+        for (int t = 0; t < threads; t++) {
+            workers[t].fs = workers[separate ? t : 0].fs;
+        }
+    }
+
+    long ops = 0;
+    for (int t = 0; t < threads; t++) {
+        worker* w = &workers[t];
+        ops += w->ops;
+        for (int k = 0; k < num_files; k++) {
+            free(w->files[k].content);
+        }
+        free(w->files);
+        free(w->buffer);
+        free(w->data);
+    }
+    for (int i = 0; i < images; i++) {
+        remove(paths[i]);
+    }
+    return seconds > 0 ? ops / seconds : 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-n ops] [-f files] [-s size] [-m] [-w] [-D] [-z] [-c] [-d disk_path]\n", program);
+}
+
+int main(int argc, char* argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+    int mode = FS_MOUNT_PREAD;
+    int flags = 0;
+    int separate = 0;
+    const char* disk_path = "stress.img";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:f:s:mwDzcd:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            ops_per_thread = atoi(optarg);
+            break;
+        case 'f':
+            num_files = atoi(optarg);
+            break;
+        case 's':
+            max_size = atoi(optarg);
+            break;
+        case 'm':
+            mode = FS_MOUNT_MMAP;
+            break;
+        case 'w':
+            flags |= FS_MOUNT_WRITE_BEHIND;
+            break;
+        case 'D':
+            flags |= FS_MOUNT_DEDUP;
+            break;
+        case 'z':
+            use_compression = 1;
+            break;
+        case 'c':
+            separate = 1;
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "Thread count %d must be between 1 and %d.\n", max_threads, MAX_THREADS);
+        return 1;
+    }
+    if (num_files < 1 || num_files > 1000) {
+        fprintf(stderr, "File count %d must be between 1 and 1000.\n", num_files);
+        return 1;
+    }
+    if (max_size < 2 * SHARED_HEADER || max_size > (1 << 24)) {
+        fprintf(stderr, "File size %d must be between %d and %d.\n", max_size, 2 * SHARED_HEADER, 1 << 24);
+        return 1;
+    }
+    if (ops_per_thread < 1) {
+        ops_per_thread = 1;
+    }
+
+    printf("%d ops per thread, %d files per thread of up to %d bytes (%s backend%s%s%s, %s)\n",
+           ops_per_thread, num_files, max_size, mode == FS_MOUNT_MMAP ? "mmap" : "pread",
+           (flags & FS_MOUNT_WRITE_BEHIND) ? ", write-behind" : "", (flags & FS_MOUNT_DEDUP) ? ", dedup" : "",
+           use_compression ? ", compressed" : "", separate ? "one image per thread" : "one shared image");
+    printf("  threads %12s %9s %11s\n", "ops/s", "speedup", "efficiency");
+
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2) {
+        double rate = run_threads(disk_path, mode | flags, separate, threads);
+        if (threads == 1) {
+            single = rate;
+        }
+        double speedup = single > 0 ? rate / single : 0;
+        printf("  %7d %12.0f %8.2fx %10.0f%%\n", threads, rate, speedup, 100 * speedup / threads);
+    }
+    printf("All contents and fs_check verified.\n");
+    return 0;
+}
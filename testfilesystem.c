@@ -2,6 +2,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include "fs.h"
 
 /*
@@ -111,6 +113,303 @@ void init_filenames(char filenames_array[NUM_FILES][MAX_FILENAME])
 }
 
 
+/*
+============ FEATURE TESTS ============
+Each test formats and mounts its own disk and unmounts it when done.
+*/
+void expect(int condition, const char *what)
+{
+    if(!condition)
+    {
+        fprintf(stderr, "Test failed: %s\n", what);
+        exit(1);
+    }
+}
+
+void start_test(const char *disk_path)
+{
+    create_disk(disk_path);
+    if(fs_mount(disk_path) < 0)
+    {
+        fprintf(stderr, "Test failed: call to fs_mount failed.\n");
+        exit(1);
+    }
+}
+
+void test_long_names(const char *disk_path)
+{
+    const char *name = "abcdefghijklmnopqrstuvwxyz12"; // MAX_FILENAME characters, no terminator on disk
+    start_test(disk_path);
+    expect(fs_create(name) == 0, "fs_create of a 28-character name");
+    expect(fs_write(name, "long", 4) == 0, "fs_write of a 28-character name");
+    expect(fs_check() == 0, "fs_check with a 28-character name");
+    fs_unmount();
+    expect(fs_mount(disk_path) == 0, "fs_mount with a 28-character name");
+    expect(fs_check() == 0, "fs_check with a 28-character name after remount");
+    char buff[8];
+    expect(fs_read(name, buff, sizeof(buff)) == 4 && memcmp(buff, "long", 4) == 0, "fs_read of a 28-character name");
+
+    // Listings return the whole name, and a sorted listing ends
+    expect(fs_create("abc") == 0 && fs_create("abcdefghijklmnopqrstuvwxyz13") == 0, "fs_create");
+    int flags[2] = { 0, FS_LIST_SORTED };
+    for(int f = 0; f < 2; f++)
+    {
+        fs_list_cursor cursor = FS_LIST_CURSOR_INIT;
+        fs_dirent entry;
+        int found = 0, calls = 0, retval;
+        while((retval = fs_list_entries(&cursor, "abc", flags[f] | FS_LIST_SIZES, &entry, 1)) > 0 && calls++ < 10)
+        {
+            fs_stat_info info;
+            expect(fs_stat(entry.name, &info) == 0 && info.size == entry.size, "fs_stat of a listed name");
+            found += strcmp(entry.name, name) == 0;
+        }
+        expect(retval == 0 && calls == 3 && found == 1, "fs_list_entries of 28-character names");
+    }
+    fs_unmount();
+    printf("Long names work.\n");
+}
+
+void test_snapshots(const char *disk_path)
+{
+    static char old_data[20 * BLOCK_SIZE], new_data[20 * BLOCK_SIZE], buff[20 * BLOCK_SIZE];
+    for(int i = 0; i < (int)sizeof(old_data); i++)
+    {
+        old_data[i] = 'a' + i % 26;
+        new_data[i] = 'A' + i % 26;
+    }
+    start_test(disk_path);
+    expect(fs_create("kept") == 0 && fs_write("kept", old_data, sizeof(old_data)) == 0, "fs_write before fs_snapshot");
+    expect(fs_create("patched") == 0 && fs_write("patched", old_data, 3 * BLOCK_SIZE) == 0, "fs_write before fs_snapshot");
+    expect(fs_create("deleted") == 0 && fs_write("deleted", old_data, 5000) == 0, "fs_write before fs_snapshot");
+
+    int snap = fs_snapshot();
+    expect(snap >= 0, "fs_snapshot");
+    expect(fs_write("kept", new_data, 2 * BLOCK_SIZE) == 0, "fs_write after fs_snapshot");
+    expect(fs_pwrite("patched", "XYZ", 3, BLOCK_SIZE + 10) == 0, "fs_pwrite after fs_snapshot");
+    expect(fs_delete("deleted") == 0, "fs_delete after fs_snapshot");
+    expect(fs_create("added") == 0 && fs_write("added", new_data, 100) == 0, "fs_write after fs_snapshot");
+
+    // The live files changed, the snapshot still has the old bytes
+    expect(fs_read("kept", buff, sizeof(buff)) == 2 * BLOCK_SIZE && memcmp(buff, new_data, 2 * BLOCK_SIZE) == 0, "fs_read after fs_snapshot");
+    expect(fs_snapshot_pread(snap, "kept", buff, sizeof(buff), 0) == (int)sizeof(old_data) && memcmp(buff, old_data, sizeof(old_data)) == 0, "fs_snapshot_pread of a rewritten file");
+    expect(fs_snapshot_pread(snap, "patched", buff, 100, BLOCK_SIZE) == 100 && memcmp(buff, old_data + BLOCK_SIZE, 100) == 0, "fs_snapshot_pread of a patched file");
+    expect(fs_pread("patched", buff, 3, BLOCK_SIZE + 10) == 3 && memcmp(buff, "XYZ", 3) == 0, "fs_pread of a patched file");
+    expect(fs_snapshot_pread(snap, "deleted", buff, sizeof(buff), 0) == 5000 && memcmp(buff, old_data, 5000) == 0, "fs_snapshot_pread of a deleted file");
+    expect(fs_read("deleted", buff, sizeof(buff)) == -1, "fs_read of a deleted file");
+    expect(fs_snapshot_pread(snap, "added", buff, sizeof(buff), 0) == -1, "fs_snapshot_pread of a file created later");
+
+    fs_list_cursor cursor = FS_LIST_CURSOR_INIT;
+    fs_dirent entries[8];
+    int count = fs_snapshot_list(snap, &cursor, NULL, entries, 8);
+    expect(count == 3, "fs_snapshot_list");
+    for(int i = 0; i < count; i++)
+    {
+        expect(strcmp(entries[i].name, "added") != 0, "fs_snapshot_list of a file created later");
+    }
+    expect(fs_check() == 0, "fs_check with a snapshot");
+
+    expect(fs_snapshot_release(snap) == 0, "fs_snapshot_release");
+    expect(fs_snapshot_release(snap) == -1, "fs_snapshot_release of a released snapshot");
+    expect(fs_check() == 0, "fs_check after fs_snapshot_release");
+    expect(fs_write("kept", old_data, sizeof(old_data)) == 0 && fs_delete("patched") == 0, "fs_write after fs_snapshot_release");
+    expect(fs_check() == 0, "fs_check after fs_snapshot_release");
+    fs_unmount();
+    printf("Snapshots work.\n");
+}
+
+void test_batches(const char *disk_path)
+{
+    static char data[3 * BLOCK_SIZE];
+    static char buff[3 * BLOCK_SIZE];
+    for(int i = 0; i < (int)sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 19;
+    }
+    start_test(disk_path);
+    expect(fs_create("old") == 0, "fs_create");
+
+    // A name repeated in the batch is created once; existing names and bad names fail alone
+    const char *names[6] = { "one", "two", "one", "old", "", "three" };
+    const void *contents[6] = { data, data, data, data, data, NULL };
+    int sizes[6] = { 10, sizeof(data), 20, 30, 40, 0 };
+    int results[6];
+    int expected[6] = { 0, 0, -1, -1, -3, 0 };
+    expect(fs_create_many(names, contents, sizes, 6, results) == 3, "fs_create_many");
+    for(int i = 0; i < 6; i++)
+    {
+        expect(results[i] == expected[i], "fs_create_many result of an entry");
+    }
+    expect(fs_read("one", buff, sizeof(buff)) == 10 && memcmp(buff, data, 10) == 0, "fs_read of a file from fs_create_many");
+    expect(fs_read("two", buff, sizeof(buff)) == (int)sizeof(data) && memcmp(buff, data, sizeof(data)) == 0, "fs_read of a file from fs_create_many");
+    expect(fs_read("three", buff, sizeof(buff)) == 0, "fs_read of an empty file from fs_create_many");
+    expect(fs_read("old", buff, sizeof(buff)) == 0, "fs_create_many left an existing file alone");
+    expect(fs_check() == 0, "fs_check after fs_create_many");
+
+    // A name repeated in the batch is deleted once; missing names fail alone
+    const char *doomed[6] = { "one", "missing", "two", "one", "", "old" };
+    int deleted[6] = { 0, -1, 0, -1, -3, 0 };
+    expect(fs_delete_many(doomed, 6, results) == 3, "fs_delete_many");
+    for(int i = 0; i < 6; i++)
+    {
+        expect(results[i] == deleted[i], "fs_delete_many result of an entry");
+    }
+    expect(fs_read("one", buff, sizeof(buff)) == -1 && fs_read("two", buff, sizeof(buff)) == -1, "fs_read of a file from fs_delete_many");
+    expect(fs_read("three", buff, sizeof(buff)) == 0, "fs_delete_many left another file alone");
+    expect(fs_delete_many(doomed, 0, results) == 0, "fs_delete_many of no files");
+    expect(fs_check() == 0, "fs_check after fs_delete_many");
+    fs_unmount();
+    printf("Batches work.\n");
+}
+
+void test_handles(const char *disk_path)
+{
+    static char buff[3 * BLOCK_SIZE];
+    start_test(disk_path);
+    expect(fs_create("log") == 0, "fs_create");
+    int fd = fs_open("log");
+    expect(fd >= 0, "fs_open");
+    expect(fs_hwrite(fd, "hello", 5) == 0 && fs_hwrite(fd, " world", 6) == 0, "fs_hwrite");
+    expect(fs_hseek(fd, 0, SEEK_CUR) == 11, "fs_hseek to the current position");
+    expect(fs_hseek(fd, -5, SEEK_END) == 6, "fs_hseek relative to the end");
+    expect(fs_hread(fd, buff, sizeof(buff)) == 5 && memcmp(buff, "world", 5) == 0, "fs_hread after fs_hseek");
+    expect(fs_hread(fd, buff, sizeof(buff)) == 0, "fs_hread at the end of the file");
+    expect(fs_hseek(fd, -1, SEEK_SET) == -3 && fs_hseek(fd, -12, SEEK_END) == -3, "fs_hseek to a negative position");
+    expect(fs_hseek(fd, 0, SEEK_CUR) == 11, "a failed fs_hseek keeps the position");
+
+    // Writing past the end leaves a gap of zeros
+    expect(fs_hseek(fd, 2 * BLOCK_SIZE, SEEK_SET) == 2 * BLOCK_SIZE, "fs_hseek past the end of the file");
+    expect(fs_hwrite(fd, "tail", 4) == 0, "fs_hwrite past the end of the file");
+    expect(fs_read("log", buff, sizeof(buff)) == 2 * BLOCK_SIZE + 4, "fs_read after a gap");
+    expect(memcmp(buff, "hello world", 11) == 0 && memcmp(buff + 2 * BLOCK_SIZE, "tail", 4) == 0, "fs_read after a gap");
+    for(int i = 11; i < 2 * BLOCK_SIZE; i++)
+    {
+        expect(buff[i] == 0, "a gap reads as zeros");
+    }
+    expect(fs_check() == 0, "fs_check after fs_hwrite");
+
+    // A handle to a deleted file fails, also once the name is reused
+    expect(fs_delete("log") == 0 && fs_create("log") == 0, "fs_delete of an open file");
+    expect(fs_hread(fd, buff, sizeof(buff)) == -1, "fs_hread of a deleted file");
+    expect(fs_hwrite(fd, "x", 1) == -1, "fs_hwrite of a deleted file");
+    expect(fs_hseek(fd, 0, SEEK_SET) == -1, "fs_hseek of a deleted file");
+    expect(fs_read("log", buff, sizeof(buff)) == 0, "fs_read of a new file with a reused name");
+    expect(fs_close(fd) == 0 && fs_close(fd) == -3, "fs_close");
+    fs_unmount();
+    printf("Handles work.\n");
+}
+
+// Run a child that writes and syncs a file, then exits without fs_unmount
+void crash_after_sync(const char *disk_path, const char *data, int size)
+{
+    pid_t pid = fork();
+    expect(pid >= 0, "fork");
+    if(pid == 0)
+    {
+        if(fs_mount(disk_path) != 0 || fs_create("synced") != 0 || fs_write("synced", data, size) != 0 || fs_sync() != 0)
+        {
+            _exit(1);
+        }
+        // Changes after the last fs_sync may or may not survive the crash
+        fs_create("unsynced");
+        fs_write("unsynced", data, size / 2);
+        _exit(0);
+    }
+    int status;
+    expect(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "write and fs_sync before the crash");
+}
+
+// Mount after a crash and check the synced file; returns the transactions replayed
+unsigned long long mount_after_crash(const char *disk_path, const char *data, int size)
+{
+    static char buff[8 * BLOCK_SIZE];
+    fs_counters before, after;
+    fs_stats(&before);
+    expect(fs_mount(disk_path) == 0, "fs_mount after a crash");
+    fs_stats(&after);
+    expect(fs_check() == 0, "fs_check after a crash");
+    expect(fs_read("synced", buff, sizeof(buff)) == size && memcmp(buff, data, size) == 0, "fs_read of a synced file after a crash");
+    fs_unmount();
+    return after.journal_replays - before.journal_replays;
+}
+
+void test_crash_recovery(const char *disk_path)
+{
+    static char data[8 * BLOCK_SIZE];
+    for(int i = 0; i < (int)sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 23;
+    }
+
+    // The last committed transaction is replayed
+    create_disk(disk_path);
+    crash_after_sync(disk_path, data, sizeof(data));
+    expect(mount_after_crash(disk_path, data, sizeof(data)) == 1, "journal replay after a crash");
+
+    // A torn commit in the other journal slot falls back to the last complete one.
+    // A slot starts with a header of magic, sequence, length and checksum.
+    create_disk(disk_path);
+    crash_after_sync(disk_path, data, sizeof(data));
+    FILE *disk = fopen(disk_path, "r+b");
+    expect(disk != NULL, "open the disk image");
+    superblock sb;
+    unsigned int header[2][4];
+    expect(fread(&sb, sizeof(sb), 1, disk) == 1, "read the superblock");
+    for(int slot = 0; slot < 2; slot++)
+    {
+        fseek(disk, ((long)sb.journal_start + slot * (sb.journal_blocks / 2)) * sb.block_size, SEEK_SET);
+        expect(fread(header[slot], sizeof(header[slot]), 1, disk) == 1, "read a journal slot");
+    }
+    const unsigned int magic = 0x4c4e524a; // "JRNL"
+    int newest = header[1][0] == magic && (header[0][0] != magic || (int)(header[1][1] - header[0][1]) > 0);
+    unsigned int torn[4] = { magic, header[newest][1] + 1, 64, 0 }; // The checksum does not match
+    fseek(disk, ((long)sb.journal_start + (1 - newest) * (sb.journal_blocks / 2)) * sb.block_size, SEEK_SET);
+    expect(fwrite(torn, sizeof(torn), 1, disk) == 1 && fclose(disk) == 0, "write a torn journal slot");
+    expect(mount_after_crash(disk_path, data, sizeof(data)) == 1, "journal replay past a torn slot");
+    printf("Crash recovery works.\n");
+}
+
+// Read the file "big" until the filesystem is unmounted
+void *read_until_unmount(void *arg)
+{
+    char buff[8 * BLOCK_SIZE];
+    const char *data = arg;
+    for(;;)
+    {
+        int retval = fs_read("big", buff, sizeof(buff));
+        if(retval == -3)
+        {
+            return NULL; // Unmounted
+        }
+        expect(retval == (int)sizeof(buff) && memcmp(buff, data, sizeof(buff)) == 0, "fs_read during fs_unmount");
+    }
+}
+
+void test_unmount_with_readers(const char *disk_path)
+{
+    static char data[8 * BLOCK_SIZE];
+    for(int i = 0; i < (int)sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 29;
+    }
+    start_test(disk_path);
+    expect(fs_create("big") == 0 && fs_write("big", data, sizeof(data)) == 0, "fs_write before fs_unmount");
+
+    // fs_unmount waits for the reads in flight; later reads fail
+    pthread_t readers[4];
+    for(int i = 0; i < 4; i++)
+    {
+        expect(pthread_create(&readers[i], NULL, read_until_unmount, data) == 0, "pthread_create");
+    }
+    usleep(10000);
+    fs_unmount();
+    for(int i = 0; i < 4; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+    printf("Unmount with readers works.\n");
+}
+
+
 /*
 ============ MAIN FUNCTION ============
 This is the main function that runs the test.
@@ -190,9 +489,17 @@ int main(int argc, char *argv[])
     }
     
     printf("All files read successfully.\n");
-    printf("Success!\n");
 
     fs_unmount();
 
+    test_long_names("disk");
+    test_snapshots("disk");
+    test_batches("disk");
+    test_handles("disk");
+    test_crash_recovery("disk");
+    test_unmount_with_readers("disk");
+
+    printf("Success!\n");
+
     return 0;
 }
\ No newline at end of file